@@ -38,6 +38,7 @@
 /* Utility headers */
 #include "security.h"
 #include "testcases.h"
+#include "benchmarks.h"
 #include "nls.h"
 #include "print.h"
 
@@ -110,7 +111,7 @@ int do_verify_config(const char *agent_bin)
 	}
 
 
-	if (cfg->db != CONFIG_DB_GLOBAL) {
+	if (cfg->db != CONFIG_DB_GLOBAL && cfg->db != CONFIG_DB_BTREE) {
 		if ((st.st_mode & (S_ISUID | S_ISGID)) != 0) {
 			printf(_("ERROR: Agent binary (%s) in DB=user setting should NOT be SUID-root.\n"),
 			       agent_bin);
@@ -187,7 +188,8 @@ int do_verify_config(const char *agent_bin)
 
 	default:
 		printf(_("ERROR: Error while trying to load state: %s\n"), ppp_get_error_desc(ret));
-		printf(_("Check if you have %s\n"), cfg->global_db_path);
+		printf(_("Check if you have %s\n"),
+		       cfg->db == CONFIG_DB_BTREE ? cfg->btree_db_path : cfg->global_db_path);
 		ppp_state_fini(s);
 		return 13;
 	}	
@@ -282,6 +284,11 @@ int do_testcase(int fast)
 	if (tmp)
 		printf("******\n*** %d ppp testcases failed\n******\n", tmp);
 
+	tmp = db_testcase(fast);
+	failed += tmp;
+	if (tmp)
+		printf("******\n*** %d db testcases failed\n******\n", tmp);
+
 
 	if (failed) {
 		printf(("***********************************************\n"
@@ -304,6 +311,158 @@ int do_testcase(int fast)
 	return retval;
 }
 
+/* Maintenance of global database: conversion to fixed-width
+ * records or compaction of the journal.
+ * Has the same requirements as testcases. */
+int do_maintain_db(int compact)
+{
+	cfg_t *cfg;
+	int ret;
+
+	ret = ppp_init(PRINT_STDOUT, NULL);
+	if (ret != 0) {
+		(void) puts(ppp_get_error_desc(ret));
+		ppp_fini();
+		return 1;
+	}
+
+	cfg = cfg_get();
+	if (cfg->db != CONFIG_DB_GLOBAL) {
+		printf("Database maintenance is only required for DB=global.\n");
+		ppp_fini();
+		return 1;
+	}
+
+	ret = compact ? ppp_db_compact() : ppp_db_convert();
+	if (ret != 0)
+		printf("%s failed: %s\n", compact ? "Compaction" : "Conversion",
+		       ppp_get_error_desc(ret));
+	else
+		printf("Database %s %s.\n", cfg->global_db_path,
+		       compact ? "compacted" : "converted");
+
+	ppp_fini();
+	return ret != 0;
+}
+
+/* Split global database into given number of shards, or merge
+ * shards back into a single file for 0.
+ * Has the same requirements as testcases. */
+int do_reshard_db(const char *count)
+{
+	cfg_t *cfg;
+	char *end;
+	long shards;
+	int ret;
+
+	shards = strtol(count, &end, 10);
+	if (*count == '\0' || *end != '\0' ||
+	    shards < 0 || shards > CONFIG_MAX_SHARDS) {
+		printf("Number of shards must be between 0 and %d.\n",
+		       CONFIG_MAX_SHARDS);
+		return 1;
+	}
+
+	ret = ppp_init(PRINT_STDOUT, NULL);
+	if (ret != 0) {
+		(void) puts(ppp_get_error_desc(ret));
+		ppp_fini();
+		return 1;
+	}
+
+	cfg = cfg_get();
+	if (cfg->db != CONFIG_DB_GLOBAL) {
+		printf("Database maintenance is only required for DB=global.\n");
+		ppp_fini();
+		return 1;
+	}
+
+	ret = ppp_db_reshard(shards);
+	if (ret != 0)
+		printf("Resharding failed: %s\n", ppp_get_error_desc(ret));
+	else
+		printf("Database %s split into %ld shards. Set DB_SHARDS=%ld "
+		       "in config file now.\n", cfg->global_db_path,
+		       shards, shards);
+
+	ppp_fini();
+	return ret != 0;
+}
+
+/* Conversion of user state file between text and binary
+ * format. Has the same requirements as testcases. */
+int do_convert_state(const char *path, const char *format)
+{
+	int binary;
+	int ret;
+
+	if (strcmp(format, "binary") == 0) {
+		binary = 1;
+	} else if (strcmp(format, "text") == 0) {
+		binary = 0;
+	} else {
+		printf("Unknown state file format %s; use binary or text.\n",
+		       format);
+		return 1;
+	}
+
+	ret = ppp_init(PRINT_STDOUT, NULL);
+	if (ret != 0) {
+		(void) puts(ppp_get_error_desc(ret));
+		ppp_fini();
+		return 1;
+	}
+
+	ret = ppp_state_convert(path, binary);
+	if (ret != 0)
+		printf("Conversion failed: %s\n", ppp_get_error_desc(ret));
+	else
+		printf("State file %s converted to %s format.\n", path, format);
+
+	ppp_fini();
+	return ret != 0;
+}
+
+/* Benchmarks have the same requirements as testcases */
+int do_benchmark(int fast)
+{
+	cfg_t *cfg;
+	int retval;
+	int failed = 0;
+
+	printf("*** Running benchmarks\n");
+
+	retval = ppp_init(PRINT_STDOUT, NULL);
+	if (retval != 0) {
+		(void) puts(ppp_get_error_desc(retval));
+		printf("Benchmarking failed:\n");
+		printf("OTPasswd not correctly installed.\n");
+		ppp_fini();
+		return 1;
+	}
+
+	/* Will succeed, as ppp_init suceeded */
+	cfg = cfg_get();
+
+	/* Never touch real user data */
+	strcpy(cfg->user_db_path, ".otpasswd_testcase");
+	strcpy(cfg->global_db_path, "/tmp/otshadow_testcase");
+	cfg->db = CONFIG_DB_USER;
+
+	failed += ppp_benchmark(fast);
+	failed += db_benchmark(fast);
+
+	if (failed) {
+		printf("*** %d errors during benchmarks\n", failed);
+		retval = 1;
+	} else {
+		retval = 0;
+	}
+
+	ppp_fini();
+	return retval;
+}
+
 /** Marks end of initialization (succeeded or not) */
 int send_init_reply(agent *a, int status, int error_code) 
 {
@@ -379,6 +538,36 @@ int main(int argc, char **argv)
 			}
 		}
 
+		if (argc >= 2 && strcmp(argv[1], "--benchmark") == 0) {
+			if (security_is_suid() == 0 || security_is_privileged()) {
+				int fast = 0;
+				if (argc == 3 && strcmp(argv[2], "--fast") == 0) {
+					fast = 1;
+				}
+				return do_benchmark(fast);
+			}
+		}
+
+		if (argc == 2 && (strcmp(argv[1], "--convert-db") == 0 ||
+				  strcmp(argv[1], "--compact-db") == 0)) {
+			if (!security_is_suid() || security_is_privileged()) {
+				return do_maintain_db(
+					strcmp(argv[1], "--compact-db") == 0);
+			}
+		}
+
+		if (argc == 3 && strcmp(argv[1], "--reshard-db") == 0) {
+			if (!security_is_suid() || security_is_privileged()) {
+				return do_reshard_db(argv[2]);
+			}
+		}
+
+		if (argc == 4 && strcmp(argv[1], "--convert-state") == 0) {
+			if (!security_is_suid() || security_is_privileged()) {
+				return do_convert_state(argv[2], argv[3]);
+			}
+		}
+
 		if (argc == 2 && strcmp(argv[1], "--check-config") == 0) {
 			if (!security_is_suid() || security_is_privileged()) {
 				/* We're not suid or we are root already */
@@ -391,8 +580,13 @@ int main(int argc, char **argv)
 
 		if (!security_is_suid()) {
 			printf("Since this program is not SUID you can run\n"
-			       "a set of testcases with --testcase option and check\n"
-			       "config file propriety with --check-config\n");
+			       "a set of testcases with --testcase option, benchmarks\n"
+			       "with --benchmark, check config file propriety\n"
+			       "with --check-config, convert global database\n"
+			       "to fixed-width records with --convert-db, apply\n"
+			       "its journal and sort it with --compact-db, split it\n"
+			       "into N files with --reshard-db N and convert a user\n"
+			       "state file with --convert-state <file> binary|text\n");
 		} else {
 			if (security_is_privileged()) {
 				printf("Since you're running this program as root you can\n"
@@ -482,10 +676,11 @@ int main(int argc, char **argv)
 
 	/* 4) We must drop permissions now.
 	 * If DB=user - drop to the user who called us.
-	 * If DB=global - drop to cfg->user_uid
+	 * If DB=global or btree - drop to cfg->user_uid
 	 */
 	switch (cfg->db) {
 	case CONFIG_DB_GLOBAL:
+	case CONFIG_DB_BTREE:
 		/* Drop root permanently to the cfg->user_uid 
 		 * We do this even if we are run as root. */
 		security_permanent_switch(cfg->user_uid, cfg->user_gid);
@@ -0,0 +1,557 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "benchmarks.h"
+
+#define PPP_INTERNAL 1
+#include "ppp.h"
+
+#include "security.h"
+#include "db.h"
+
+/***************************
+ * Helpers
+ **************************/
+static double _bench_now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void _bench_report(const char *name, unsigned long count,
+			  double elapsed, const char *unit)
+{
+	if (elapsed <= 0.0)
+		elapsed = 0.000001;
+	printf("%-40s %10lu %-10s %8.3fs %12.0f/s\n",
+	       name, count, unit, elapsed, count / elapsed);
+}
+
+/***************************
+ * Passcode generation
+ **************************/
+
+/* Passcode generation as done before the key schedule was cached
+ * in state: every code expands the key again. */
+static int _bench_passcode_uncached(const state *s, num_t counter, char *passcode)
+{
+	unsigned char cnt_bin[16], cipher_bin[16];
+	const char *alphabet = NULL;
+	num_t cipher;
+	int alphabet_len;
+	int i;
+
+	ppp_add_salt(s, &counter);
+	num_export(counter, (char *)cnt_bin, NUM_FORMAT_BIN);
+	if (crypto_aes_encrypt(s->sequence_key, cnt_bin, cipher_bin) != 0)
+		return 1;
+	num_import(&cipher, (char *)cipher_bin, NUM_FORMAT_BIN);
+
+	ppp_alphabet_get(s->alphabet, &alphabet);
+	alphabet_len = strlen(alphabet);
+	for (i = 0; i < s->code_length; i++) {
+		const uint64_t r = num_div_i(&cipher, cipher, alphabet_len);
+		passcode[i] = alphabet[r];
+	}
+	passcode[i] = '\0';
+	return 0;
+}
+
+/* Passcodes per ppp_get_passcodes call; a card holds about this many */
+#define _BENCH_BATCH 70
+
+int ppp_benchmark(int fast)
+{
+	const unsigned long codes = fast ? 2000 : 200000;
+	const unsigned char key[32] = "OTPasswd benchmark key.";
+	char passcode[17] = {0};
+	char *current_user = security_get_calling_user();
+	unsigned long i;
+	double start;
+	int failed = 0;
+	state s;
+
+	printf("*** Passcode generation benchmark\n");
+
+	if (state_init(&s, current_user) != 0) {
+		printf("Unable to initialize state\n");
+		free(current_user);
+		return 1;
+	}
+	free(current_user);
+
+	memcpy(s.sequence_key, key, sizeof(key));
+	state_key_update(&s);
+	s.code_length = 4;
+	s.alphabet = 1;
+	ppp_calculate(&s);
+
+	/* Raw AES */
+	{
+		unsigned char block[16] = {0};
+		start = _bench_now();
+		for (i = 0; i < codes; i++) {
+			block[0] = i;
+			crypto_aes_encrypt(key, block, block);
+		}
+		_bench_report("AES-256 with key expansion per block",
+			      codes, _bench_now() - start, "blocks");
+
+		start = _bench_now();
+		for (i = 0; i < codes; i++) {
+			block[0] = i;
+			crypto_aes_encrypt_ctx(&s.key_ctx, block, block);
+		}
+		_bench_report("AES-256 with cached key schedule",
+			      codes, _bench_now() - start, "blocks");
+	}
+
+	/* Multi-block runs on each available backend */
+	{
+		const int backends[] = {
+			CRYPTO_AES_TABLE, CRYPTO_AES_BITSLICE, CRYPTO_AES_AESNI,
+			CRYPTO_AES_OPENSSL
+		};
+		unsigned char blocks[PPP_BATCH_BLOCKS * 16] = {0};
+		char name[60];
+		crypto_aes_ctx ctx;
+		int b;
+
+		for (b = 0; b < (int)(sizeof(backends)/sizeof(*backends)); b++) {
+			if (crypto_aes_set_backend(backends[b]) != 0)
+				continue;
+			crypto_aes_init(&ctx, key);
+
+			start = _bench_now();
+			for (i = 0; i < codes; i += PPP_BATCH_BLOCKS) {
+				blocks[0] = i;
+				crypto_aes_encrypt_blocks(&ctx, blocks, blocks,
+							  PPP_BATCH_BLOCKS);
+			}
+			snprintf(name, sizeof(name), "AES-256 %s, %d block runs",
+				 crypto_aes_backend_name(backends[b]),
+				 PPP_BATCH_BLOCKS);
+			_bench_report(name, i, _bench_now() - start, "blocks");
+
+			crypto_aes_clear(&ctx);
+		}
+		crypto_aes_set_backend(CRYPTO_AES_AUTO);
+	}
+
+	/* Whole passcodes */
+	start = _bench_now();
+	for (i = 0; i < codes; i++) {
+		if (_bench_passcode_uncached(&s, num_i(i), passcode) != 0)
+			failed++;
+	}
+	_bench_report("Passcodes, key expanded per code (old)",
+		      codes, _bench_now() - start, "passcodes");
+
+	start = _bench_now();
+	for (i = 0; i < codes; i++) {
+		if (ppp_get_passcode(&s, num_i(i), passcode) != 0)
+			failed++;
+	}
+	_bench_report("Passcodes, ppp_get_passcode",
+		      codes, _bench_now() - start, "passcodes");
+
+	/* Batches of card size */
+	{
+		char batch[_BENCH_BATCH * 17];
+		start = _bench_now();
+		for (i = 0; i < codes; i += _BENCH_BATCH) {
+			if (ppp_get_passcodes(&s, num_i(i), _BENCH_BATCH, batch) != 0)
+				failed++;
+		}
+		_bench_report("Passcodes, ppp_get_passcodes",
+			      i, _bench_now() - start, "passcodes");
+	}
+
+	/* Conversion alone, with and without vector instructions */
+	{
+		const char *level_names[] = { "scalar", "SSE2", "AVX2" };
+		const ppp_alphabet_t *alphabet = ppp_alphabet_desc(2);
+		const ppp_kernel_t *kernel = ppp_kernel_select(alphabet->length, 16);
+		const int best = ppp_simd_available();
+		unsigned char cipher_bin[PPP_BATCH_BLOCKS * 16];
+		char batch[PPP_BATCH_BLOCKS * 17];
+		char name[60];
+		int level;
+
+		crypto_file_rng("/dev/urandom", NULL, cipher_bin, sizeof(cipher_bin));
+
+		for (level = PPP_SIMD_NONE; level <= best; level++) {
+			ppp_simd_set(level);
+			start = _bench_now();
+			for (i = 0; i < codes; i += PPP_BATCH_BLOCKS) {
+				cipher_bin[0] = i;
+				ppp_convert_blocks(kernel, alphabet, 16, cipher_bin,
+						   PPP_BATCH_BLOCKS, batch, 17);
+			}
+			snprintf(name, sizeof(name), "Conversion %s, base %d, 16 chars",
+				 level_names[level], alphabet->length);
+			_bench_report(name, i, _bench_now() - start, "passcodes");
+		}
+		ppp_simd_set(best);
+	}
+
+	state_fini(&s);
+	return failed;
+}
+
+/***************************
+ * Database
+ **************************/
+
+/* Fork a process dirtying page cache of the filesystem
+ * holding path, as busy hosts do with logs and builds. */
+static pid_t _bench_writer_start(const char *path)
+{
+	static char chunk[1 << 20];
+	pid_t pid;
+	int fd, i;
+
+	pid = fork();
+	if (pid != 0)
+		return pid;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		_exit(1);
+
+	memset(chunk, 'x', sizeof(chunk));
+	/* Wrap at 64MB to limit used space */
+	for (i = 0; ; i++) {
+		if (i == 64) {
+			lseek(fd, 0, SEEK_SET);
+			i = 0;
+		}
+		if (write(fd, chunk, sizeof(chunk)) < 0)
+			_exit(1);
+	}
+}
+
+static void _bench_writer_stop(pid_t pid, const char *path)
+{
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	unlink(path);
+}
+
+/* Lock, store and unlock state the way each login does */
+static int _bench_store(state *s, const char *name, int stores, int old_sync)
+{
+	double start, elapsed, total = 0.0, max = 0.0;
+	int failed = 0;
+	int i;
+
+	for (i = 0; i < stores; i++) {
+		s->counter = num_add(s->counter, num_i(1));
+
+		/* Database is in a temporary directory; CONFIG_DIR
+		 * might not be ours, so its checks are skipped */
+		s->db_permissions = 0;
+
+		start = _bench_now();
+		if (state_lock(s) != 0) {
+			failed++;
+			continue;
+		}
+		if (old_sync)
+			sync();
+		if (state_store(s, 0) != 0)
+			failed++;
+		state_unlock(s);
+		elapsed = _bench_now() - start;
+
+		total += elapsed;
+		if (elapsed > max)
+			max = elapsed;
+	}
+
+	printf("%-40s %10d %-10s avg %8.3fms max %8.3fms\n",
+	       name, stores, "stores", total * 1000.0 / stores, max * 1000.0);
+	return failed;
+}
+
+/* Decode entry of given format many times */
+static int _bench_decode(state *s, int binary, unsigned long count)
+{
+	char entry[STATE_ENTRY_SIZE];
+	char copy[STATE_ENTRY_SIZE];
+	double start;
+	unsigned long i;
+	int length;
+	int failed = 0;
+
+	length = db_file_entry_encode(s, entry, sizeof(entry), binary);
+	if (length < 0)
+		return 1;
+
+	start = _bench_now();
+	for (i = 0; i < count; i++) {
+		/* Text entry is modified while parsed */
+		memcpy(copy, entry, length);
+		if (db_file_entry_decode(s, copy, length, NULL) != 0)
+			failed++;
+	}
+	_bench_report(binary ? "Decode binary record (v3)" :
+		      "Parse text entry (v1)", count,
+		      _bench_now() - start, "entries");
+
+	memset(entry, 0, sizeof(entry));
+	memset(copy, 0, sizeof(copy));
+	return failed;
+}
+
+/* Fork writers, each updating counter of its own user in global
+ * database the way each login does. Returns number of failures. */
+static int _bench_group_writers(int writers, int updates, const char *title)
+{
+	char name[40];
+	double start;
+	int failed = 0;
+	int i, j, status;
+	state s;
+
+	start = _bench_now();
+	for (i = 0; i < writers; i++) {
+		if (fork() != 0)
+			continue;
+
+		snprintf(name, sizeof(name), "bench%d", i);
+		if (state_init(&s, name) != 0)
+			_exit(updates);
+		for (j = 0; j < updates; j++) {
+			s.db_permissions = 0;
+			if (state_lock(&s) != 0) {
+				failed++;
+				continue;
+			}
+			if (state_load(&s) != 0) {
+				failed++;
+			} else {
+				s.counter = num_add(s.counter, num_i(1));
+				if (state_store(&s, 0) != 0)
+					failed++;
+			}
+			state_unlock(&s);
+		}
+		state_fini(&s);
+		_exit(failed > 255 ? 255 : failed);
+	}
+
+	for (i = 0; i < writers; i++) {
+		if (wait(&status) == -1 || !WIFEXITED(status))
+			failed++;
+		else
+			failed += WEXITSTATUS(status);
+	}
+
+	_bench_report(title, (unsigned long)writers * updates,
+		      _bench_now() - start, "stores");
+	return failed;
+}
+
+/* Files of global database removed after benchmark */
+static const char *_bench_db_suffixes[] = { "", ".idx", ".jnl", ".lck", ".tmp", NULL };
+
+/* Create empty global database */
+static int _bench_db_create(const char *path)
+{
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		printf("Unable to create benchmark database\n");
+		return 1;
+	}
+	close(fd);
+	return 0;
+}
+
+static void _bench_db_remove(const char *db)
+{
+	char path[CONFIG_PATH_LEN + 16];
+	int i;
+
+	for (i = 0; _bench_db_suffixes[i]; i++) {
+		snprintf(path, sizeof(path), "%s%s", db, _bench_db_suffixes[i]);
+		unlink(path);
+	}
+}
+
+/* Throughput of concurrent durable updates of global database
+ * with and without group commit */
+static int _bench_group_commit(const char *dir, int fast)
+{
+	const int max_writers = 16;
+	const int updates = fast ? 10 : 100;
+	const unsigned char key[32] = "OTPasswd benchmark key.";
+	cfg_t *cfg = cfg_get();
+	const cfg_t saved = *cfg;
+	char title[64];
+	int failed = 0;
+	int writers, group, i;
+	state s;
+
+	printf("*** Global database group commit benchmark\n");
+
+	cfg->db = CONFIG_DB_GLOBAL;
+	cfg->db_durability = CONFIG_DURABILITY_FULL;
+	cfg->db_journal = 0;
+	cfg->db_lease = 0;
+	cfg->db_shards = 0;
+	cfg->user_uid = getuid();
+	cfg->user_gid = getgid();
+	snprintf(cfg->global_db_path, sizeof(cfg->global_db_path),
+		 "%s/otshadow.group", dir);
+
+	/* Database must exist before first store */
+	if (_bench_db_create(cfg->global_db_path) != 0) {
+		*cfg = saved;
+		return 1;
+	}
+
+	for (i = 0; i < max_writers; i++) {
+		snprintf(title, sizeof(title), "bench%d", i);
+		if (state_init(&s, title) != 0) {
+			failed++;
+			continue;
+		}
+		memcpy(s.sequence_key, key, sizeof(key));
+		state_key_update(&s);
+		s.db_permissions = 0;
+		if (state_lock(&s) != 0 || state_store(&s, 0) != 0)
+			failed++;
+		state_unlock(&s);
+		state_fini(&s);
+	}
+
+	for (group = 0; failed == 0 && group <= 1; group++) {
+		cfg->db_group_commit = group ? CONFIG_ENABLED : CONFIG_DISABLED;
+		for (writers = 1; writers <= max_writers; writers *= 2) {
+			snprintf(title, sizeof(title), "%2d writers, group commit %s",
+				 writers, group ? "on" : "off");
+			failed += _bench_group_writers(writers, updates, title);
+		}
+	}
+
+	_bench_db_remove(cfg->global_db_path);
+
+	*cfg = saved;
+	return failed;
+}
+
+int db_benchmark(int fast)
+{
+	const int stores = fast ? 5 : 50;
+	const unsigned char key[32] = "OTPasswd benchmark key.";
+	char *current_user = security_get_calling_user();
+	cfg_t *cfg = cfg_get();
+	const cfg_t saved = *cfg;
+	char dir[] = "/tmp/otpasswd_bench_XXXXXX";
+	char load_path[sizeof(dir) + 16];
+	int failed = 0;
+	pid_t writer;
+	state s;
+
+	printf("*** Database store latency benchmark\n");
+
+	/* Every file of benchmark goes there, never to the home */
+	if (mkdtemp(dir) == NULL) {
+		printf("Unable to create benchmark directory\n");
+		free(current_user);
+		return 1;
+	}
+	snprintf(load_path, sizeof(load_path), "%s/load", dir);
+
+	cfg->db = CONFIG_DB_GLOBAL;
+	cfg->db_journal = 0;
+	cfg->db_lease = 0;
+	cfg->db_shards = 0;
+	cfg->user_uid = getuid();
+	cfg->user_gid = getgid();
+	snprintf(cfg->global_db_path, sizeof(cfg->global_db_path),
+		 "%s/otshadow", dir);
+
+	if (_bench_db_create(cfg->global_db_path) != 0 ||
+	    state_init(&s, current_user) != 0) {
+		printf("Unable to initialize state\n");
+		free(current_user);
+		failed = 1;
+		goto end;
+	}
+	free(current_user);
+
+	memcpy(s.sequence_key, key, sizeof(key));
+	state_key_update(&s);
+
+	/* Parsing is done on each load */
+	s.counter = num_i(123456789);
+	strcpy(s.label, "benchmark label");
+	strcpy(s.contact, "bench@example.com");
+	failed += _bench_decode(&s, 0, fast ? 10000 : 500000);
+	failed += _bench_decode(&s, 1, fast ? 10000 : 500000);
+
+	cfg->db_durability = CONFIG_DURABILITY_NONE;
+	failed += _bench_store(&s, "Store, durability=none", stores, 0);
+	cfg->db_durability = CONFIG_DURABILITY_FULL;
+	failed += _bench_store(&s, "Store, durability=full", stores, 0);
+
+	/* Background writes go to the filesystem of database */
+	writer = _bench_writer_start(load_path);
+	if (writer == -1) {
+		printf("Unable to start background writer\n");
+		failed++;
+	} else {
+		/* Let dirty pages accumulate */
+		usleep(fast ? 100000 : 1000000);
+
+		cfg->db_durability = CONFIG_DURABILITY_NONE;
+		failed += _bench_store(&s, "Store under load, durability=none",
+				       stores, 0);
+		failed += _bench_store(&s, "Store under load, sync() (old)",
+				       stores, 1);
+		cfg->db_durability = CONFIG_DURABILITY_FULL;
+		failed += _bench_store(&s, "Store under load, durability=full",
+				       stores, 0);
+
+		_bench_writer_stop(writer, load_path);
+	}
+	cfg->db_durability = saved.db_durability;
+
+	state_fini(&s);
+
+	failed += _bench_group_commit(dir, fast);
+
+end:
+	_bench_db_remove(cfg->global_db_path);
+	*cfg = saved;
+	rmdir(dir);
+	return failed;
+}
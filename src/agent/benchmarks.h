@@ -0,0 +1,32 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Internal benchmarks of OTPasswd. Measure throughput of the hot
+ *   paths (passcode generation, DB access) so that optimizations can
+ *   be compared against the previous implementation.
+ **********************************************************************/
+
+#ifndef _BENCHMARKS_H_
+#define _BENCHMARKS_H_
+
+/* Benchmarks used by agent --benchmark */
+
+extern int ppp_benchmark(int fast);
+extern int db_benchmark(int fast);
+
+#endif
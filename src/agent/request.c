@@ -815,14 +815,10 @@ static int request_execute(agent *a, const cfg_t *cfg)
 		if (!a->s) {
 			ret = AGENT_ERR_NO_STATE;
 		} else {
-			ret = ppp_increment(a->s);
-			if (ret == 0) {
-				ret = ppp_authenticate(a->s, r_str); /* Done atomically */
-				if (ret != 0) {
-					print(PRINT_NOTICE, "CLI authentication failed.\n");
-				}
-			} else {
-				print(PRINT_NOTICE, "Agent: ppp_increment failed.\n");
+			/* Done atomically */
+			ret = ppp_increment_authenticate(a->s, r_str);
+			if (ret != 0) {
+				print(PRINT_NOTICE, "CLI authentication failed.\n");
 			}
 		}
 		_send_reply(a, ret);
@@ -17,6 +17,8 @@
  **********************************************************************/
 
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 
 #include "testcases.h"
 
@@ -24,6 +26,12 @@
 #include "ppp.h"
 
 #include "security.h"
+#include "db.h"
+#include "db_btree.h"
+#include "db_index.h"
+#include "db_journal.h"
+#include "db_lease.h"
+#include "db_record.h"
 
 /***************************
  * Crypto/NUM Testcases
@@ -77,6 +85,97 @@ int crypto_testcase(void)
 	}
 	printf("\n");
 
+	/* Expanded key must give the same result */
+	{
+		const unsigned char ctx_plain[] = "To be encrypted.";
+		crypto_aes_ctx ctx;
+		crypto_aes_init(&ctx, key);
+		crypto_aes_encrypt_ctx(&ctx, ctx_plain, encrypted);
+		crypto_aes_clear(&ctx);
+
+		printf("crypto_aes_test (ctx) [ 3]: ");
+		if (memcmp(encrypted, encrypted_origin, 16) != 0) {
+			printf("FAILED\n");
+			crypto_print_hex(encrypted, 16);
+			failed++;
+		} else {
+			printf("PASSED\n");
+		}
+	}
+
+	/* Every AES backend available on this CPU must pass known
+	 * answers and agree with table implementation on multi-block runs */
+	{
+		/* FIPS-197, Appendix C.3 */
+		const unsigned char fips_key[32] =
+			"\x00\x01\x02\x03\x04\x05\x06\x07"
+			"\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f"
+			"\x10\x11\x12\x13\x14\x15\x16\x17"
+			"\x18\x19\x1a\x1b\x1c\x1d\x1e\x1f";
+		const unsigned char fips_plain[16] =
+			"\x00\x11\x22\x33\x44\x55\x66\x77"
+			"\x88\x99\xaa\xbb\xcc\xdd\xee\xff";
+		const unsigned char fips_cipher[16] =
+			"\x8e\xa2\xb7\xca\x51\x67\x45\xbf"
+			"\xea\xfc\x49\x90\x4b\x49\x60\x89";
+		const unsigned char ctx_plain[] = "To be encrypted.";
+		const int backends[] = {
+			CRYPTO_AES_TABLE, CRYPTO_AES_BITSLICE, CRYPTO_AES_AESNI,
+			CRYPTO_AES_OPENSSL
+		};
+		unsigned char blocks_plain[7 * 16];
+		unsigned char blocks_ref[7 * 16], blocks_enc[7 * 16];
+		crypto_aes_ctx ctx;
+		int b;
+
+		crypto_file_rng("/dev/urandom", NULL, blocks_plain, sizeof(blocks_plain));
+
+		crypto_aes_set_backend(CRYPTO_AES_TABLE);
+		crypto_aes_init(&ctx, key);
+		crypto_aes_encrypt_blocks(&ctx, blocks_plain, blocks_ref, 7);
+		crypto_aes_clear(&ctx);
+
+		for (b = 0; b < (int)(sizeof(backends)/sizeof(*backends)); b++) {
+			const char *name = crypto_aes_backend_name(backends[b]);
+			if (crypto_aes_set_backend(backends[b]) != 0) {
+				printf("crypto_aes_test (%s) [ 4]: SKIPPED, "
+				       "not available\n", name);
+				continue;
+			}
+
+			printf("crypto_aes_test (%s) [ 4]: ", name);
+
+			crypto_aes_encrypt(fips_key, fips_plain, encrypted);
+			if (memcmp(encrypted, fips_cipher, 16) != 0) {
+				printf("FAILED ");
+				failed++;
+			} else {
+				printf("PASSED ");
+			}
+
+			crypto_aes_encrypt(key, ctx_plain, encrypted);
+			if (memcmp(encrypted, encrypted_origin, 16) != 0) {
+				printf("FAILED ");
+				failed++;
+			} else {
+				printf("PASSED ");
+			}
+
+			crypto_aes_init(&ctx, key);
+			crypto_aes_encrypt_blocks(&ctx, blocks_plain, blocks_enc, 7);
+			crypto_aes_clear(&ctx);
+			if (memcmp(blocks_enc, blocks_ref, sizeof(blocks_ref)) != 0) {
+				printf("FAILED\n");
+				failed++;
+			} else {
+				printf("PASSED\n");
+			}
+		}
+		crypto_aes_set_backend(CRYPTO_AES_AUTO);
+		printf("crypto_aes_test: using %s backend\n",
+		       crypto_aes_backend_name(crypto_aes_get_backend()));
+	}
+
 
 	/* SHA256 testcase */
 	{
@@ -364,7 +463,7 @@ static int _ppp_testcase_statistical(const state *s, const int alphabet_len, con
 //		num_to_bin(counter, cnt_bin, 16);
 
 		/* Encrypt counter with key */
-		ret = crypto_aes_encrypt(s->sequence_key, cnt_bin, cipher_bin);
+		ret = crypto_aes_encrypt_ctx(&s->key_ctx, cnt_bin, cipher_bin);
 		if (ret != 0) {
 			printf("AES ERROR\n");
 			goto clear;
@@ -476,7 +575,7 @@ static int _ppp_testcase_stat_2(const state *s,
 		num_export(counter, (char *)cnt_bin, NUM_FORMAT_BIN);
 
 		/* Encrypt counter with key */
-		ret = crypto_aes_encrypt(s->sequence_key, cnt_bin, cipher_bin);
+		ret = crypto_aes_encrypt_ctx(&s->key_ctx, cnt_bin, cipher_bin);
 		if (ret != 0) {
 			printf("AES ERROR\n");
 			goto clear;
@@ -546,6 +645,7 @@ clear:
 static int _ppp_testcase_authenticate(const char *passcode)
 {
 	int retval = 0;
+	int matched;
 
 	const char *prompt = NULL;
 	char *current_user = security_get_calling_user();
@@ -609,7 +709,12 @@ static int _ppp_testcase_authenticate(const char *passcode)
 		goto cleanup;
 	}
 
-	if (ppp_authenticate(&s, passcode) == 0) {
+	if (ppp_authenticate(&s, passcode, &matched) == 0) {
+		if (matched > 0 && ppp_resync(&s, matched) != 0) {
+			printf("PPP_RESYNC FAILED\n");
+			retval = 0;
+			goto cleanup;
+		}
 
 		/* Correctly authenticated */
 		printf("AUTHENTICATION SUCCESSFULL\n");
@@ -625,6 +730,281 @@ cleanup:
 	return retval;
 }
 
+/* Passcodes ahead of the prompted one are accepted with lookahead
+ * and counter is moved past them. Expects empty key stored with
+ * counter 0. */
+static int _ppp_testcase_lookahead(const char *username)
+{
+	cfg_t *cfg = cfg_get();
+	const int lookahead = cfg->pam_lookahead;
+	char ahead[17], behind[17], combined[17];
+	int failed = 0;
+	state s;
+
+	printf("*** Lookahead testcase\n");
+
+	if (state_init(&s, username) != 0) {
+		printf("STATE_INIT FAILED\n");
+		return 1;
+	}
+	ppp_calculate(&s);
+	ppp_get_passcode(&s, num_i(2), ahead);
+	ppp_get_passcode(&s, num_i(1), behind);
+	ppp_get_passcode(&s, num_i(5), combined);
+	state_fini(&s);
+
+	cfg->pam_lookahead = 4;
+
+	printf("Passcode 2 codes ahead, should succeed:\n");
+	if (_ppp_testcase_authenticate(ahead) == 0)
+		failed++;
+
+	/* Counter must be stored past the used passcode */
+	if (state_init(&s, username) != 0 || ppp_state_load(&s, PPP_DONT_LOCK) != 0) {
+		printf("STATE_LOAD FAILED\n");
+		failed++;
+	} else if (num_cmp(s.counter, num_i(3)) != 0) {
+		printf("Counter not resynchronized: FAILED\n");
+		failed++;
+	}
+	state_fini(&s);
+
+	printf("Skipped passcode, should NOT succeed:\n");
+	if (_ppp_testcase_authenticate(behind) != 0)
+		failed++;
+
+	/* Counter is 4 now; increment and resynchronization
+	 * are stored at once */
+	printf("Passcode 1 code ahead within increment, should succeed:\n");
+	if (state_init(&s, username) != 0 ||
+	    ppp_increment_authenticate(&s, combined) != 0 ||
+	    num_cmp(s.counter, num_i(4)) != 0) {
+		printf("INCREMENT_AUTHENTICATE FAILED\n");
+		failed++;
+	}
+	state_fini(&s);
+
+	if (state_init(&s, username) != 0 || ppp_state_load(&s, PPP_DONT_LOCK) != 0 ||
+	    num_cmp(s.counter, num_i(6)) != 0) {
+		printf("Counter not stored past the passcode: FAILED\n");
+		failed++;
+	}
+	state_fini(&s);
+
+	if (state_init(&s, username) != 0 ||
+	    ppp_increment_authenticate(&s, combined) == 0) {
+		printf("Used passcode accepted again: FAILED\n");
+		failed++;
+	}
+	state_fini(&s);
+
+	cfg->pam_lookahead = lookahead;
+	return failed;
+}
+
+/* Batch generation must give exactly the same codes as the single one */
+static int _ppp_testcase_batch(state *s)
+{
+	const int count = 2 * PPP_BATCH_BLOCKS + 3;
+	const num_t firsts[] = {
+		num_i(0),
+		num_i(864197393UL),
+		num_ii(0ULL, 0xFFFFFFFFFFFFFFF8ULL),
+	};
+	char batch[(2 * PPP_BATCH_BLOCKS + 3) * 17];
+	char passcode[17];
+	const int orig_alphabet = s->alphabet;
+	const int orig_length = s->code_length;
+	const unsigned int orig_flags = s->flags;
+	int failed = 0, checked = 0;
+	int alphabet, length, f, salted, i;
+
+	printf("*** Batch passcode generation test\n");
+
+	for (salted = 0; salted < 2; salted++) {
+		if (salted)
+			s->flags |= FLAG_SALTED;
+		else
+			s->flags &= ~FLAG_SALTED;
+
+		for (alphabet = 0; alphabet < ppp_alphabet_count; alphabet++) {
+			/* Skip alphabets denied by policy */
+			if (ppp_verify_alphabet(alphabet) != 0)
+				continue;
+			s->alphabet = alphabet;
+
+			for (length = 2; length <= 16; length++) {
+				s->code_length = length;
+
+				for (f = 0; f < (int)(sizeof(firsts)/sizeof(*firsts)); f++) {
+					if (ppp_get_passcodes(s, firsts[f], count, batch) != 0) {
+						printf("ppp_get_passcodes failed "
+						       "(alphabet=%d len=%d)\n",
+						       alphabet, length);
+						failed++;
+						continue;
+					}
+
+					for (i = 0; i < count; i++) {
+						const char *code = batch + i * (length + 1);
+						ppp_get_passcode(s, num_add_i(firsts[f], i), passcode);
+						checked++;
+						if (strcmp(code, passcode) != 0) {
+							printf("Batch mismatch alphabet=%d len=%d "
+							       "code %d: %s != %s\n",
+							       alphabet, length, i, code, passcode);
+							failed++;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	s->alphabet = orig_alphabet;
+	s->code_length = orig_length;
+	s->flags = orig_flags;
+
+	if (failed)
+		printf("ppp_testcase[batch]: FAILED (%d errors)\n", failed);
+	else
+		printf("ppp_testcase[batch]: %d passcodes compared, PASSED\n", checked);
+	return failed;
+}
+
+/* Specialized conversion kernels must match the generic one */
+static int _ppp_testcase_kernels(int fast)
+{
+	const int passes = fast ? 50 : 2000;
+	char chars[100];
+	char out[17], ref[17];
+	ppp_alphabet_t alphabet;
+	int failed = 0;
+	int k, i;
+
+	printf("*** Passcode kernel test (%d kernels): ", ppp_kernel_count);
+	fflush(stdout);
+
+	/* Distinct printable characters */
+	for (i = 0; i < (int)sizeof(chars); i++)
+		chars[i] = '!' + i;
+	alphabet.id = -1;
+	alphabet.chars = chars;
+	alphabet.policy = 0;
+
+	for (k = 0; k < ppp_kernel_count; k++) {
+		const ppp_kernel_t *kernel = &ppp_kernels[k];
+		alphabet.length = kernel->alphabet_length;
+
+		if (ppp_kernel_select(kernel->alphabet_length,
+				      kernel->code_length) != kernel) {
+			printf("\nKernel %d/%d not selected ",
+			       kernel->alphabet_length, kernel->code_length);
+			failed++;
+		}
+
+		for (i = 0; i < passes; i++) {
+			num_t cipher;
+
+			/* Edge values first, random ones later */
+			if (i == 0)
+				cipher = num_zero();
+			else if (i == 1)
+				cipher = num_ii(0xFFFFFFFFFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL);
+			else
+				crypto_file_rng("/dev/urandom", NULL,
+						(unsigned char *)&cipher, sizeof(cipher));
+
+			kernel->convert(cipher, &alphabet, kernel->code_length, out);
+			ppp_kernel_generic.convert(cipher, &alphabet,
+						   kernel->code_length, ref);
+			if (strcmp(out, ref) != 0) {
+				printf("\nKernel %d/%d mismatch: %s != %s ",
+				       kernel->alphabet_length, kernel->code_length,
+				       out, ref);
+				failed++;
+				break;
+			}
+		}
+	}
+
+	if (failed)
+		printf("FAILED\n");
+	else
+		printf("PASSED\n");
+	return failed;
+}
+
+/* Compare batch conversion with generic kernel for every available
+ * instruction set, alphabet length and code length */
+static int _ppp_testcase_simd(int fast)
+{
+	enum { BLOCKS = 11 };
+	unsigned char cipher_bin[BLOCKS * 16];
+	char chars[256];
+	char out[BLOCKS * 17], ref[17];
+	const int best = ppp_simd_available();
+	ppp_alphabet_t alphabet;
+	int failed = 0;
+	int level, length, len, i;
+
+	printf("*** Batch conversion test (SIMD level %d): ", best);
+	fflush(stdout);
+
+	for (i = 0; i < (int)sizeof(chars); i++)
+		chars[i] = (char)i;
+	alphabet.id = -1;
+	alphabet.chars = chars;
+	alphabet.policy = 0;
+
+	for (level = PPP_SIMD_NONE; level <= best; level++) {
+		if (ppp_simd_set(level) != 0) {
+			printf("\nUnable to select level %d ", level);
+			failed++;
+			continue;
+		}
+
+		for (length = 2; length <= 256; length += fast ? 7 : 1) {
+			alphabet.length = length;
+
+			for (len = 2; len <= 16; len++) {
+				const ppp_kernel_t *kernel = ppp_kernel_select(length, len);
+
+				crypto_file_rng("/dev/urandom", NULL,
+						cipher_bin, sizeof(cipher_bin));
+				/* Edge values in first lanes */
+				memset(cipher_bin, 0, 16);
+				memset(cipher_bin + 16, 0xFF, 16);
+
+				ppp_convert_blocks(kernel, &alphabet, len, cipher_bin,
+						   BLOCKS, out, len + 1);
+
+				for (i = 0; i < BLOCKS; i++) {
+					num_t cipher;
+					num_import(&cipher, (char *)cipher_bin + 16*i,
+						   NUM_FORMAT_BIN);
+					ppp_kernel_generic.convert(cipher, &alphabet, len, ref);
+					if (memcmp(out + i * (len + 1), ref, len + 1) != 0) {
+						printf("\nLevel %d, alphabet %d, length %d "
+						       "block %d mismatch ",
+						       level, length, len, i);
+						failed++;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	ppp_simd_set(best);
+
+	if (failed)
+		printf("FAILED\n");
+	else
+		printf("PASSED\n");
+	return failed;
+}
+
 #define _PPP_TEST(cnt,len, col, row, code)			\
 s.counter = num_i(cnt); s.code_length = (len);			\
 ppp_calculate(&s);						\
@@ -678,6 +1058,7 @@ int ppp_testcase(int fast)
 
 	/* Statistical tests using following key */
 	memcpy(s.sequence_key, ex_bin, sizeof(s.sequence_key));
+	state_key_update(&s);
 	failed += _ppp_testcase_statistical(&s, 64, 16, stat_tests);
 	/* Following test should fail using norms from first test */
 	// failed += _ppp_testcase_statistical(&s, 88, 16, 500000);
@@ -688,6 +1069,7 @@ int ppp_testcase(int fast)
 	printf("*** PPPv3 compatibility tests\n");
 	printf("* Sequence key = 0.\n");
 	memset(s.sequence_key, 0, sizeof(s.sequence_key));
+	state_key_update(&s);
 	_PPP_TEST(0, 4, 'A', 1, "NH7j");
 	_PPP_TEST(34, 4, 'G', 5, "EXh5");
 	_PPP_TEST(864197393UL+50UL, 4, 'E', 8, "u2Yp");
@@ -721,6 +1103,7 @@ int ppp_testcase(int fast)
 	};
 	// 8045322210FFEE00000000000000000000000000000000000000000065758698
 	memcpy(s.sequence_key, ex2_bin, sizeof(s.sequence_key));
+	state_key_update(&s);
 
 	printf("New key: ");
 	crypto_print_hex(s.sequence_key, 32);
@@ -744,6 +1127,10 @@ int ppp_testcase(int fast)
 	_PPP_TEST(70+34, 7, 'A', 7, "Ao_\"e82");
 	_PPP_TEST(70+36, 7, 'C', 7, "(&JV?E_");
 
+	failed += _ppp_testcase_batch(&s);
+	failed += _ppp_testcase_kernels(fast);
+	failed += _ppp_testcase_simd(fast);
+
 	state_fini(&s);
 
 	/* Authenticate testcase */
@@ -768,6 +1155,20 @@ int ppp_testcase(int fast)
 		failed++;
 	}
 
+	/* Start again from counter 0 */
+	if (state_init(&s, current_user) != 0) {
+		printf("ERROR WHILE CREATING TEST KEY\n");
+		failed++;
+		free(current_user);
+		return failed;
+	}
+	state_lock(&s);
+	state_store(&s, 0);
+	state_unlock(&s);
+	state_fini(&s);
+
+	failed += _ppp_testcase_lookahead(current_user);
+
 	free(current_user);
 	return failed;
 }
@@ -785,6 +1186,138 @@ int config_testcase(void)
 }
 
 
+#if !USE_GMP
+/* Reference bit-serial implementations used before arithmetic was
+ * moved to word operations. Kept for differential testing. */
+static num_t _num_ref_mul_i(num_t arg1, const uint64_t arg2, int *overflow)
+{
+	int i;
+	int can_overflow = 0;
+	num_t reply = num_zero();
+	num_t r = num_i(arg2);
+
+	*overflow = 0;
+	for (i=0; i<128; i++) {
+		if (arg1.lo & 0x01) {
+			const num_t prev = reply;
+			if (can_overflow)
+				*overflow = 1;
+			reply.lo += r.lo;
+			reply.hi += r.hi + (reply.lo < prev.lo);
+			if (reply.hi < prev.hi
+			    || (reply.hi == prev.hi && reply.lo < prev.lo))
+				*overflow = 1;
+		}
+
+		arg1 = num_rshift(arg1);
+
+		if (r.hi & 0x8000000000000000ULL)
+			can_overflow = 1;
+		r = num_lshift(r);
+	}
+	return reply;
+}
+
+static uint64_t _num_ref_div_i(num_t *result, const num_t divwhat, const uint64_t divby)
+{
+	int i;
+	uint64_t remainder = 0;
+	char overflow = 0;
+
+	*result = divwhat;
+
+	for (i = 0; i < 128; i++) {
+		if (remainder & 0x8000000000000000ULL)
+			overflow = 1;
+		remainder <<= 1;
+
+		if (result->hi & 0x8000000000000000ULL)
+			remainder |= 1;
+
+		*result = num_lshift(*result);
+		if (overflow) {
+			remainder = 0xFFFFFFFFFFFFFFFFULL - divby + 1 + remainder;
+			result->lo |= 1;
+			overflow = 0;
+		} else if (remainder >= divby) {
+			remainder -= divby;
+			result->lo |= 1;
+		}
+	}
+	return remainder;
+}
+
+/* xorshift64*; good enough to spread test inputs */
+static uint64_t _num_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 2685821657736338717ULL;
+}
+
+/* Random number with random bit length, so small values are tested too */
+static uint64_t _num_rand_len(uint64_t *state)
+{
+	const int bits = _num_rand(state) % 65;
+	if (bits == 0)
+		return 0;
+	return _num_rand(state) >> (64 - bits);
+}
+
+static int _num_testcase_differential(int passes)
+{
+	int failed = 0;
+	uint64_t seed = 0;
+	int i, overflow;
+
+	crypto_file_rng("/dev/urandom", NULL, (unsigned char *)&seed, sizeof(seed));
+	seed |= 1;
+
+	printf("* Differential test (%d random inputs): ", passes);
+	fflush(stdout);
+
+	for (i = 0; i < passes; i++) {
+		const num_t a = num_ii(_num_rand_len(&seed), _num_rand_len(&seed));
+		uint64_t divby = _num_rand_len(&seed);
+		num_t q, q_ref, m, m_ref;
+		uint64_t r, r_ref;
+
+		if (divby == 0)
+			divby = 1 + (i % 95);
+
+		r = num_div_i(&q, a, divby);
+		r_ref = _num_ref_div_i(&q_ref, a, divby);
+		if (num_cmp(q, q_ref) != 0 || r != r_ref) {
+			printf("\nDIV FAILED: %016llx%016llx / %llu\n",
+			       (unsigned long long)a.hi, (unsigned long long)a.lo,
+			       (unsigned long long)divby);
+			failed++;
+			break;
+		}
+
+		/* Multiplication; skip values which would overflow */
+		m_ref = _num_ref_mul_i(a, divby, &overflow);
+		if (overflow)
+			continue;
+		m = num_mul_i(a, divby);
+		if (num_cmp(m, m_ref) != 0) {
+			printf("\nMUL FAILED: %016llx%016llx * %llu\n",
+			       (unsigned long long)a.hi, (unsigned long long)a.lo,
+			       (unsigned long long)divby);
+			failed++;
+			break;
+		}
+	}
+
+	if (!failed)
+		printf("OK\n");
+	return failed;
+}
+#endif
+
 int num_testcase(int fast)
 {
 	int failed = 0;
@@ -1076,6 +1609,10 @@ int num_testcase(int fast)
 
 	if (i >= 30000) 
 		printf("OK\n");
+	else
+		printf("\n");
+
+	failed += _num_testcase_differential(fast ? 2000 : 1000000);
 
 #else
 
@@ -1154,3 +1691,1294 @@ int num_testcase(int fast)
 	return failed;
 }
 
+
+/***************************
+ * Database testcases
+ **************************/
+static const char *_db_testcase_path = "/tmp/otshadow_testcase_idx";
+
+/* Write database of n users, collect offsets of their entries */
+static int _db_testcase_create(int users, db_index_builder *b)
+{
+	char username[32];
+	FILE *f;
+	int i;
+
+	f = fopen(_db_testcase_path, "w");
+	if (!f)
+		return 1;
+
+	for (i = 0; i < users; i++) {
+		const int len = snprintf(username, sizeof(username), "user%d", i);
+		db_index_builder_add(b, username, len, ftell(f));
+		/* Entries of various length */
+		fprintf(f, "%s:1:%0*d\n", username, 10 + i % 50, i);
+	}
+
+	return fclose(f) != 0;
+}
+
+static int _db_testcase_index(int fast)
+{
+	const int users = fast ? 500 : 20000;
+	char idx_path[100];
+	char username[32];
+	char buff[128];
+	db_index_builder b;
+	struct stat st;
+	uint64_t offset;
+	int failed = 0;
+	FILE *f;
+	int i;
+
+	snprintf(idx_path, sizeof(idx_path), "%s%s",
+		 _db_testcase_path, DB_INDEX_SUFFIX);
+
+	printf("* Database index (%d users): ", users);
+	fflush(stdout);
+
+	db_index_builder_init(&b);
+	if (_db_testcase_create(users, &b) != 0 ||
+	    stat(_db_testcase_path, &st) != 0 ||
+	    db_index_write(&b, idx_path, &st, (uid_t) -1, (gid_t) -1) != 0) {
+		printf("FAILED (unable to create database)\n");
+		db_index_builder_fini(&b);
+		return 1;
+	}
+	db_index_builder_fini(&b);
+
+	f = fopen(_db_testcase_path, "r");
+	assert(f);
+
+	/* Every entry must be reachable with a single read */
+	for (i = 0; i < users; i++) {
+		const int len = snprintf(username, sizeof(username), "user%d:", i);
+		username[len - 1] = '\0';
+		if (db_index_find(idx_path, &st, username, &offset) != 0) {
+			printf("FAILED (user%d not found) ", i);
+			failed++;
+			break;
+		}
+
+		username[len - 1] = ':';
+		if (fseek(f, offset, SEEK_SET) != 0 ||
+		    fgets(buff, sizeof(buff), f) == NULL ||
+		    strncmp(buff, username, len) != 0) {
+			printf("FAILED (user%d at wrong offset) ", i);
+			failed++;
+			break;
+		}
+	}
+	fclose(f);
+
+	if (db_index_find(idx_path, &st, "nonexistent", &offset) == 0) {
+		printf("FAILED (found nonexistent user) ");
+		failed++;
+	}
+
+	/* Index must not be trusted after database changes */
+	f = fopen(_db_testcase_path, "a");
+	assert(f);
+	fputs("appended:1:0000000000\n", f);
+	fclose(f);
+	stat(_db_testcase_path, &st);
+	if (db_index_find(idx_path, &st, "user0", &offset) == 0) {
+		printf("FAILED (outdated index used) ");
+		failed++;
+	}
+
+	unlink(idx_path);
+	unlink(_db_testcase_path);
+
+	if (failed == 0)
+		printf("OK\n");
+	else
+		printf("\n");
+	return failed;
+}
+
+static int _db_testcase_convert(int fast)
+{
+	const int users = fast ? 50 : 2000;
+	char idx_path[100];
+	char username[32];
+	char buff[STATE_ENTRY_SIZE];
+	char long_user[301];
+	db_index_builder b;
+	struct stat st;
+	uint64_t offset;
+	int failed = 0;
+	FILE *f;
+	int i;
+
+	snprintf(idx_path, sizeof(idx_path), "%s%s",
+		 _db_testcase_path, DB_INDEX_SUFFIX);
+
+	printf("* Fixed-width conversion (%d users): ", users);
+	fflush(stdout);
+
+	db_index_builder_init(&b);
+	i = _db_testcase_create(users, &b);
+	db_index_builder_fini(&b);
+
+	/* Entry too long for a slot must be kept in version 1 */
+	memset(long_user, 'x', sizeof(long_user) - 1);
+	long_user[sizeof(long_user) - 1] = '\0';
+	f = fopen(_db_testcase_path, "a");
+	assert(f);
+	fprintf(f, "%s:1:%0250d\n", long_user, 0);
+	fclose(f);
+
+	if (i != 0 || db_file_convert(_db_testcase_path) != 0) {
+		printf("FAILED (conversion failed)\n");
+		unlink(_db_testcase_path);
+		return 1;
+	}
+
+	f = fopen(_db_testcase_path, "r");
+	assert(f);
+	for (i = 0; i < users; i++) {
+		const int len = snprintf(username, sizeof(username), "user%d:2:", i);
+		if (fgets(buff, sizeof(buff), f) == NULL ||
+		    strlen(buff) != 512 ||
+		    strncmp(buff, username, len) != 0 ||
+		    buff[len + 10 + i % 50] != ':' ||
+		    buff[494] != '#' || buff[511] != '\n') {
+			printf("FAILED (entry %d not converted) ", i);
+			failed++;
+			break;
+		}
+	}
+
+	if (failed == 0 &&
+	    (fgets(buff, sizeof(buff), f) == NULL ||
+	     strncmp(buff + sizeof(long_user) - 1, ":1:", 3) != 0)) {
+		printf("FAILED (long entry changed) ");
+		failed++;
+	}
+	fclose(f);
+
+	/* Index is rebuilt and points at slots */
+	stat(_db_testcase_path, &st);
+	if (db_index_find(idx_path, &st, "user1", &offset) != 0 ||
+	    offset != 512 ||
+	    db_index_find(idx_path, &st, long_user, &offset) != 0 ||
+	    offset != (uint64_t)users * 512) {
+		printf("FAILED (index not rebuilt) ");
+		failed++;
+	}
+
+	/* Second conversion changes nothing */
+	if (db_file_convert(_db_testcase_path) != 0 ||
+	    stat(_db_testcase_path, &st) != 0 ||
+	    st.st_size != (off_t)users * 512 + strlen(long_user) + 254) {
+		printf("FAILED (conversion not idempotent) ");
+		failed++;
+	}
+
+	unlink(idx_path);
+	unlink(_db_testcase_path);
+
+	if (failed == 0)
+		printf("OK\n");
+	else
+		printf("\n");
+	return failed;
+}
+
+static int _db_testcase_journal(int fast)
+{
+	const int users = fast ? 30 : 600;
+	const char *zeroes = "00000000000000000000000000000000";
+	char jnl_path[100], idx_path[100], lck_path[100];
+	char buff[STATE_ENTRY_SIZE];
+	char previous[STATE_ENTRY_SIZE];
+	db_journal_record r;
+	unsigned int counter, failures;
+	int failed = 0, entries;
+	FILE *f;
+	int i;
+
+	snprintf(jnl_path, sizeof(jnl_path), "%s%s",
+		 _db_testcase_path, DB_JOURNAL_SUFFIX);
+	snprintf(idx_path, sizeof(idx_path), "%s%s",
+		 _db_testcase_path, DB_INDEX_SUFFIX);
+	snprintf(lck_path, sizeof(lck_path), "%s.lck", _db_testcase_path);
+
+	printf("* Journal compaction and sorting (%d users): ", users);
+	fflush(stdout);
+
+	f = fopen(_db_testcase_path, "w");
+	assert(f);
+	for (i = 0; i < users; i++)
+		fprintf(f, "user%d:1:%s%s:%032X:%s:0:0:0:8:1:0::0::\n",
+			i, zeroes, zeroes, i, zeroes);
+	fclose(f);
+	unlink(jnl_path);
+
+	/* Every third user gets two updates; the latter must win */
+	for (i = 0; i < users; i += 3) {
+		snprintf(buff, sizeof(buff), "user%d", i);
+		db_journal_record_init(&r, buff);
+		r.counter_lo = i + 100;
+		if (db_journal_append(jnl_path, &r, 0, (uid_t)-1, (gid_t)-1, NULL) != 0)
+			failed++;
+
+		/* Torn record left by a crash */
+		if (i == 3) {
+			f = fopen(jnl_path, "a");
+			assert(f);
+			fwrite(&r, sizeof(r) / 2, 1, f);
+			fclose(f);
+		}
+
+		r.counter_lo = i + 200;
+		r.failures = i;
+		if (db_journal_append(jnl_path, &r, 0, (uid_t)-1, (gid_t)-1, NULL) != 0)
+			failed++;
+	}
+
+	/* Records of removed users are ignored */
+	db_journal_record_init(&r, "removed");
+	db_journal_append(jnl_path, &r, 0, (uid_t)-1, (gid_t)-1, NULL);
+
+	if (failed) {
+		printf("FAILED (unable to append)\n");
+		goto cleanup;
+	}
+
+	if (db_journal_find(jnl_path, "user6", &r) != 0 || r.counter_lo != 206 ||
+	    db_journal_find(jnl_path, "user1", &r) != 1) {
+		printf("FAILED (wrong record found) ");
+		failed++;
+	}
+
+	if (db_file_compact(_db_testcase_path) != 0) {
+		printf("FAILED (compaction failed)\n");
+		failed++;
+		goto cleanup;
+	}
+
+	if (db_journal_records(jnl_path) != 0) {
+		printf("FAILED (journal not emptied) ");
+		failed++;
+	}
+
+	/* Entries come sorted by username */
+	f = fopen(_db_testcase_path, "r");
+	assert(f);
+	previous[0] = '\0';
+	for (entries = 0; fgets(buff, sizeof(buff), f) != NULL; entries++) {
+		int expected;
+		if (sscanf(buff, "user%d:%*[^:]:%*[^:]:%X:%*[^:]:%u",
+			   &i, &counter, &failures) != 3) {
+			printf("FAILED (invalid entry) ");
+			failed++;
+			break;
+		}
+
+		expected = i % 3 ? i : i + 200;
+		if (counter != (unsigned int)expected ||
+		    failures != (unsigned int)(i % 3 ? 0 : i)) {
+			printf("FAILED (entry %d not updated) ", i);
+			failed++;
+			break;
+		}
+
+		*strchr(buff, ':') = '\0';
+		if (strcmp(previous, buff) >= 0) {
+			printf("FAILED (%s not sorted) ", buff);
+			failed++;
+			break;
+		}
+		strcpy(previous, buff);
+	}
+	if (failed == 0 && entries != users) {
+		printf("FAILED (%d of %d entries) ", entries, users);
+		failed++;
+	}
+	fclose(f);
+
+cleanup:
+	unlink(jnl_path);
+	unlink(idx_path);
+	unlink(lck_path);
+	unlink(_db_testcase_path);
+
+	if (failed == 0)
+		printf("OK\n");
+	else
+		printf("\n");
+	return failed;
+}
+
+/* Check that every user is in its file of database split into given
+ * number of shards, in sorted order. Returns number of entries or -1. */
+static int _db_testcase_layout(int shards)
+{
+	char path[STATE_PATH_SIZE], expected[STATE_PATH_SIZE];
+	char buff[STATE_ENTRY_SIZE], previous[STATE_ENTRY_SIZE];
+	int entries = 0, i;
+	FILE *f;
+
+	for (i = 0; i < (shards ? shards : 1); i++) {
+		if (shards)
+			db_file_shard_name(_db_testcase_path, i, path, sizeof(path));
+		else
+			strcpy(path, _db_testcase_path);
+
+		f = fopen(path, "r");
+		if (!f)
+			return -1;
+
+		previous[0] = '\0';
+		while (fgets(buff, sizeof(buff), f) != NULL) {
+			*strchr(buff, ':') = '\0';
+			db_file_shard_path(_db_testcase_path, shards, buff,
+					   expected, sizeof(expected));
+			if (strcmp(path, expected) != 0 ||
+			    strcmp(previous, buff) >= 0) {
+				fclose(f);
+				return -1;
+			}
+			strcpy(previous, buff);
+			entries++;
+		}
+		fclose(f);
+	}
+	return entries;
+}
+
+static int _db_testcase_shards(int fast)
+{
+	const int users = fast ? 50 : 1000;
+	const char *zeroes = "00000000000000000000000000000000";
+	static const int layouts[] = { 4, 3, 0 };
+	char path[STATE_PATH_SIZE], buff[STATE_ENTRY_SIZE];
+	db_journal_record r;
+	unsigned int counter = 0;
+	int failed = 0, from = 0, entries, i;
+	FILE *f;
+
+	printf("* Database sharding (%d users): ", users);
+	fflush(stdout);
+
+	f = fopen(_db_testcase_path, "w");
+	assert(f);
+	for (i = users - 1; i >= 0; i--)
+		fprintf(f, "user%d:1:%s%s:%032X:%s:0:0:0:8:1:0::0::\n",
+			i, zeroes, zeroes, i, zeroes);
+	fclose(f);
+
+	/* Journal is applied before entries are moved */
+	snprintf(path, sizeof(path), "%s%s", _db_testcase_path, DB_JOURNAL_SUFFIX);
+	db_journal_record_init(&r, "user5");
+	r.counter_lo = 0x99;
+	db_journal_append(path, &r, 0, (uid_t)-1, (gid_t)-1, NULL);
+
+	for (i = 0; i < (int) (sizeof(layouts) / sizeof(*layouts)); i++) {
+		const int to = layouts[i];
+
+		if (from > 0) {
+			/* Crash while swapping directories of shards */
+			snprintf(path, sizeof(path), "%s" DB_FILE_SHARD_SUFFIX,
+				 _db_testcase_path);
+			strcpy(buff, path);
+			strcat(buff, ".old");
+			if (rename(path, buff) != 0) {
+				printf("FAILED (unable to move %s) ", path);
+				failed++;
+			}
+		}
+
+#if DEBUG
+		/* Failure after the first shard keeps the old layout */
+		if (to > 1) {
+			db_file_reshard_fail = 1;
+			if (db_file_reshard(_db_testcase_path, from, to) == 0 ||
+			    _db_testcase_layout(from) != users) {
+				printf("FAILED (old layout lost: %d -> %d shards) ",
+				       from, to);
+				failed++;
+			}
+			db_file_reshard_fail = -1;
+		}
+#endif
+
+		if (db_file_reshard(_db_testcase_path, from, to) != 0) {
+			printf("FAILED (%d -> %d shards) ", from, to);
+			failed++;
+			break;
+		}
+
+		entries = _db_testcase_layout(to);
+		if (entries != users) {
+			printf("FAILED (%d of %d entries in %d shards) ",
+			       entries, users, to);
+			failed++;
+		}
+
+		/* Files of previous layout are gone */
+		if (from == 0)
+			strcpy(path, _db_testcase_path);
+		else
+			db_file_shard_name(_db_testcase_path, from - 1,
+					   path, sizeof(path));
+		if (from > to && access(path, F_OK) == 0) {
+			printf("FAILED (%s left) ", path);
+			failed++;
+		}
+		from = to;
+	}
+
+	f = fopen(_db_testcase_path, "r");
+	while (f && fgets(buff, sizeof(buff), f) != NULL) {
+		if (strncmp(buff, "user5:", 6) == 0)
+			sscanf(buff, "user5:%*[^:]:%*[^:]:%X", &counter);
+	}
+	if (f)
+		fclose(f);
+	if (counter != 0x99) {
+		printf("FAILED (journal not applied) ");
+		failed++;
+	}
+
+	/* Directories of shards are removed with their lock files */
+	snprintf(path, sizeof(path), "%s" DB_FILE_SHARD_SUFFIX, _db_testcase_path);
+	strcpy(buff, path);
+	strcat(buff, ".new");
+	if (access(path, F_OK) == 0 || access(buff, F_OK) == 0) {
+		printf("FAILED (shard directory left) ");
+		failed++;
+	}
+
+	snprintf(path, sizeof(path), "%s%s", _db_testcase_path, DB_INDEX_SUFFIX);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s%s", _db_testcase_path, DB_JOURNAL_SUFFIX);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s.lck", _db_testcase_path);
+	unlink(path);
+	unlink(_db_testcase_path);
+
+	if (failed == 0)
+		printf("OK\n");
+	else
+		printf("\n");
+	return failed;
+}
+
+/* Store (or remove) state of user%d with given counter */
+static int _db_testcase_btree_store(int user, int counter, int remove)
+{
+	char username[32];
+	state s;
+	int ret;
+
+	snprintf(username, sizeof(username), "user%d", user);
+	if (state_init(&s, username) != 0)
+		return 1;
+
+	s.counter = num_i(counter);
+	s.sequence_key[0] = user;
+	ret = state_lock(&s);
+	if (ret == 0) {
+		ret = state_store(&s, remove);
+		ret |= state_unlock(&s);
+	}
+	state_fini(&s);
+	return ret;
+}
+
+/* Counter of user%d, -1 if it has no state, -2 on error */
+static int _db_testcase_btree_load(int user)
+{
+	char username[32];
+	state s;
+	int ret;
+
+	snprintf(username, sizeof(username), "user%d", user);
+	if (state_init(&s, username) != 0)
+		return -2;
+
+	ret = state_load(&s);
+	if (ret == 0)
+		ret = s.sequence_key[0] == (unsigned char) user ? (int) s.counter.lo : -2;
+	else
+		ret = ret == STATE_NO_USER_ENTRY ? -1 : -2;
+	state_fini(&s);
+	return ret;
+}
+
+static int _db_testcase_btree(int fast)
+{
+	const int users = fast ? 300 : 5000;
+	const char *path = "/tmp/otbtree_testcase";
+	cfg_t *cfg = cfg_get();
+	const cfg_t saved = *cfg;
+	db_btree_page meta[2];
+	char lck[100];
+	struct stat st;
+	off_t size;
+	int failed = 0, bad = 0, i, u, fd, newest;
+
+	printf("* B+tree database (%d users): ", users);
+	fflush(stdout);
+
+	unlink(path);
+	cfg->db = CONFIG_DB_BTREE;
+	strcpy(cfg->btree_db_path, path);
+	cfg->db_durability = CONFIG_DURABILITY_NONE;
+	cfg->user_uid = getuid();
+	cfg->user_gid = getgid();
+
+	/* Inserted in scattered order */
+	for (i = 0; i < users; i++) {
+		u = (i * 7919) % users;
+		bad += _db_testcase_btree_store(u, u, 0) != 0;
+	}
+	for (u = 0; u < users; u++)
+		bad += _db_testcase_btree_load(u) != u;
+	if (bad) {
+		printf("FAILED (%d users not stored) ", bad);
+		failed++;
+	}
+
+	/* Updates reuse pages freed by previous commits */
+	stat(path, &st);
+	size = st.st_size;
+	for (u = 0, bad = 0; u < users; u += 2)
+		bad += _db_testcase_btree_store(u, u + users, 0) != 0;
+	for (u = 0; u < users; u++)
+		bad += _db_testcase_btree_load(u) != (u % 2 ? u : u + users);
+	stat(path, &st);
+	if (bad) {
+		printf("FAILED (%d users not updated) ", bad);
+		failed++;
+	}
+	if (st.st_size > size + 2 * DB_BTREE_DEPTH_MAX * DB_BTREE_PAGE_SIZE) {
+		printf("FAILED (database grew from %jd to %jd bytes) ",
+		       (intmax_t) size, (intmax_t) st.st_size);
+		failed++;
+	}
+
+	for (u = 0, bad = 0; u < users; u += 3)
+		bad += _db_testcase_btree_store(u, 0, 1) != 0;
+	bad += _db_testcase_btree_store(users, 0, 1) == 0;
+	for (u = 0; u < users; u++) {
+		const int expected = u % 3 == 0 ? -1 : (u % 2 ? u : u + users);
+		bad += _db_testcase_btree_load(u) != expected;
+	}
+	if (bad) {
+		printf("FAILED (%d users not removed) ", bad);
+		failed++;
+	}
+
+	/* Commit whose meta page is torn is lost as a whole */
+	_db_testcase_btree_store(1, 77, 0);
+	fd = open(path, O_RDWR);
+	assert(fd != -1);
+	if (pread(fd, meta, sizeof(meta), 0) != sizeof(meta))
+		assert(0);
+	newest = meta[1].meta.generation > meta[0].meta.generation;
+	meta[newest].raw[DB_BTREE_PAGE_SIZE - 1] ^= 0xFF;
+	if (pwrite(fd, &meta[newest], DB_BTREE_PAGE_SIZE,
+		   newest * DB_BTREE_PAGE_SIZE) != DB_BTREE_PAGE_SIZE)
+		assert(0);
+	close(fd);
+	if (_db_testcase_btree_load(1) != 1) {
+		printf("FAILED (previous commit not used) ");
+		failed++;
+	}
+	if (_db_testcase_btree_store(1, 78, 0) != 0 ||
+	    _db_testcase_btree_load(1) != 78 ||
+	    _db_testcase_btree_load(2) != 2 + users) {
+		printf("FAILED (not updated after torn commit) ");
+		failed++;
+	}
+
+	*cfg = saved;
+	snprintf(lck, sizeof(lck), "%s.lck", path);
+	unlink(lck);
+	unlink(path);
+
+	if (failed == 0)
+		printf("OK\n");
+	else
+		printf("\n");
+	return failed;
+}
+
+/* Store counter of user%d in global database, or load it if counter
+ * is -1. Permissions aren't checked; CONFIG_DIR might not exist. */
+static int _db_testcase_global(int user, int counter)
+{
+	char username[32];
+	state s;
+	int ret;
+
+	snprintf(username, sizeof(username), "user%d", user);
+	if (state_init(&s, username) != 0)
+		return -2;
+
+	s.db_permissions = 0;
+	s.counter = num_i(counter);
+	s.sequence_key[0] = user;
+	ret = state_lock(&s);
+	if (ret == 0) {
+		ret = counter == -1 ? state_load(&s) : state_store(&s, 0);
+		state_unlock(&s);
+	}
+	if (ret == 0 && counter == -1)
+		ret = s.sequence_key[0] == (unsigned char) user ? (int) s.counter.lo : -2;
+	else if (ret != 0)
+		ret = -2;
+	state_fini(&s);
+	return ret;
+}
+
+/* Slots of global database overwritten in place */
+static int _db_testcase_torn(void)
+{
+	cfg_t *cfg = cfg_get();
+	const cfg_t saved = *cfg;
+	const char *zeroes = "00000000000000000000000000000000";
+	char slot[2][512], slots[3 * 512], path[100];
+	struct stat st_before, st_after;
+	int failed = 0, u, fd;
+	FILE *f;
+
+	printf("* Torn fixed-width slots: ");
+	fflush(stdout);
+
+	/* Database exists; it's created by the administrator */
+	f = fopen(_db_testcase_path, "w");
+	assert(f);
+	fclose(f);
+	cfg->db = CONFIG_DB_GLOBAL;
+	strcpy(cfg->global_db_path, _db_testcase_path);
+	cfg->db_shards = 0;
+	cfg->db_journal = 0;
+	cfg->db_lease = 0;
+	cfg->db_durability = CONFIG_DURABILITY_NONE;
+	cfg->user_uid = getuid();
+	cfg->user_gid = getgid();
+
+	for (u = 0; u < 3; u++)
+		failed += _db_testcase_global(u, 1) != 0;
+	if (failed) {
+		printf("FAILED (users not stored)\n");
+		goto cleanup;
+	}
+
+	/* Aligned, sealed slot is overwritten in place */
+	stat(_db_testcase_path, &st_before);
+	if (_db_testcase_global(1, 5) != 0 ||
+	    _db_testcase_global(1, -1) != 5) {
+		printf("FAILED (user not updated) ");
+		failed++;
+	}
+	stat(_db_testcase_path, &st_after);
+	if (st_before.st_ino != st_after.st_ino) {
+		printf("FAILED (aligned slot not updated in place) ");
+		failed++;
+	}
+
+	/* Keep the slot before and after an update; then tear it */
+	fd = open(_db_testcase_path, O_RDWR);
+	assert(fd != -1);
+	if (pread(fd, slot[0], sizeof(slot[0]), 512) != sizeof(slot[0]))
+		assert(0);
+	_db_testcase_global(1, 9);
+	if (pread(fd, slot[1], sizeof(slot[1]), 512) != sizeof(slot[1]) ||
+	    pwrite(fd, slot[0] + 256, 256, 512 + 256) != 256)
+		assert(0);
+
+	if (_db_testcase_global(1, -1) != -2 ||
+	    _db_testcase_global(0, -1) != 1 || _db_testcase_global(2, -1) != 1) {
+		printf("FAILED (torn slot accepted) ");
+		failed++;
+	}
+
+	/* Writer finishing the slot makes it valid again */
+	if (pwrite(fd, slot[1], sizeof(slot[1]), 512) != sizeof(slot[1]))
+		assert(0);
+	close(fd);
+	if (_db_testcase_global(1, -1) != 9) {
+		printf("FAILED (completed slot rejected) ");
+		failed++;
+	}
+
+	/* Entry before them moves slots off the sector boundary;
+	 * the database has to be rewritten instead */
+	f = fopen(_db_testcase_path, "r");
+	assert(f);
+	if (fread(slots, 1, sizeof(slots), f) != sizeof(slots))
+		assert(0);
+	fclose(f);
+	f = fopen(_db_testcase_path, "w");
+	assert(f);
+	fprintf(f, "user:1:%s%s:0:%s:0:0:0:8:1:0::0::\n", zeroes, zeroes, zeroes);
+	fwrite(slots, 1, sizeof(slots), f);
+	fclose(f);
+	stat(_db_testcase_path, &st_before);
+	if (_db_testcase_global(1, 11) != 0 ||
+	    _db_testcase_global(1, -1) != 11 || _db_testcase_global(2, -1) != 1) {
+		printf("FAILED (unaligned user not updated) ");
+		failed++;
+	}
+	stat(_db_testcase_path, &st_after);
+	if (st_before.st_ino == st_after.st_ino) {
+		printf("FAILED (unaligned slot updated in place) ");
+		failed++;
+	}
+
+cleanup:
+	*cfg = saved;
+	snprintf(path, sizeof(path), "%s.lck", _db_testcase_path);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s%s", _db_testcase_path, DB_INDEX_SUFFIX);
+	unlink(path);
+	unlink(_db_testcase_path);
+
+	if (failed == 0)
+		printf("OK\n");
+	else
+		printf("\n");
+	return failed;
+}
+
+/* Session waiting for a busy stripe doesn't stop sessions of other
+ * stripes: user0 is held locked while a child process waits for it,
+ * two users of other stripes must still get their locks. */
+static int _db_testcase_stripes(void)
+{
+	cfg_t *cfg = cfg_get();
+	const cfg_t saved = *cfg;
+	uint64_t stripes[3];
+	char path[100], username[32];
+	int users[2], found = 0, failed = 0, status, u;
+	pid_t child;
+	state s;
+	FILE *f;
+
+	printf("* Lock queues of stripes: ");
+	fflush(stdout);
+
+	/* Two users of stripes other than the one of user0 */
+	stripes[0] = db_index_hash("user0", 5) % 1024;
+	for (u = 1; found < 2; u++) {
+		snprintf(username, sizeof(username), "user%d", u);
+		stripes[found + 1] = db_index_hash(username, strlen(username)) % 1024;
+		if (stripes[found + 1] == stripes[0] ||
+		    (found == 1 && stripes[2] == stripes[1]))
+			continue;
+		users[found++] = u;
+	}
+
+	f = fopen(_db_testcase_path, "w");
+	assert(f);
+	fclose(f);
+	cfg->db = CONFIG_DB_GLOBAL;
+	strcpy(cfg->global_db_path, _db_testcase_path);
+	cfg->db_shards = 0;
+	cfg->db_journal = 0;
+	cfg->db_lease = 0;
+	cfg->db_durability = CONFIG_DURABILITY_NONE;
+	cfg->db_lock_timeout = 2000;
+
+	/* Adding users rewrites the file; updates later are done in place */
+	if (_db_testcase_global(0, 1) != 0 ||
+	    _db_testcase_global(users[0], 1) != 0 ||
+	    _db_testcase_global(users[1], 1) != 0 ||
+	    state_init(&s, "user0") != 0) {
+		printf("FAILED (setup) ");
+		failed++;
+		goto end;
+	}
+	s.db_permissions = 0;
+	if (state_lock(&s) != 0) {
+		printf("FAILED (lock of user0) ");
+		failed++;
+		state_fini(&s);
+		goto end;
+	}
+
+	child = fork();
+	assert(child != -1);
+	if (child == 0) {
+		/* Waits in queue of user0 stripe until we unlock */
+		close(s.lock);
+		_exit(_db_testcase_global(0, -1) == 1 ? 0 : 1);
+	}
+
+	/* Let the child queue up; others must not wait for it */
+	usleep(100000);
+	cfg->db_lock_timeout = 500;
+	for (u = 0; u < 2; u++) {
+		if (_db_testcase_global(users[u], 2) != 0) {
+			printf("FAILED (user%d waited for other stripe) ", users[u]);
+			failed++;
+		}
+	}
+
+	state_unlock(&s);
+	state_fini(&s);
+	if (waitpid(child, &status, 0) != child ||
+	    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("FAILED (waiting session didn't get its lock) ");
+		failed++;
+	}
+
+end:
+	*cfg = saved;
+	snprintf(path, sizeof(path), "%s.lck", _db_testcase_path);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s%s", _db_testcase_path, DB_INDEX_SUFFIX);
+	unlink(path);
+	unlink(_db_testcase_path);
+
+	if (failed == 0)
+		printf("OK\n");
+	else
+		printf("\n");
+	return failed;
+}
+
+/* Counter leasing of global database */
+static int _db_testcase_lease_db(void)
+{
+	const char *dir = "/tmp/otpasswd_testcase_lease_db";
+	cfg_t *cfg = cfg_get();
+	const cfg_t saved = *cfg;
+	char path[100];
+	db_lease l;
+	state s;
+	int failed = 0, ret;
+	FILE *f;
+
+	printf("* Leased counters: ");
+	fflush(stdout);
+
+	f = fopen(_db_testcase_path, "w");
+	assert(f);
+	fclose(f);
+	cfg->db = CONFIG_DB_GLOBAL;
+	strcpy(cfg->global_db_path, _db_testcase_path);
+	cfg->db_shards = 0;
+	cfg->db_journal = 0;
+	cfg->db_lease = 10;
+	strcpy(cfg->db_lease_dir, dir);
+	cfg->db_durability = CONFIG_DURABILITY_NONE;
+	cfg->user_uid = getuid();
+	cfg->user_gid = getgid();
+
+	/* Lease of passcodes 1-11 */
+	if (_db_testcase_global(0, 1) != 0 || _db_testcase_global(0, -1) != 1 ||
+	    db_lease_read(dir, "user0", &l, getuid()) != 0 || l.end_lo != 11) {
+		printf("FAILED (counter not leased) ");
+		failed++;
+	}
+
+	/* Position before the start of lease is not trusted */
+	l.position_lo = 0;
+	if (db_lease_write(dir, "user0", &l, (uid_t)-1, (gid_t)-1) != 0 ||
+	    _db_testcase_global(0, -1) != 11) {
+		printf("FAILED (position before lease used) ");
+		failed++;
+	}
+	l.position_lo = 5;
+	if (db_lease_write(dir, "user0", &l, (uid_t)-1, (gid_t)-1) != 0 ||
+	    _db_testcase_global(0, -1) != 5) {
+		printf("FAILED (position within lease not used) ");
+		failed++;
+	}
+
+	/* New key within the lease is stored with its own counter */
+	ret = state_init(&s, "user0");
+	if (ret == 0) {
+		s.db_permissions = 0;
+		ret = state_lock(&s);
+		if (ret == 0) {
+			ret = state_load(&s);
+			s.sequence_key[1] ^= 0xFF;
+			s.counter = num_i(3);
+			ret |= state_store(&s, 0);
+			state_unlock(&s);
+		}
+		state_fini(&s);
+	}
+	if (ret != 0 || db_lease_read(dir, "user0", &l, getuid()) == 0 ||
+	    _db_testcase_global(0, -1) != 3) {
+		printf("FAILED (lease kept with new key) ");
+		failed++;
+	}
+
+	*cfg = saved;
+	db_lease_remove(dir, "user0");
+	rmdir(dir);
+	snprintf(path, sizeof(path), "%s.lck", _db_testcase_path);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s%s", _db_testcase_path, DB_INDEX_SUFFIX);
+	unlink(path);
+	unlink(_db_testcase_path);
+
+	if (failed == 0)
+		printf("OK\n");
+	else
+		printf("\n");
+	return failed;
+}
+
+static int _db_testcase_lease(void)
+{
+	const char *dir = "/tmp/otpasswd_testcase_lease";
+	char path[100];
+	db_lease l, r;
+	int failed = 0;
+
+	printf("* Lease positions: ");
+	fflush(stdout);
+
+	snprintf(path, sizeof(path), "%s/user", dir);
+	unlink(path);
+	rmdir(dir);
+
+	l.end_hi = 0;
+	l.end_lo = 32;
+	l.position_hi = 0;
+	l.position_lo = 17;
+
+	/* Directory is created on first use */
+	if (db_lease_write(dir, "user", &l, (uid_t)-1, (gid_t)-1) != 0 ||
+	    db_lease_read(dir, "user", &r, geteuid()) != 0 ||
+	    memcmp(&l, &r, sizeof(l)) != 0) {
+		printf("FAILED (position not stored) ");
+		failed++;
+	}
+
+	l.position_lo = 18;
+	if (db_lease_write(dir, "user", &l, (uid_t)-1, (gid_t)-1) != 0 ||
+	    db_lease_read(dir, "user", &r, geteuid()) != 0 ||
+	    r.position_lo != 18) {
+		printf("FAILED (position not updated) ");
+		failed++;
+	}
+
+	/* Position which others could change must not be trusted */
+	chmod(path, S_IRUSR | S_IWUSR | S_IWGRP);
+	if (db_lease_read(dir, "user", &r, geteuid()) == 0) {
+		printf("FAILED (unsafe position used) ");
+		failed++;
+	}
+	chmod(path, S_IRUSR | S_IWUSR);
+	if (db_lease_read(dir, "user", &r, geteuid() + 1) == 0) {
+		printf("FAILED (position of other owner used) ");
+		failed++;
+	}
+
+	if (db_lease_write(dir, "../user", &l, (uid_t)-1, (gid_t)-1) == 0 ||
+	    db_lease_write(dir, ".user", &l, (uid_t)-1, (gid_t)-1) == 0) {
+		printf("FAILED (unsafe username accepted) ");
+		failed++;
+	}
+
+	db_lease_remove(dir, "user");
+	if (db_lease_read(dir, "user", &r, geteuid()) == 0) {
+		printf("FAILED (position not removed) ");
+		failed++;
+	}
+	rmdir(dir);
+
+	if (failed == 0)
+		printf("OK\n");
+	else
+		printf("\n");
+	return failed;
+}
+
+static int _db_testcase_record(void)
+{
+	const char *path = "/tmp/otpasswd_testcase_state";
+	char username[DB_RECORD_USER_SIZE] = "user";
+	unsigned char record[DB_RECORD_SIZE];
+	char text[STATE_ENTRY_SIZE], converted[STATE_ENTRY_SIZE];
+	char lck[100];
+	state s, r;
+	int failed = 0;
+	int length;
+	FILE *f;
+
+	printf("* Binary state records: ");
+	fflush(stdout);
+
+	memset(&s, 0, sizeof(s));
+	memset(&r, 0, sizeof(r));
+	s.username = username;
+	r.username = username;
+	memset(s.sequence_key, 0xA5, sizeof(s.sequence_key));
+	s.counter.hi = 0x0102030405060708ULL;
+	s.counter.lo = 0x1112131415161718ULL;
+	s.latest_card = num_i(17);
+	s.code_length = 4;
+	s.alphabet = 2;
+	s.flags = FLAG_SHOW;
+	s.failures = 3;
+	s.recent_failures = 1;
+	s.channel_time = 1234567890;
+	s.spass_set = 1;
+	s.spass_time = 987654321;
+	memset(s.spass, 0x5A, sizeof(s.spass));
+	strcpy(s.label, "label");
+	strcpy(s.contact, "contact@example.com");
+
+	if (db_record_encode(&s, record) != 0 ||
+	    db_record_decode(&r, record, sizeof(record), NULL) != 0 ||
+	    num_cmp(r.counter, s.counter) != 0 ||
+	    num_cmp(r.latest_card, s.latest_card) != 0 ||
+	    memcmp(r.sequence_key, s.sequence_key, sizeof(s.sequence_key)) != 0 ||
+	    memcmp(r.spass, s.spass, sizeof(s.spass)) != 0 ||
+	    r.spass_set != 1 || r.spass_time != s.spass_time ||
+	    r.code_length != 4 || r.alphabet != 2 || r.flags != FLAG_SHOW ||
+	    r.failures != 3 || r.recent_failures != 1 ||
+	    r.channel_time != s.channel_time ||
+	    strcmp(r.label, s.label) != 0 || strcmp(r.contact, s.contact) != 0) {
+		printf("FAILED (record not decoded) ");
+		failed++;
+	}
+
+	/* Damage is detected by CRC */
+	record[100] ^= 1;
+	if (db_record_decode(&r, record, sizeof(record), NULL) == 0) {
+		printf("FAILED (damaged record accepted) ");
+		failed++;
+	}
+	record[100] ^= 1;
+
+	if (db_record_decode(&r, record, sizeof(record) - 1, NULL) == 0) {
+		printf("FAILED (truncated record accepted) ");
+		failed++;
+	}
+
+	r.username = "other";
+	if (db_record_decode(&r, record, sizeof(record), NULL) == 0) {
+		printf("FAILED (record of other user accepted) ");
+		failed++;
+	}
+
+	/* Conversion both ways gives the same text entry */
+	length = db_file_entry_encode(&s, text, sizeof(text), 0);
+	f = fopen(path, "w");
+	assert(f);
+	fwrite(text, 1, length, f);
+	fclose(f);
+
+	if (db_file_convert_state(path, 1) != 0) {
+		printf("FAILED (conversion to binary) ");
+		failed++;
+	}
+
+	f = fopen(path, "r");
+	assert(f);
+	length = fread(converted, 1, sizeof(converted), f);
+	fclose(f);
+	if (length != DB_RECORD_SIZE ||
+	    !db_record_is_binary(converted, length)) {
+		printf("FAILED (state file not binary) ");
+		failed++;
+	}
+
+	if (db_file_convert_state(path, 0) != 0) {
+		printf("FAILED (conversion to text) ");
+		failed++;
+	}
+
+	f = fopen(path, "r");
+	assert(f);
+	length = fread(converted, 1, sizeof(converted), f);
+	fclose(f);
+	if (length != (int) strlen(text) || memcmp(converted, text, length) != 0) {
+		printf("FAILED (text entry changed) ");
+		failed++;
+	}
+
+	snprintf(lck, sizeof(lck), "%s.lck", path);
+	unlink(lck);
+	unlink(path);
+
+	if (failed == 0)
+		printf("OK\n");
+	else
+		printf("\n");
+	return failed;
+}
+
+#if DEBUG && defined(__GLIBC__)
+/* Allocations are counted while loading state. glibc allows
+ * replacing malloc; replacements pass to its implementation.
+ * Only in debug builds; the agent installed setuid keeps
+ * the allocator of libc. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static int _alloc_counting = 0;
+static int _alloc_count = 0;
+
+void *malloc(size_t size)
+{
+	_alloc_count += _alloc_counting;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+	_alloc_count += _alloc_counting;
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	_alloc_count += _alloc_counting;
+	return __libc_realloc(ptr, size);
+}
+#else
+/* Allocations are not counted */
+static int _alloc_counting = 0;
+static int _alloc_count = 0;
+#endif
+
+static int _db_testcase_parse(void)
+{
+	const char *jnl = "/tmp/otpasswd_testcase_parse.jnl";
+	const char *key = "000102030405060708090A0B0C0D0E0F"
+		"101112131415161718191a1b1c1d1e1f";
+	char username[DB_RECORD_USER_SIZE] = "user";
+	char entry[STATE_ENTRY_SIZE];
+	db_journal_record r;
+	state s, l;
+	int failed = 0, ret, i, length;
+	FILE *f;
+
+	/* Malformed entries; parser is expected to reject all of them */
+	static const char *const invalid[] = {
+		/* Not a hex digit in key */
+		"user:1:%.63sX:1:0:0:0:0:4:1:0::0::\n",
+		/* Counter longer than 128 bits */
+		"user:1:%s:100000000000000000000000000000000:0:0:0:0:4:1:0::0::\n",
+		/* Failures don't fit unsigned int */
+		"user:1:%s:1:0:4294967296:0:0:4:1:0::0::\n",
+		/* Empty and signed numbers */
+		"user:1:%s:1:0::0:0:4:1:0::0::\n",
+		"user:1:%s:1:0:0:0:-1:4:1:0::0::\n",
+		/* Field missing, field in excess */
+		"user:1:%s:1:0:0:0:0:4:1:0::0:\n",
+		"user:1:%s:1:0:0:0:0:4:1:0::0:::\n",
+		NULL,
+	};
+
+	printf("* Zero-allocation state loading: ");
+	fflush(stdout);
+
+	memset(&s, 0, sizeof(s));
+	s.username = username;
+
+	for (i = 0; invalid[i]; i++) {
+		snprintf(entry, sizeof(entry), invalid[i], key);
+		ret = db_file_entry_decode(&s, entry, strlen(entry), NULL);
+		if (ret == 0) {
+			printf("FAILED (invalid entry %d accepted) ", i);
+			failed++;
+		}
+	}
+
+	snprintf(entry, sizeof(entry),
+		 "user:1:%s:1F:A:4294967295:2:1234567890:4:1:3::0:label:contact\n",
+		 key);
+	db_journal_record_init(&r, "user");
+	r.counter_lo = 32;
+	unlink(jnl);
+	db_journal_append(jnl, &r, 0, (uid_t)-1, (gid_t)-1, NULL);
+
+	_alloc_count = 0;
+	_alloc_counting = 1;
+	ret = db_file_entry_decode(&s, entry, strlen(entry), NULL);
+	ret |= db_journal_find(jnl, "user", &r);
+	_alloc_counting = 0;
+
+	if (ret != 0 || s.counter.lo != 0x1F || s.latest_card.lo != 0xA ||
+	    s.sequence_key[10] != 0x0A || s.sequence_key[31] != 0x1F ||
+	    s.failures != 4294967295U || s.recent_failures != 2 ||
+	    s.channel_time != 1234567890 || s.flags != 3 ||
+	    s.spass_set != 0 || strcmp(s.label, "label") != 0 ||
+	    strcmp(s.contact, "contact") != 0 || r.counter_lo != 32) {
+		printf("FAILED (entry not parsed) ");
+		failed++;
+	}
+
+	if (_alloc_count != 0) {
+		printf("FAILED (%d allocations) ", _alloc_count);
+		failed++;
+	}
+
+	unlink(jnl);
+
+	/* Whole load of user state; the user was looked
+	 * up once by state_init */
+	if (state_init(&l, security_get_calling_user()) != 0 ||
+	    l.location.status != 0) {
+		printf("FAILED (state not located)\n");
+		return failed + 1;
+	}
+
+	memcpy(l.sequence_key, s.sequence_key, sizeof(l.sequence_key));
+	l.counter = num_i(1234);
+	length = db_file_entry_encode(&l, entry, sizeof(entry), 0);
+	f = fopen(l.location.db, "w");
+	assert(f);
+	fwrite(entry, 1, length, f);
+	fclose(f);
+	l.counter = num_i(0);
+
+	_alloc_count = 0;
+	_alloc_counting = 1;
+	ret = state_lock(&l);
+	ret |= state_load(&l);
+	ret |= state_unlock(&l);
+	_alloc_counting = 0;
+
+	if (ret != 0 || num_cmp(l.counter, num_i(1234)) != 0) {
+		printf("FAILED (state not loaded) ");
+		failed++;
+	}
+
+	if (_alloc_count != 0) {
+		printf("FAILED (%d allocations while loading) ", _alloc_count);
+		failed++;
+	}
+	state_fini(&l);
+
+	if (failed == 0)
+		printf("OK\n");
+	else
+		printf("\n");
+	return failed;
+}
+
+int db_testcase(int fast)
+{
+	int failed = 0;
+
+	printf("*** Database testcases\n");
+	failed += _db_testcase_index(fast);
+	failed += _db_testcase_convert(fast);
+	failed += _db_testcase_journal(fast);
+	failed += _db_testcase_shards(fast);
+	failed += _db_testcase_btree(fast);
+	failed += _db_testcase_torn();
+	failed += _db_testcase_stripes();
+	failed += _db_testcase_lease_db();
+	failed += _db_testcase_lease();
+	failed += _db_testcase_record();
+	failed += _db_testcase_parse();
+	return failed;
+}
@@ -33,6 +33,7 @@ extern int state_testcase(void);
 extern int spass_testcase(void);
 extern int ppp_testcase(int fast);
 extern int config_testcase(void);
+extern int db_testcase(int fast);
 
 
 #endif
@@ -19,24 +19,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <assert.h>
 
 #include "crypto.h"
 
-/* Select implementation... */
-#define USE_SLOWAES 0
-#define USE_POLARSSL 1
-#define USE_OPENSSL 0
-
-
-#define USE_SHA256_COREUTILS 1
-
 
 #if USE_OPENSSL
 
 #include <openssl/evp.h>
 #include <openssl/rand.h>
-#include <openssl/sha.h>
 
 int crypto_ossl_rng(unsigned char *buff, const int size, int secure)
 {
@@ -53,48 +45,56 @@ int crypto_ossl_rng(unsigned char *buff, const int size, int secure)
 
 	assert(RAND_status() == 1);
 
-	if (RAND_bytes(buff, size) != 1) {
-		RAND_cleanup();
+	if (RAND_bytes(buff, size) != 1)
 		return 1;
-	}
 
-	RAND_cleanup();
 	return 0;
 }
 
+int crypto_aes_init(crypto_aes_ctx *ctx, const unsigned char *key)
+{
+	return openssl_setkey_enc(&ctx->openssl, key);
+}
+
+int crypto_aes_rekey(crypto_aes_ctx *ctx, const unsigned char *key)
+{
+	return openssl_rekey_enc(&ctx->openssl, key);
+}
+
+int crypto_aes_encrypt_ctx(const crypto_aes_ctx *ctx,
+			   const unsigned char *plain,
+			   unsigned char *encrypted)
+{
+	return openssl_encrypt_blocks(&ctx->openssl, plain, encrypted, 1);
+}
+
+int crypto_aes_encrypt_blocks(const crypto_aes_ctx *ctx,
+			      const unsigned char *plain,
+			      unsigned char *encrypted,
+			      int blocks)
+{
+	assert(blocks >= 0);
+	return openssl_encrypt_blocks(&ctx->openssl, plain, encrypted, blocks);
+}
+
+void crypto_aes_clear(crypto_aes_ctx *ctx)
+{
+	openssl_clear(&ctx->openssl);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
 int crypto_aes_encrypt(const unsigned char *key,
 		     const unsigned char *plain,
 		     unsigned char *encrypted)
 {
+	crypto_aes_ctx ctx;
 	int ret;
-	int written = 0;
-	EVP_CIPHER_CTX ctx;
 
-	/* Paranoid check */
-	assert(EVP_MAX_KEY_LENGTH == 32);
-
-	ret = EVP_EncryptInit(&ctx, EVP_aes_256_cbc(), key, NULL);
-	if (ret != 1)
-		return 1;
+	ret = crypto_aes_init(&ctx, key);
+	if (ret == 0)
+		ret = crypto_aes_encrypt_ctx(&ctx, plain, encrypted);
 
-	EVP_CIPHER_CTX_set_padding(&ctx, 0);
-
-	ret = EVP_EncryptUpdate(&ctx, encrypted, &written, plain, 128/8);
-	if (ret != 1) {
-		ret = 1;
-		goto cleanup;
-	}
-	
-	if (written != 128/8) {
-		ret = 1;
-		goto cleanup;
-	} else {
-		ret = 0;
-	}
-
-cleanup:
-	if (EVP_CIPHER_CTX_cleanup(&ctx) != 1)
-		return 1;
+	crypto_aes_clear(&ctx);
 	return ret;
 }
 
@@ -103,40 +103,34 @@ int crypto_aes_decrypt(const unsigned char *key,
 		unsigned char *decrypted)
 {
 	int ret;
-	EVP_CIPHER_CTX ctx;
-	int written = 128/8;
+	int written = 0;
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
 
-	ret = EVP_DecryptInit(&ctx, EVP_aes_256_cbc(), key, NULL);
-	if (ret != 1)
+	if (ctx == NULL)
 		return 1;
 
-	EVP_CIPHER_CTX_set_padding(&ctx, 0);
-
-	ret = EVP_DecryptUpdate(&ctx, decrypted, &written, encrypted, 16);
+	ret = EVP_DecryptInit_ex2(ctx, EVP_aes_256_ecb(), key, NULL, NULL);
 	if (ret != 1) {
 		ret = 1;
 		goto cleanup;
 	}
-		
-	if (written != 128/8) {
+
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+	ret = EVP_DecryptUpdate(ctx, decrypted, &written, encrypted, 16);
+	if (ret != 1 || written != 128/8)
 		ret = 1;
-		goto cleanup;
-	} else {
+	else
 		ret = 0;
-	}
 
 cleanup:
-	if (EVP_CIPHER_CTX_cleanup(&ctx) != 1)
-		return 1;
+	EVP_CIPHER_CTX_free(ctx);
 	return ret;
 }
 
 int crypto_sha256(const unsigned char *data, const unsigned int length, unsigned char *hash)
 {
-	SHA256(data, length, hash);
-
-	/* In openssl implementation it seems to always succeed */
-	return 0;
+	return openssl_sha256(data, length, hash);
 }
 
 #endif /* USE_OPENSSL */
@@ -148,6 +142,11 @@ int crypto_sha256(const unsigned char *data, const unsigned int length, unsigned
 
 int crypto_sha256(const unsigned char *data, const unsigned int length, unsigned char *hash)
 {
+#if USE_POLARSSL
+	if (crypto_aes_get_backend() == CRYPTO_AES_OPENSSL)
+		return openssl_sha256(data, length, hash);
+#endif
+
 	if (sha256_buffer (data, length, hash) == NULL) {
 		return 1;
 	}
@@ -157,7 +156,32 @@ int crypto_sha256(const unsigned char *data, const unsigned int length, unsigned
 
 #if USE_SLOWAES
 
-#include "aes256.h"
+int crypto_aes_init(crypto_aes_ctx *ctx, const unsigned char *key)
+{
+	aes256_init(&ctx->aes, key);
+	return 0;
+}
+
+int crypto_aes_rekey(crypto_aes_ctx *ctx, const unsigned char *key)
+{
+	crypto_aes_clear(ctx);
+	return crypto_aes_init(ctx, key);
+}
+
+int crypto_aes_encrypt_ctx(const crypto_aes_ctx *ctx,
+			   const unsigned char *plain,
+			   unsigned char *encrypted)
+{
+	memcpy(encrypted, plain, 16);
+	aes256_encrypt_ecb((aes256_context *)&ctx->aes, encrypted);
+	return 0;
+}
+
+void crypto_aes_clear(crypto_aes_ctx *ctx)
+{
+	aes256_done(&ctx->aes);
+	memset(ctx, 0, sizeof(*ctx));
+}
 
 int crypto_aes_encrypt(const unsigned char *key,
 		     const unsigned char *plain,
@@ -193,21 +217,144 @@ int crypto_aes_decrypt(const unsigned char *key,
 
 #if USE_POLARSSL
 
-#include "polarssl_aes.h"
+/* Backend requested by crypto_aes_set_backend() */
+static int aes_backend = CRYPTO_AES_AUTO;
 
-int crypto_aes_encrypt(const unsigned char *key,
-		     const unsigned char *plain,
-		     unsigned char *encrypted)
+static int _crypto_aes_resolve(int backend)
 {
-	aes_context ctx;
-	aes_setkey_enc(&ctx, key, 256);
+	if (backend != CRYPTO_AES_AUTO)
+		return backend;
 
+	/* Library was built with OpenSSL on purpose */
+	if (openssl_available())
+		return CRYPTO_AES_OPENSSL;
 
-	aes_crypt_ecb(&ctx, AES_ENCRYPT, plain, encrypted);
+	/* Prefer constant-time implementations */
+	return aesni_available() ? CRYPTO_AES_AESNI : CRYPTO_AES_BITSLICE;
+}
 
+int crypto_aes_set_backend(int backend)
+{
+	switch (backend) {
+	case CRYPTO_AES_AUTO:
+	case CRYPTO_AES_TABLE:
+	case CRYPTO_AES_BITSLICE:
+		break;
+	case CRYPTO_AES_AESNI:
+		if (!aesni_available())
+			return 1;
+		break;
+	case CRYPTO_AES_OPENSSL:
+		if (!openssl_available())
+			return 1;
+		break;
+	default:
+		return 1;
+	}
+	aes_backend = backend;
+	return 0;
+}
 
+int crypto_aes_get_backend(void)
+{
+	return _crypto_aes_resolve(aes_backend);
+}
 
-	return 0;
+int crypto_aes_init(crypto_aes_ctx *ctx, const unsigned char *key)
+{
+	/* Backend is fixed for the lifetime of the context */
+	ctx->backend = _crypto_aes_resolve(aes_backend);
+
+	switch (ctx->backend) {
+	case CRYPTO_AES_AESNI:
+		aesni_setkey_enc(&ctx->aesni, key);
+		return 0;
+
+	case CRYPTO_AES_BITSLICE:
+		bitslice_setkey_enc(&ctx->bitslice, key);
+		return 0;
+
+	case CRYPTO_AES_OPENSSL:
+		return openssl_setkey_enc(&ctx->openssl, key);
+
+	case CRYPTO_AES_TABLE:
+	default:
+		if (aes_setkey_enc(&ctx->aes, key, 256) != 0)
+			return 1;
+		return 0;
+	}
+}
+
+int crypto_aes_encrypt_ctx(const crypto_aes_ctx *ctx,
+			   const unsigned char *plain,
+			   unsigned char *encrypted)
+{
+	return crypto_aes_encrypt_blocks(ctx, plain, encrypted, 1);
+}
+
+int crypto_aes_encrypt_blocks(const crypto_aes_ctx *ctx,
+			      const unsigned char *plain,
+			      unsigned char *encrypted,
+			      int blocks)
+{
+	int i;
+	assert(blocks >= 0);
+
+	switch (ctx->backend) {
+	case CRYPTO_AES_AESNI:
+		aesni_encrypt_blocks(&ctx->aesni, plain, encrypted, blocks);
+		return 0;
+
+	case CRYPTO_AES_BITSLICE:
+		bitslice_encrypt_blocks(&ctx->bitslice, plain, encrypted, blocks);
+		return 0;
+
+	case CRYPTO_AES_OPENSSL:
+		return openssl_encrypt_blocks(&ctx->openssl, plain, encrypted, blocks);
+
+	case CRYPTO_AES_TABLE:
+	default:
+		/* Encryption doesn't modify the context */
+		for (i = 0; i < blocks; i++) {
+			aes_crypt_ecb((aes_context *)&ctx->aes, AES_ENCRYPT,
+				      plain + 16*i, encrypted + 16*i);
+		}
+		return 0;
+	}
+}
+
+int crypto_aes_rekey(crypto_aes_ctx *ctx, const unsigned char *key)
+{
+	/* Only libcrypto context holds resources worth keeping */
+	if (ctx->backend == CRYPTO_AES_OPENSSL &&
+	    _crypto_aes_resolve(aes_backend) == CRYPTO_AES_OPENSSL)
+		return openssl_rekey_enc(&ctx->openssl, key);
+
+	crypto_aes_clear(ctx);
+	return crypto_aes_init(ctx, key);
+}
+
+void crypto_aes_clear(crypto_aes_ctx *ctx)
+{
+	/* Key schedule of this one lives in libcrypto */
+	if (ctx->backend == CRYPTO_AES_OPENSSL)
+		openssl_clear(&ctx->openssl);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+int crypto_aes_encrypt(const unsigned char *key,
+		     const unsigned char *plain,
+		     unsigned char *encrypted)
+{
+	crypto_aes_ctx ctx;
+	int ret;
+
+	ret = crypto_aes_init(&ctx, key);
+	if (ret == 0)
+		ret = crypto_aes_encrypt_ctx(&ctx, plain, encrypted);
+
+	crypto_aes_clear(&ctx);
+	return ret;
 }
 
 int crypto_aes_decrypt(const unsigned char *key, 
@@ -224,6 +371,67 @@ int crypto_aes_decrypt(const unsigned char *key,
 
 #endif /* USE_POLARSSL */
 
+#if !USE_POLARSSL
+/* Other backends have no runtime dispatch */
+int crypto_aes_set_backend(int backend)
+{
+	return (backend == CRYPTO_AES_AUTO || backend == CRYPTO_AES_TABLE) ? 0 : 1;
+}
+
+int crypto_aes_get_backend(void)
+{
+	return CRYPTO_AES_TABLE;
+}
+#endif /* !USE_POLARSSL */
+
+#if USE_SLOWAES
+int crypto_aes_encrypt_blocks(const crypto_aes_ctx *ctx,
+			      const unsigned char *plain,
+			      unsigned char *encrypted,
+			      int blocks)
+{
+	int i;
+	assert(blocks >= 0);
+
+	/* Blocks are independent; backend is free to process
+	 * them in any order */
+	for (i = 0; i < blocks; i++) {
+		if (crypto_aes_encrypt_ctx(ctx, plain + 16*i, encrypted + 16*i) != 0)
+			return 1;
+	}
+	return 0;
+}
+#endif /* USE_SLOWAES */
+
+const char *crypto_aes_backend_name(int backend)
+{
+	switch (backend) {
+	case CRYPTO_AES_AUTO:
+		return "auto";
+	case CRYPTO_AES_TABLE:
+		return "table";
+	case CRYPTO_AES_AESNI:
+		return "aes-ni";
+	case CRYPTO_AES_BITSLICE:
+		return "bitslice";
+	case CRYPTO_AES_OPENSSL:
+		return "openssl";
+	default:
+		return "unknown";
+	}
+}
+
+int crypto_aes_backend_parse(const char *name)
+{
+	int backend;
+
+	for (backend = CRYPTO_AES_AUTO; backend <= CRYPTO_AES_OPENSSL; backend++) {
+		if (strcasecmp(name, crypto_aes_backend_name(backend)) == 0)
+			return backend;
+	}
+	return -1;
+}
+
 
 extern int crypto_salted_sha256(const unsigned char *data,
 				const unsigned int length, 
@@ -22,6 +22,76 @@
 #ifndef _CRYPTO_H_
 #define _CRYPTO_H_
 
+/* Select implementation... */
+#define USE_SLOWAES 0
+#define USE_POLARSSL 1
+#define USE_OPENSSL 0
+
+#define USE_SHA256_COREUTILS 1
+
+#if USE_POLARSSL
+#include "polarssl_aes.h"
+#include "aesni_aes.h"
+#include "bitslice_aes.h"
+#include "openssl_aes.h"
+#endif
+
+#if USE_OPENSSL
+#include "openssl_aes.h"
+#endif
+
+#if USE_SLOWAES
+#include "slow_aes256.h"
+#endif
+
+/** Expanded AES-256 encryption key. Initialized once with
+ * crypto_aes_init() and then reused for any number of blocks
+ * encrypted with the same key. Holds key material - always
+ * clear it with crypto_aes_clear(), also before initializing it
+ * again. Musn't be copied by value as polarssl context points
+ * into itself.
+ */
+typedef struct {
+#if USE_POLARSSL
+	int backend;		/* Resolved CRYPTO_AES_* backend */
+	aes_context aes;
+	aesni_context aesni;
+	bitslice_context bitslice;
+	openssl_context openssl;
+#elif USE_SLOWAES
+	aes256_context aes;
+#elif USE_OPENSSL
+	openssl_context openssl;
+#else
+	unsigned char key[32];
+#endif
+} crypto_aes_ctx;
+
+/** AES implementations. With polarssl build the backend is chosen
+ * at runtime: AES-NI when CPU supports it, constant-time bitsliced
+ * otherwise. Table-based polarssl can still be selected explicitly.
+ * When built with OpenSSL (HAVE_OPENSSL) libcrypto is preferred and
+ * is used for SHA-256 as well. */
+enum crypto_aes_backend {
+	CRYPTO_AES_AUTO = 0,
+	CRYPTO_AES_TABLE = 1,
+	CRYPTO_AES_AESNI = 2,
+	CRYPTO_AES_BITSLICE = 3,
+	CRYPTO_AES_OPENSSL = 4,
+};
+
+/* Force AES backend used by contexts initialized later.
+ * Returns 1 if the backend is not available on this machine. */
+extern int crypto_aes_set_backend(int backend);
+
+/* Backend which will be used by next crypto_aes_init() */
+extern int crypto_aes_get_backend(void);
+
+extern const char *crypto_aes_backend_name(int backend);
+
+/* Backend with given name or -1 if name is unknown */
+extern int crypto_aes_backend_parse(const char *name);
+
 /* Get some fast cryptographically-secure pseudo-random data
  * and store in a buff. With secure=1 uses real random seed.
  */
@@ -48,6 +118,35 @@ extern int crypto_aes_encrypt(
 	const unsigned char *plain,
 	unsigned char *encrypted);
 
+/* Expand 256 bit key into the context */
+extern int crypto_aes_init(
+	crypto_aes_ctx *ctx,
+	const unsigned char *key);
+
+/* Replace key of initialized or zeroed context. Resources of the
+ * context are reused where the backend allows it, so a context set
+ * up once can be rekeyed without allocating. */
+extern int crypto_aes_rekey(
+	crypto_aes_ctx *ctx,
+	const unsigned char *key);
+
+/* Encrypt 128 bits using previously expanded key */
+extern int crypto_aes_encrypt_ctx(
+	const crypto_aes_ctx *ctx,
+	const unsigned char *plain,
+	unsigned char *encrypted);
+
+/* Encrypt a run of independent 128 bit blocks (ECB) using
+ * previously expanded key. plain and encrypted hold blocks*16 bytes */
+extern int crypto_aes_encrypt_blocks(
+	const crypto_aes_ctx *ctx,
+	const unsigned char *plain,
+	unsigned char *encrypted,
+	int blocks);
+
+/* Zero expanded key */
+extern void crypto_aes_clear(crypto_aes_ctx *ctx);
+
 /* Decrypt 128 bits with 256 bit key */
 
 extern int crypto_aes_decrypt(
@@ -29,7 +29,6 @@
 
 static char num_overflow = 0;
 
-#define num_set_overflow() _num_set_overflow(__FILE__, __LINE__)
 void _num_set_overflow(const char *file, int location)
 {
 	print(PRINT_WARN, "(%s:%d Overflow!)\n", file, location);
@@ -104,98 +103,6 @@ int num_cmp(const num_t arg1, const num_t arg2)
 	return 0;
 }
 
-num_t num_add(const num_t arg1, const num_t arg2)
-{
-	num_t r = {
-		.lo = arg1.lo + arg2.lo,
-		.hi = arg1.hi + arg2.hi
-	};
-
-	if (r.hi < arg1.hi)
-		num_set_overflow();
-
-	if (r.lo < arg1.lo) {
-		r.hi += 1;
-		if (r.hi < 1)
-			num_set_overflow();
-	}
-
-	return r;
-}
-
-num_t num_sub(const num_t arg1, const num_t arg2)
-{
-	num_t r = {
-		.lo = arg1.lo - arg2.lo,
-		.hi = arg1.hi - arg2.hi
-	};
-
-	/* Overflow in high subtraction */
-	if (r.hi > arg1.hi)
-		num_set_overflow();
-
-	/* Overflow in low subtraction */
-	if (r.lo > arg1.lo) {
-		const uint64_t tmp = r.hi - 1;
-		if (tmp > r.hi)
-			num_set_overflow();
-		r.hi = tmp;
-	}
-	return r;
-}
-
-num_t num_mul_i(num_t arg1, const uint64_t arg2)
-{
-	int i;
-	int can_overflow = 0;
-	num_t reply = num_zero();
-	num_t r = num_i(arg2);
-	for (i=0; i<128; i++) {
-		if (arg1.lo & 0x01) {
-			if (can_overflow)
-				num_set_overflow();
-			reply = num_add(reply, r);
-		}
-
-		arg1 = num_rshift(arg1);
-
-		if (r.hi & 0x8000000000000000ULL)
-			can_overflow = 1;
-		r = num_lshift(r);
-	}
-	return reply;
-}
-
-uint64_t num_div_i(num_t *result, const num_t divwhat, const uint64_t divby)
-{
-	int i;
-	uint64_t remainder = 0;
-	char overflow = 0;
-
-	*result = divwhat;
-
-	for (i = 0; i < 128; i++) {
-		if (remainder & 0x8000000000000000ULL)
-			overflow = 1;
-		remainder <<= 1;
-
-		if (result->hi & 0x8000000000000000ULL)
-			remainder |= 1;
-
-		*result = num_lshift(*result);
-		if (overflow) {
-			remainder = 0xFFFFFFFFFFFFFFFFULL - divby + 1 + remainder;
-			result->lo |= 1;
-			overflow = 0;
-		} else if (remainder >= divby) {
-			remainder -= divby;
-			result->lo |= 1;
-		}
-	}
-	return remainder;
-}
-
-
 /***********************************************
  * Conversions
  **********************************************/
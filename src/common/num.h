@@ -96,15 +96,160 @@ extern int num_cmp(num_t arg1, num_t arg2);
 
 /*****************************
  * Arithmetic operations
+ *
+ * Those are called in passcode generation and conversion loops,
+ * so they are inline and work on whole 64 bit words. Where
+ * compiler provides 128 bit integer type it is used for multiplication.
  *****************************/
+
+#if defined(__SIZEOF_INT128__)
+#define NUM_HAVE_INT128 1
+#else
+#define NUM_HAVE_INT128 0
+#endif
+
+/** Marks that last operation overflowed. Defined in num.c */
+extern void _num_set_overflow(const char *file, int location);
+#define num_set_overflow() _num_set_overflow(__FILE__, __LINE__)
+
 /** Add two nums */
-extern num_t num_add(const num_t arg1, const num_t arg2);
+static inline num_t num_add(const num_t arg1, const num_t arg2)
+{
+	num_t r = {
+		.hi = arg1.hi + arg2.hi,
+		.lo = arg1.lo + arg2.lo,
+	};
+
+	if (r.hi < arg1.hi)
+		num_set_overflow();
+
+	if (r.lo < arg1.lo) {
+		r.hi += 1;
+		if (r.hi < 1)
+			num_set_overflow();
+	}
+
+	return r;
+}
+
 /** Subtract two nums */
-extern num_t num_sub(const num_t arg1, const num_t arg2);
+static inline num_t num_sub(const num_t arg1, const num_t arg2)
+{
+	num_t r = {
+		.hi = arg1.hi - arg2.hi,
+		.lo = arg1.lo - arg2.lo,
+	};
+
+	/* Overflow in high subtraction */
+	if (r.hi > arg1.hi)
+		num_set_overflow();
+
+	/* Overflow in low subtraction */
+	if (r.lo > arg1.lo) {
+		const uint64_t tmp = r.hi - 1;
+		if (tmp > r.hi)
+			num_set_overflow();
+		r.hi = tmp;
+	}
+	return r;
+}
+
+/** Full 64x64 -> 128 bit multiplication */
+static inline void _num_mul64(const uint64_t a, const uint64_t b,
+			      uint64_t *hi, uint64_t *lo)
+{
+#if NUM_HAVE_INT128
+	const unsigned __int128 r = (unsigned __int128)a * b;
+	*hi = (uint64_t)(r >> 64);
+	*lo = (uint64_t)r;
+#else
+	/* Schoolbook on 32 bit halves */
+	const uint64_t a_lo = a & 0xFFFFFFFFULL, a_hi = a >> 32;
+	const uint64_t b_lo = b & 0xFFFFFFFFULL, b_hi = b >> 32;
+	const uint64_t ll = a_lo * b_lo;
+	const uint64_t lh = a_lo * b_hi;
+	const uint64_t hl = a_hi * b_lo;
+	const uint64_t hh = a_hi * b_hi;
+	const uint64_t mid = (ll >> 32) + (lh & 0xFFFFFFFFULL) + (hl & 0xFFFFFFFFULL);
+
+	*lo = (mid << 32) | (ll & 0xFFFFFFFFULL);
+	*hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+/** Divide 128 bit number (hi, lo) by divby. Requires hi < divby,
+ * so that quotient fits in 64 bits. */
+static inline uint64_t _num_div128(const uint64_t hi, const uint64_t lo,
+				   const uint64_t divby, uint64_t *remainder)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+	uint64_t q, r;
+	__asm__ ("divq %4" : "=a" (q), "=d" (r) : "a" (lo), "d" (hi), "rm" (divby));
+	*remainder = r;
+	return q;
+#elif NUM_HAVE_INT128
+	const unsigned __int128 n = ((unsigned __int128)hi << 64) | lo;
+	const uint64_t q = (uint64_t)(n / divby);
+	*remainder = lo - q * divby;
+	return q;
+#else
+	uint64_t q = 0, r = hi;
+	int i;
+
+	if (divby <= 0xFFFFFFFFULL) {
+		/* Two steps of 32 bit long division; can't overflow */
+		uint64_t t = (r << 32) | (lo >> 32);
+		q = (t / divby) << 32;
+		r = t % divby;
+		t = (r << 32) | (lo & 0xFFFFFFFFULL);
+		q |= t / divby;
+		*remainder = t % divby;
+		return q;
+	}
+
+	/* Restoring division, one bit at a time */
+	for (i = 63; i >= 0; i--) {
+		const int carry = (r >> 63) != 0;
+		r = (r << 1) | ((lo >> i) & 1);
+		if (carry || r >= divby) {
+			r -= divby;
+			q |= 1ULL << i;
+		}
+	}
+	*remainder = r;
+	return q;
+#endif
+}
+
 /** Mul num by integer */
-extern num_t num_mul_i(num_t arg1, const uint64_t arg2);
+static inline num_t num_mul_i(const num_t arg1, const uint64_t arg2)
+{
+	num_t r;
+	uint64_t lo_carry, hi_hi, hi_lo;
+
+	_num_mul64(arg1.lo, arg2, &lo_carry, &r.lo);
+	_num_mul64(arg1.hi, arg2, &hi_hi, &hi_lo);
+
+	r.hi = lo_carry + hi_lo;
+	if (hi_hi != 0 || r.hi < hi_lo)
+		num_set_overflow();
+
+	return r;
+}
+
 /** Divide num by integer. Whole part in result, reminder is returned */
-extern uint64_t num_div_i(num_t *result, const num_t divwhat, const uint64_t divby);
+static inline uint64_t num_div_i(num_t *result, const num_t divwhat, const uint64_t divby)
+{
+	uint64_t remainder;
+	const uint64_t hi = divwhat.hi;
+	const uint64_t lo = divwhat.lo;
+
+	assert(divby != 0);
+
+	result->hi = hi / divby;
+	result->lo = _num_div128(hi % divby, lo, divby, &remainder);
+	return remainder;
+}
 
 /** Add to integer */
 #define num_add_i(a, b) num_add((a), num_i(b))
@@ -0,0 +1,177 @@
+ /**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   AES-256 encryption using x86 AES-NI instructions.
+ *   Functions are compiled with target attribute, so the rest of the
+ *   program doesn't need -maes and still runs on older CPUs.
+ **********************************************************************/
+
+#include <string.h>
+#include <assert.h>
+
+#include "aesni_aes.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define AESNI_SUPPORTED 1
+#else
+#define AESNI_SUPPORTED 0
+#endif
+
+#if AESNI_SUPPORTED
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+int aesni_available(void)
+{
+	static int available = -1;
+	unsigned int eax, ebx, ecx, edx;
+
+	if (available != -1)
+		return available;
+
+	if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+		available = 0;
+	else
+		available = (ecx & bit_AES) ? 1 : 0;
+
+	return available;
+}
+
+/* Prefix-xor of four 32 bit words: w0, w0^w1, w0^w1^w2, ... */
+static inline AESNI_TARGET __m128i _aesni_prefix_xor(__m128i k)
+{
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	return k;
+}
+
+/* aeskeygenassist requires immediate round constant, hence macros */
+#define _AESNI_EXPAND_A(prev2, prev1, rcon)				\
+	_mm_xor_si128(_aesni_prefix_xor(prev2),				\
+		      _mm_shuffle_epi32(					\
+			      _mm_aeskeygenassist_si128(prev1, rcon), 0xff))
+
+#define _AESNI_EXPAND_B(prev2, prev1)					\
+	_mm_xor_si128(_aesni_prefix_xor(prev2),				\
+		      _mm_shuffle_epi32(					\
+			      _mm_aeskeygenassist_si128(prev1, 0x00), 0xaa))
+
+AESNI_TARGET
+void aesni_setkey_enc(aesni_context *ctx, const unsigned char *key)
+{
+	__m128i rk[15];
+	int i;
+
+	rk[0] = _mm_loadu_si128((const __m128i *)key);
+	rk[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+
+	rk[2]  = _AESNI_EXPAND_A(rk[0],  rk[1],  0x01);
+	rk[3]  = _AESNI_EXPAND_B(rk[1],  rk[2]);
+	rk[4]  = _AESNI_EXPAND_A(rk[2],  rk[3],  0x02);
+	rk[5]  = _AESNI_EXPAND_B(rk[3],  rk[4]);
+	rk[6]  = _AESNI_EXPAND_A(rk[4],  rk[5],  0x04);
+	rk[7]  = _AESNI_EXPAND_B(rk[5],  rk[6]);
+	rk[8]  = _AESNI_EXPAND_A(rk[6],  rk[7],  0x08);
+	rk[9]  = _AESNI_EXPAND_B(rk[7],  rk[8]);
+	rk[10] = _AESNI_EXPAND_A(rk[8],  rk[9],  0x10);
+	rk[11] = _AESNI_EXPAND_B(rk[9],  rk[10]);
+	rk[12] = _AESNI_EXPAND_A(rk[10], rk[11], 0x20);
+	rk[13] = _AESNI_EXPAND_B(rk[11], rk[12]);
+	rk[14] = _AESNI_EXPAND_A(rk[12], rk[13], 0x40);
+
+	for (i = 0; i < 15; i++) {
+		_mm_storeu_si128((__m128i *)(ctx->rk + 16*i), rk[i]);
+		rk[i] = _mm_setzero_si128();
+	}
+}
+
+AESNI_TARGET
+void aesni_encrypt_blocks(const aesni_context *ctx,
+			  const unsigned char *plain,
+			  unsigned char *encrypted,
+			  int blocks)
+{
+	__m128i rk[15];
+	int i, r;
+
+	for (r = 0; r < 15; r++)
+		rk[r] = _mm_loadu_si128((const __m128i *)(ctx->rk + 16*r));
+
+	/* Four independent blocks hide aesenc latency */
+	for (i = 0; i + 4 <= blocks; i += 4) {
+		const __m128i *in = (const __m128i *)(plain + 16*i);
+		__m128i *out = (__m128i *)(encrypted + 16*i);
+		__m128i b0 = _mm_xor_si128(_mm_loadu_si128(in + 0), rk[0]);
+		__m128i b1 = _mm_xor_si128(_mm_loadu_si128(in + 1), rk[0]);
+		__m128i b2 = _mm_xor_si128(_mm_loadu_si128(in + 2), rk[0]);
+		__m128i b3 = _mm_xor_si128(_mm_loadu_si128(in + 3), rk[0]);
+
+		for (r = 1; r < 14; r++) {
+			b0 = _mm_aesenc_si128(b0, rk[r]);
+			b1 = _mm_aesenc_si128(b1, rk[r]);
+			b2 = _mm_aesenc_si128(b2, rk[r]);
+			b3 = _mm_aesenc_si128(b3, rk[r]);
+		}
+
+		_mm_storeu_si128(out + 0, _mm_aesenclast_si128(b0, rk[14]));
+		_mm_storeu_si128(out + 1, _mm_aesenclast_si128(b1, rk[14]));
+		_mm_storeu_si128(out + 2, _mm_aesenclast_si128(b2, rk[14]));
+		_mm_storeu_si128(out + 3, _mm_aesenclast_si128(b3, rk[14]));
+	}
+
+	/* Remaining blocks one by one */
+	for (; i < blocks; i++) {
+		__m128i b = _mm_loadu_si128((const __m128i *)(plain + 16*i));
+		b = _mm_xor_si128(b, rk[0]);
+		for (r = 1; r < 14; r++)
+			b = _mm_aesenc_si128(b, rk[r]);
+		b = _mm_aesenclast_si128(b, rk[14]);
+		_mm_storeu_si128((__m128i *)(encrypted + 16*i), b);
+	}
+
+	for (r = 0; r < 15; r++)
+		rk[r] = _mm_setzero_si128();
+}
+
+#else /* AESNI_SUPPORTED */
+
+int aesni_available(void)
+{
+	return 0;
+}
+
+void aesni_setkey_enc(aesni_context *ctx, const unsigned char *key)
+{
+	/* Never called when aesni_available() returns 0 */
+	assert(0);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+void aesni_encrypt_blocks(const aesni_context *ctx,
+			  const unsigned char *plain,
+			  unsigned char *encrypted,
+			  int blocks)
+{
+	assert(0);
+}
+
+#endif /* AESNI_SUPPORTED */
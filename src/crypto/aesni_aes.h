@@ -0,0 +1,45 @@
+ /**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   AES-256 encryption using x86 AES-NI instructions. Compiled
+ *   on every platform; aesni_available() tells at runtime whether
+ *   the remaining functions may be called.
+ **********************************************************************/
+
+#ifndef _AESNI_AES_H_
+#define _AESNI_AES_H_
+
+/** Expanded AES-256 encryption key: 15 round keys */
+typedef struct {
+	unsigned char rk[15 * 16];
+} aesni_context;
+
+/** Returns 1 if CPU supports AES-NI and this build can use it */
+extern int aesni_available(void);
+
+/** Expand 256 bit key */
+extern void aesni_setkey_enc(aesni_context *ctx, const unsigned char *key);
+
+/** Encrypt a number of independent 16 byte blocks (ECB).
+ * Blocks are interleaved four at a time. */
+extern void aesni_encrypt_blocks(const aesni_context *ctx,
+				 const unsigned char *plain,
+				 unsigned char *encrypted,
+				 int blocks);
+
+#endif
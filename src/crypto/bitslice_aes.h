@@ -0,0 +1,51 @@
+ /**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Constant-time bitsliced AES-256 encryption. Uses no table
+ *   lookups or secret-dependent branches, so it can be used where
+ *   AES-NI is not available. Four blocks are encrypted at once in
+ *   64 bit words.
+ *
+ *   Based on BearSSL's aes_ct64 code, Copyright (c) 2016 Thomas
+ *   Pornin <pornin@bolet.org>, MIT license; see bitslice_aes.c for
+ *   the full notice.
+ **********************************************************************/
+
+#ifndef _BITSLICE_AES_H_
+#define _BITSLICE_AES_H_
+
+#include <stdint.h>
+
+/** Number of blocks processed in one pass */
+#define BITSLICE_AES_LANES 4
+
+/** Expanded, bitsliced AES-256 encryption key */
+typedef struct {
+	uint64_t skey[15 * 8];
+} bitslice_context;
+
+/** Expand 256 bit key */
+extern void bitslice_setkey_enc(bitslice_context *ctx, const unsigned char *key);
+
+/** Encrypt a number of independent 16 byte blocks (ECB) */
+extern void bitslice_encrypt_blocks(const bitslice_context *ctx,
+				    const unsigned char *plain,
+				    unsigned char *encrypted,
+				    int blocks);
+
+#endif
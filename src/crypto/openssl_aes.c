@@ -0,0 +1,179 @@
+ /**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   AES-256 and SHA-256 using OpenSSL 3 libcrypto. Algorithms are
+ *   fetched from the default provider once and reused; each key
+ *   gets one EVP_CIPHER_CTX which encrypts whole runs of counters.
+ **********************************************************************/
+
+#include <string.h>
+#include <assert.h>
+
+#include "openssl_aes.h"
+
+#ifndef HAVE_OPENSSL
+#define HAVE_OPENSSL 0
+#endif
+
+#if HAVE_OPENSSL
+
+#include <openssl/evp.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+#error OpenSSL 3.0 or newer is required
+#endif
+
+/* Fetched once; fetching is expensive and results are immutable */
+static EVP_CIPHER *aes_ecb = NULL;
+static EVP_MD *sha256 = NULL;
+
+static int _openssl_fetch(void)
+{
+	if (aes_ecb == NULL)
+		aes_ecb = EVP_CIPHER_fetch(NULL, "AES-256-ECB", NULL);
+	if (sha256 == NULL)
+		sha256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+
+	return (aes_ecb != NULL && sha256 != NULL) ? 0 : 1;
+}
+
+int openssl_available(void)
+{
+	return _openssl_fetch() == 0 ? 1 : 0;
+}
+
+int openssl_setkey_enc(openssl_context *ctx, const unsigned char *key)
+{
+	EVP_CIPHER_CTX *evp;
+
+	ctx->evp = NULL;
+	if (_openssl_fetch() != 0)
+		return 1;
+
+	evp = EVP_CIPHER_CTX_new();
+	if (evp == NULL)
+		return 1;
+
+	if (EVP_EncryptInit_ex2(evp, aes_ecb, key, NULL, NULL) != 1) {
+		EVP_CIPHER_CTX_free(evp);
+		return 1;
+	}
+
+	/* Input is always a multiple of block size */
+	EVP_CIPHER_CTX_set_padding(evp, 0);
+
+	ctx->evp = evp;
+	return 0;
+}
+
+int openssl_rekey_enc(openssl_context *ctx, const unsigned char *key)
+{
+	if (ctx->evp == NULL)
+		return openssl_setkey_enc(ctx, key);
+
+	/* Cipher stays; only its key schedule is replaced,
+	 * without allocating */
+	if (EVP_EncryptInit_ex2(ctx->evp, NULL, key, NULL, NULL) != 1)
+		return 1;
+	EVP_CIPHER_CTX_set_padding(ctx->evp, 0);
+	return 0;
+}
+
+int openssl_encrypt_blocks(const openssl_context *ctx,
+			   const unsigned char *plain,
+			   unsigned char *encrypted,
+			   int blocks)
+{
+	int written = 0;
+
+	assert(ctx->evp != NULL);
+	if (blocks == 0)
+		return 0;
+
+	/* ECB without padding keeps no state between updates,
+	 * so context is never finalized */
+	if (EVP_EncryptUpdate(ctx->evp, encrypted, &written,
+			      plain, blocks * 16) != 1)
+		return 1;
+
+	return written == blocks * 16 ? 0 : 1;
+}
+
+void openssl_clear(openssl_context *ctx)
+{
+	/* Frees and cleanses key schedule */
+	EVP_CIPHER_CTX_free(ctx->evp);
+	ctx->evp = NULL;
+}
+
+int openssl_sha256(const unsigned char *data,
+		   const unsigned int length,
+		   unsigned char *hash)
+{
+	if (_openssl_fetch() != 0)
+		return 1;
+
+	if (EVP_Digest(data, length, hash, NULL, sha256, NULL) != 1)
+		return 1;
+	return 0;
+}
+
+#else /* HAVE_OPENSSL */
+
+int openssl_available(void)
+{
+	return 0;
+}
+
+int openssl_setkey_enc(openssl_context *ctx, const unsigned char *key)
+{
+	/* Never called when openssl_available() returns 0 */
+	assert(0);
+	ctx->evp = NULL;
+	return 1;
+}
+
+int openssl_rekey_enc(openssl_context *ctx, const unsigned char *key)
+{
+	assert(0);
+	return 1;
+}
+
+int openssl_encrypt_blocks(const openssl_context *ctx,
+			   const unsigned char *plain,
+			   unsigned char *encrypted,
+			   int blocks)
+{
+	assert(0);
+	return 1;
+}
+
+void openssl_clear(openssl_context *ctx)
+{
+	ctx->evp = NULL;
+}
+
+int openssl_sha256(const unsigned char *data,
+		   const unsigned int length,
+		   unsigned char *hash)
+{
+	assert(0);
+	return 1;
+}
+
+#endif /* HAVE_OPENSSL */
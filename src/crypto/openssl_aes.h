@@ -0,0 +1,59 @@
+ /**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   AES-256 and SHA-256 using OpenSSL 3 libcrypto. Compiled in
+ *   only with OPENSSL cmake option (HAVE_OPENSSL); otherwise
+ *   openssl_available() returns 0 and the rest must not be called.
+ **********************************************************************/
+
+#ifndef _OPENSSL_AES_H_
+#define _OPENSSL_AES_H_
+
+/** Cipher context bound to one key. EVP_CIPHER_CTX is opaque
+ * and allocated by libcrypto, hence the pointer. */
+typedef struct {
+	void *evp;
+} openssl_context;
+
+/** Returns 1 if this build links libcrypto and AES-256-ECB
+ * could be fetched from it */
+extern int openssl_available(void);
+
+/** Allocate cipher context for the key. Returns 0 on success. */
+extern int openssl_setkey_enc(openssl_context *ctx, const unsigned char *key);
+
+/** Replace key of context set up by openssl_setkey_enc, reusing
+ * its cipher context. Empty context is set up. */
+extern int openssl_rekey_enc(openssl_context *ctx, const unsigned char *key);
+
+/** Encrypt a number of independent 16 byte blocks (ECB)
+ * with a single EVP_EncryptUpdate call */
+extern int openssl_encrypt_blocks(const openssl_context *ctx,
+				  const unsigned char *plain,
+				  unsigned char *encrypted,
+				  int blocks);
+
+/** Free cipher context; key schedule is cleansed by libcrypto */
+extern void openssl_clear(openssl_context *ctx);
+
+/** SHA-256 of data */
+extern int openssl_sha256(const unsigned char *data,
+			  const unsigned int length,
+			  unsigned char *hash);
+
+#endif
@@ -107,6 +107,7 @@ static void _config_defaults(cfg_t *cfg)
 
 		.db = CONFIG_DB_UNCONFIGURED,
 		.global_db_path = "/etc/otpasswd/otshadow",
+		.btree_db_path = "/etc/otpasswd/otbtree",
 		.user_db_path = ".otpasswd",
 
 		.sql_host = "localhost",
@@ -119,12 +120,23 @@ static void _config_defaults(cfg_t *cfg)
 		.ldap_user = "",
 		.ldap_pass = "",
 
+		.db_format = CONFIG_FORMAT_TEXT,
+		.db_durability = CONFIG_DURABILITY_FULL,
+		.db_lock_timeout = 5000,
+		.db_group_commit = CONFIG_ENABLED,
+		.db_journal = 0,
+		.db_lease = 0,
+		.db_lease_dir = "/run/otpasswd",
+		.db_shards = 0,
+		.crypto_backend = CRYPTO_AES_AUTO,
+
 		.pam_logging = 2,
 		.pam_silent = CONFIG_DISABLED,
 		.pam_enforce = CONFIG_DISABLED,
 		.pam_enforce_policy = CONFIG_ENABLED,
 		.pam_retry = 0,
 		.pam_retries = 3,
+		.pam_lookahead = 1,
 
 		.pam_key_regeneration_prompt = 0,
 		.pam_failure_warning = 1,
@@ -392,6 +404,8 @@ static int _config_parse(cfg_t *cfg, const char *config_path)
 				cfg->db = CONFIG_DB_GLOBAL;
 			else if (_EQ(equality, "user"))
 				cfg->db = CONFIG_DB_USER;
+			else if (_EQ(equality, "btree"))
+				cfg->db = CONFIG_DB_BTREE;
 			else if (_EQ(equality, "mysql"))
 				cfg->db = CONFIG_DB_MYSQL;
 			else if (_EQ(equality, "ldap"))
@@ -402,6 +416,61 @@ static int _config_parse(cfg_t *cfg, const char *config_path)
 				      " %d in config file\n", line_count);
 				goto error;
 			}
+		} else if (_EQ(line_buf, "db_format")) {
+			_right_trim(equality);
+			if (_EQ(equality, "text"))
+				cfg->db_format = CONFIG_FORMAT_TEXT;
+			else if (_EQ(equality, "binary"))
+				cfg->db_format = CONFIG_FORMAT_BINARY;
+			else {
+				print(PRINT_ERROR,
+				      "Illegal db_format parameter at line"
+				      " %d in config file\n", line_count);
+				goto error;
+			}
+		} else if (_EQ(line_buf, "db_durability")) {
+			_right_trim(equality);
+			if (_EQ(equality, "full"))
+				cfg->db_durability = CONFIG_DURABILITY_FULL;
+			else if (_EQ(equality, "none"))
+				cfg->db_durability = CONFIG_DURABILITY_NONE;
+			else {
+				print(PRINT_ERROR,
+				      "Illegal db_durability parameter at line"
+				      " %d in config file\n", line_count);
+				goto error;
+			}
+		} else if (_EQ(line_buf, "db_lock_timeout")) {
+			REQUIRE_INT_ARG(1, 600000);
+			cfg->db_lock_timeout = arg;
+		} else if (_EQ(line_buf, "db_group_commit")) {
+			REQUIRE_ED_ARG();
+			cfg->db_group_commit = arg;
+		} else if (_EQ(line_buf, "db_journal")) {
+			REQUIRE_INT_ARG(0, 1000000);
+			cfg->db_journal = arg;
+		} else if (_EQ(line_buf, "db_lease")) {
+			REQUIRE_INT_ARG(0, 10000);
+			cfg->db_lease = arg;
+		} else if (_EQ(line_buf, "db_lease_dir")) {
+			if (equality[0] != '/') {
+				print(PRINT_ERROR,
+				      "Config Error at %d: DB_LEASE_DIR must be an absolute path.\n", line_count);
+				goto error;
+			}
+			_COPY(cfg->db_lease_dir, equality);
+		} else if (_EQ(line_buf, "db_shards")) {
+			REQUIRE_INT_ARG(0, CONFIG_MAX_SHARDS);
+			cfg->db_shards = arg;
+		} else if (_EQ(line_buf, "crypto_backend")) {
+			_right_trim(equality);
+			cfg->crypto_backend = crypto_aes_backend_parse(equality);
+			if (cfg->crypto_backend == -1) {
+				print(PRINT_ERROR,
+				      "Illegal crypto_backend parameter at line"
+				      " %d in config file\n", line_count);
+				goto error;
+			}
 		} else if (_EQ(line_buf, "db_user")) {
 			if (strchr(equality, '/') != NULL) {
 				print(PRINT_ERROR,
@@ -443,6 +512,9 @@ static int _config_parse(cfg_t *cfg, const char *config_path)
 		} else if (_EQ(line_buf, "pam_retries")) {
 			REQUIRE_INT_ARG(2, 5);
 			cfg->pam_retries = arg;
+		} else if (_EQ(line_buf, "pam_lookahead")) {
+			REQUIRE_INT_ARG(1, PPP_LOOKAHEAD_MAX);
+			cfg->pam_lookahead = arg;
 		} else if (_EQ(line_buf, "pam_logging")) {
 			REQUIRE_INT_ARG(0, 3);
 			cfg->pam_logging = arg;
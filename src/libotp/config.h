@@ -25,10 +25,12 @@
 #define CONFIG_PATH		(CONFIG_DIR "otpasswd.conf")
 #define CONFIG_DEF_DB_GLOBAL	(CONFIG_DIR "otshadow")
 #define CONFIG_DEF_DB_USER	".otpasswd"
+#define CONFIG_DEF_DB_BTREE	(CONFIG_DIR "otbtree")
 #define CONFIG_MAX_LINE_LEN	200
 #define CONFIG_PATH_LEN		100
 #define CONFIG_SQL_LEN		50
 #define CONFIG_ALPHABET_LEN	90
+#define CONFIG_MAX_SHARDS	100
 
 /** DB types */
 enum CONFIG_DB_TYPE {
@@ -37,9 +39,22 @@ enum CONFIG_DB_TYPE {
 	/* Feature database backends */
 	CONFIG_DB_MYSQL = 2,
 	CONFIG_DB_LDAP = 3,
+	CONFIG_DB_BTREE = 4,
 	CONFIG_DB_UNCONFIGURED = 10
 };
 
+/** Format of user state files */
+enum {
+	CONFIG_FORMAT_TEXT = 0,
+	CONFIG_FORMAT_BINARY = 1,
+};
+
+/** Durability of database updates */
+enum {
+	CONFIG_DURABILITY_FULL = 0,
+	CONFIG_DURABILITY_NONE = 1,
+};
+
 /** Fields */
 enum {
 	OOB_DISABLED = 0,
@@ -74,9 +89,15 @@ typedef struct {
 	/** Location of global database file */
 	char global_db_path[CONFIG_PATH_LEN];
 
+	/** Location of B+tree database file */
+	char btree_db_path[CONFIG_PATH_LEN];
+
 	/** Location of user database file */
 	char user_db_path[CONFIG_PATH_LEN];
 
+	/** Format of written user state files; CONFIG_FORMAT_* */
+	int db_format;
+
 	/** SQL Configuration data */
 	char sql_host[CONFIG_SQL_LEN];
 	char sql_database[CONFIG_SQL_LEN];
@@ -89,6 +110,36 @@ typedef struct {
 	char ldap_user[CONFIG_SQL_LEN];
 	char ldap_pass[CONFIG_SQL_LEN];
 
+	/** Flush database updates to disk before reporting success?
+	 * One of CONFIG_DURABILITY_* */
+	int db_durability;
+
+	/** How long to wait for database lock (ms) */
+	int db_lock_timeout;
+
+	/** Let one session flush updates of global database done
+	 * by concurrent sessions */
+	int db_group_commit;
+
+	/** Journal counter updates of the global database and compact
+	 * the journal after that many records; 0 - disabled */
+	int db_journal;
+
+	/** Counter leasing for the global database: store counter
+	 * advanced by that many passcodes and keep the position within
+	 * the lease in db_lease_dir, which should be on tmpfs.
+	 * 0 - disabled */
+	int db_lease;
+	char db_lease_dir[CONFIG_PATH_LEN];
+
+	/** Split the global database into that many files in a
+	 * directory next to global_db_path, each with its own lock;
+	 * users are assigned by hash of the username. 0 - disabled */
+	int db_shards;
+
+	/** AES implementation; one of CRYPTO_AES_* */
+	int crypto_backend;
+
 	/***
 	 * PAM Configuration
 	 ***/
@@ -121,6 +172,11 @@ typedef struct {
 	/** How many retries are allowed */
 	int pam_retries;
 
+	/** Number of consecutive passcodes, starting with the
+	 * prompted one, accepted during authentication. Matching
+	 * one of the later ones moves counter past it. */
+	int pam_lookahead;
+
 	/** Do we allow key regeneration (,) prompt? */
 	int pam_key_regeneration_prompt;
 
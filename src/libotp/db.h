@@ -39,6 +39,10 @@
 
 /*** File based DB. ***/
 
+/* Determine location of state database of s->username and keep it
+ * in s->location; called once by state_init. */
+extern int db_file_locate(state *s);
+
 /* Locking state file */
 extern int db_file_lock(state *s);
 extern int db_file_unlock(state *s);
@@ -47,6 +51,73 @@ extern int db_file_unlock(state *s);
 extern int db_file_load(state *s);
 extern int db_file_store(state *s, int remove);
 
+/* Rewrite database at given path using fixed-width records, which
+ * can be later updated in place. Locks the database exclusively. */
+extern int db_file_convert(const char *db_path);
+
+/* Apply journal of the database at given path to the database
+ * and empty it. Entries are sorted by username, so they can be
+ * found by binary search. Locks the database exclusively. */
+extern int db_file_compact(const char *db_path);
+
+/* Directory of shards of the global database; suffix of its path */
+#define DB_FILE_SHARD_SUFFIX ".d"
+
+/* Path of shard number shard of database at db. Returns 1 if
+ * it doesn't fit in size bytes. */
+extern int db_file_shard_name(const char *db, int shard, char *path, size_t size);
+
+/* Path of file of database at db holding username when the database
+ * is split into shards (0 - not split, db itself). Users are assigned
+ * to shards by a stable hash of the username. Returns 1 if path
+ * doesn't fit in size bytes. */
+extern int db_file_shard_path(const char *db, int shards, const char *username,
+			      char *path, size_t size);
+
+/* Move entries of database at db split into from shards into a new
+ * layout of to shards (0 - single file at db). Journals are applied
+ * first. New layout is written completely before it replaces the old
+ * one, whose files are removed then; if resharding fails or is
+ * interrupted the old layout is kept. Locks all files of the old
+ * layout exclusively. */
+extern int db_file_reshard(const char *db, int from, int to);
+
+#if DEBUG
+/* Shard before which db_file_reshard fails; -1 - none. For testcases. */
+extern int db_file_reshard_fail;
+#endif
+
+/* Decode single state entry, text (modified in place) or binary,
+ * of given length. If username is given (DB_RECORD_USER_SIZE bytes)
+ * username of the entry is stored there, otherwise it must match
+ * s->username. Returns 0 or STATE_PARSE_ERROR. */
+extern int db_file_entry_decode(state *s, char *entry, size_t length,
+				char *username);
+
+/* Encode state as a text entry or a binary record. Returns
+ * length of the entry or -1 on error. */
+extern int db_file_entry_encode(const state *s, char *buffer, size_t size,
+				int binary);
+
+/* Convert single-entry state file at given path (of DB=user) into
+ * binary record or text entry. Locks the state file. */
+extern int db_file_convert_state(const char *path, int binary);
+
+
+/*** B+tree DB. ***/
+
+/* Set location of the database in s->location; called once
+ * by state_init. */
+extern int db_btree_locate(state *s);
+
+/* Locking state entry */
+extern int db_btree_lock(state *s);
+extern int db_btree_unlock(state *s);
+
+/* Load/Store state from/to B+tree database. */
+extern int db_btree_load(state *s);
+extern int db_btree_store(state *s, int remove);
+
 
 /*** MySQL DB. ***/
 
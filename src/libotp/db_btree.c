@@ -0,0 +1,962 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   B+tree database (DB=btree) for large numbers of users. Loading
+ *   a state reads one page per level of the tree; storing it writes
+ *   copies of those pages and commits with a single meta page, so
+ *   the tree on disk is always either the old or the new one.
+ *   Pages freed by a commit are reused by later commits.
+ **********************************************************************/
+
+#define _GNU_SOURCE	/* F_OFD_SETLK */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>	/* offsetof */
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>	/* clock_gettime */
+
+#include "print.h"
+#include "state.h"
+#include "db.h"
+#include "config.h"
+#include "db_index.h"
+#include "db_btree.h"
+
+/* Lock file layout: byte 0 guards the tree; sessions hold it shared
+ * while looking up their entry and exclusively while committing.
+ * Following bytes are stripes; each user locks one of them selected
+ * by hash of the username for the whole lock/load/store/unlock, as
+ * in the global database. */
+#define DB_BTREE_LOCK_TREE 0
+#define DB_BTREE_LOCK_STRIPES 1024
+
+/* See db_file.c */
+#ifdef F_OFD_SETLK
+#	define DB_BTREE_SETLK F_OFD_SETLK
+#else
+#	define DB_BTREE_SETLK F_SETLK
+#endif
+
+/* Update in progress. Modified pages are kept in memory
+ * until they are written all at once by commit. */
+typedef struct {
+	int fd;
+	db_btree_meta meta;
+
+	/* Pages taken from the head of meta free list */
+	unsigned int reused;
+
+	/* Pages of the old tree; free after commit */
+	unsigned int freed_count;
+	uint32_t freed[DB_BTREE_DEPTH_MAX];
+
+	/* New pages: up to two per level and a new root */
+	unsigned int dirty_count;
+	uint32_t dirty_no[2 * DB_BTREE_DEPTH_MAX + 1];
+	db_btree_page dirty[2 * DB_BTREE_DEPTH_MAX + 1];
+
+	/* Pages on the path from root to the leaf */
+	db_btree_page path[DB_BTREE_DEPTH_MAX];
+} db_btree_txn;
+
+/******************
+ * Static helpers
+ ******************/
+static double _db_btree_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* Lock (or unlock) a byte of the lock file, retrying until
+ * DB_LOCK_TIMEOUT passes */
+static int _db_btree_setlk(int fd, short type, off_t start)
+{
+	const double deadline = _db_btree_now() +
+		cfg_get()->db_lock_timeout / 1000.0;
+	useconds_t delay = 100;
+	struct flock fl;
+
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = 1;
+	fl.l_pid = 0; /* Required for OFD locks */
+
+	for (;;) {
+		if (fcntl(fd, DB_BTREE_SETLK, &fl) == 0)
+			return 0;
+		if (errno != EACCES && errno != EAGAIN) {
+			print_perror(PRINT_NOTICE, "Unable to lock");
+			return 1;
+		}
+		if (type == F_UNLCK || _db_btree_now() >= deadline)
+			return 1;
+		usleep(delay);
+		if (delay < 1000)
+			delay *= 2;
+	}
+}
+
+/* Database is kept next to the global one and must be
+ * protected likewise; file created by PAM is fixed. */
+static int _db_btree_permissions(const char *db)
+{
+	const cfg_t *cfg = cfg_get();
+	struct stat st;
+
+	if (stat(db, &st) != 0) {
+		print(PRINT_NOTICE, "Database \"%s\" does not exists.\n", db);
+		return STATE_NON_EXISTENT;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		print(PRINT_ERROR, "Database \"%s\" is not a regular file.\n", db);
+		return STATE_IO_ERROR;
+	}
+
+	if (st.st_mode & (S_IWGRP | S_IWOTH)) {
+		print(PRINT_ERROR,
+		      "Database \"%s\" has write permissions "
+		      "for others or group. Fix it and try again.\n", db);
+		return STATE_IO_ERROR;
+	}
+
+	if (st.st_uid != cfg->user_uid) {
+		if (getuid() != 0 ||
+		    chown(db, cfg->user_uid, cfg->user_gid) != 0) {
+			print(PRINT_ERROR, "Database \"%s\" not owned by "
+			      "user defined in config.\n", db);
+			return STATE_IO_ERROR;
+		}
+	}
+	return 0;
+}
+
+/* Check permissions once per operation, as for DB=global */
+static int _db_btree_check(state *s)
+{
+	if (s->db_permissions == -1)
+		s->db_permissions = _db_btree_permissions(s->location.db);
+	return s->db_permissions;
+}
+
+/* FNV-1a over 64 bit words of meta page with checksum zeroed */
+static uint64_t _db_btree_checksum(const db_btree_page *p)
+{
+	uint64_t word, hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < sizeof(p->raw); i += sizeof(word)) {
+		if (i == offsetof(db_btree_meta, checksum))
+			continue;
+		memcpy(&word, p->raw + i, sizeof(word));
+		hash ^= word;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static void _db_btree_meta_init(db_btree_meta *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->magic = DB_BTREE_MAGIC;
+	m->version = DB_BTREE_VERSION;
+	m->page_size = DB_BTREE_PAGE_SIZE;
+	m->pages = 2;
+}
+
+static int _db_btree_meta_valid(const db_btree_page *p)
+{
+	const db_btree_meta *m = &p->meta;
+	return m->magic == DB_BTREE_MAGIC &&
+		m->version == DB_BTREE_VERSION &&
+		m->page_size == DB_BTREE_PAGE_SIZE &&
+		m->checksum == _db_btree_checksum(p) &&
+		m->pages >= 2 && m->root < m->pages &&
+		m->free_count <= DB_BTREE_FREE_MAX;
+}
+
+/* Read newest valid meta page. Meta page torn by a crash is
+ * invalid, so the previous commit is used. Empty file holds
+ * an empty tree. */
+static int _db_btree_read_meta(int fd, const char *db, db_btree_meta *meta)
+{
+	db_btree_page pages[2];
+	ssize_t got;
+	int i, best = -1;
+
+	got = pread(fd, pages, sizeof(pages), 0);
+	if (got < 0) {
+		print_perror(PRINT_ERROR, "Unable to read database %s", db);
+		return STATE_IO_ERROR;
+	}
+
+	if (got == 0) {
+		_db_btree_meta_init(meta);
+		return 0;
+	}
+
+	for (i = 0; i < 2 && (size_t) got >= (i + 1) * sizeof(*pages); i++) {
+		if (!_db_btree_meta_valid(&pages[i]))
+			continue;
+		if (best == -1 ||
+		    pages[i].meta.generation > pages[best].meta.generation)
+			best = i;
+	}
+
+	if (best == -1) {
+		print(PRINT_ERROR, "Database \"%s\" is damaged.\n", db);
+		return STATE_PARSE_ERROR;
+	}
+
+	*meta = pages[best].meta;
+	return 0;
+}
+
+/* Read tree page and check it can be safely used */
+static int _db_btree_read(int fd, const db_btree_meta *meta, uint32_t no,
+			  db_btree_page *p)
+{
+	const db_btree_node *n = &p->node;
+	unsigned int i;
+
+	if (no < 2 || no >= meta->pages)
+		goto damaged;
+
+	if (pread(fd, p, sizeof(*p), (off_t) no * DB_BTREE_PAGE_SIZE) !=
+	    sizeof(*p)) {
+		print_perror(PRINT_ERROR, "Unable to read database page %u", no);
+		return STATE_IO_ERROR;
+	}
+
+	switch (n->type) {
+	case DB_BTREE_LEAF:
+		if (n->count == 0 || n->count > DB_BTREE_LEAF_MAX)
+			goto damaged;
+		for (i = 0; i < n->count; i++)
+			if (n->u.leaf.key[i][DB_RECORD_USER_SIZE - 1] != '\0')
+				goto damaged;
+		return 0;
+
+	case DB_BTREE_BRANCH:
+		if (n->count > DB_BTREE_BRANCH_MAX)
+			goto damaged;
+		for (i = 0; i < n->count; i++)
+			if (n->u.branch.key[i][DB_RECORD_USER_SIZE - 1] != '\0')
+				goto damaged;
+		for (i = 0; i <= n->count; i++)
+			if (n->u.branch.child[i] < 2 ||
+			    n->u.branch.child[i] >= meta->pages)
+				goto damaged;
+		return 0;
+	}
+
+damaged:
+	print(PRINT_ERROR, "Page %u of B+tree database is damaged.\n", no);
+	return STATE_PARSE_ERROR;
+}
+
+/* Number of keys not greater than username; child to descend into */
+static unsigned int _db_btree_upper(const db_btree_node *n, const char *username)
+{
+	unsigned int lo = 0, hi = n->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(n->u.branch.key[mid], username) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Position of username in leaf, or where it would be inserted */
+static unsigned int _db_btree_lower(const db_btree_node *n, const char *username,
+				    int *found)
+{
+	unsigned int lo = 0, hi = n->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(n->u.leaf.key[mid], username) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*found = lo < n->count && strcmp(n->u.leaf.key[lo], username) == 0;
+	return lo;
+}
+
+/* Find leaf holding username. Caller holds the tree lock. */
+static int _db_btree_find(int fd, const char *db, const char *username,
+			  db_btree_page *p, unsigned int *pos)
+{
+	db_btree_meta meta;
+	uint32_t no;
+	int depth, found, ret;
+
+	ret = _db_btree_read_meta(fd, db, &meta);
+	if (ret != 0)
+		return ret;
+
+	no = meta.root;
+	if (no == 0)
+		return STATE_NO_USER_ENTRY;
+
+	for (depth = 0; depth < DB_BTREE_DEPTH_MAX; depth++) {
+		ret = _db_btree_read(fd, &meta, no, p);
+		if (ret != 0)
+			return ret;
+
+		if (p->node.type == DB_BTREE_LEAF) {
+			*pos = _db_btree_lower(&p->node, username, &found);
+			return found ? 0 : STATE_NO_USER_ENTRY;
+		}
+		no = p->node.u.branch.child[_db_btree_upper(&p->node, username)];
+	}
+
+	print(PRINT_ERROR, "B+tree database \"%s\" is too deep.\n", db);
+	return STATE_PARSE_ERROR;
+}
+
+/* Take a page for a new node. Free pages are reused first. */
+static db_btree_node *_db_btree_alloc(db_btree_txn *t, uint32_t *no)
+{
+	db_btree_page *p;
+
+	assert(t->dirty_count < sizeof(t->dirty_no) / sizeof(*t->dirty_no));
+
+	if (t->reused < t->meta.free_count)
+		*no = t->meta.free[t->reused++];
+	else
+		*no = t->meta.pages++;
+
+	p = &t->dirty[t->dirty_count];
+	t->dirty_no[t->dirty_count++] = *no;
+	memset(p, 0, sizeof(*p));
+	return &p->node;
+}
+
+/* Write modified copy of a node to a new page */
+static uint32_t _db_btree_put(db_btree_txn *t, const db_btree_node *n)
+{
+	uint32_t no;
+	*_db_btree_alloc(t, &no) = *n;
+	return no;
+}
+
+static void _db_btree_leaf_insert(db_btree_node *n, unsigned int pos,
+				  const char *key, const unsigned char *record)
+{
+	memmove(n->u.leaf.key[pos + 1], n->u.leaf.key[pos],
+		(n->count - pos) * DB_RECORD_USER_SIZE);
+	memmove(n->u.leaf.record[pos + 1], n->u.leaf.record[pos],
+		(n->count - pos) * DB_RECORD_SIZE);
+
+	memset(n->u.leaf.key[pos], 0, DB_RECORD_USER_SIZE);
+	strcpy(n->u.leaf.key[pos], key);
+	memcpy(n->u.leaf.record[pos], record, DB_RECORD_SIZE);
+	n->count++;
+}
+
+static void _db_btree_leaf_remove(db_btree_node *n, unsigned int pos)
+{
+	n->count--;
+	memmove(n->u.leaf.key[pos], n->u.leaf.key[pos + 1],
+		(n->count - pos) * DB_RECORD_USER_SIZE);
+	memmove(n->u.leaf.record[pos], n->u.leaf.record[pos + 1],
+		(n->count - pos) * DB_RECORD_SIZE);
+
+	memset(n->u.leaf.key[n->count], 0, DB_RECORD_USER_SIZE);
+	memset(n->u.leaf.record[n->count], 0, DB_RECORD_SIZE);
+}
+
+/* Move upper half of full leaf into empty node right */
+static void _db_btree_leaf_split(db_btree_node *n, db_btree_node *right)
+{
+	const unsigned int half = (n->count + 1) / 2;
+
+	right->type = DB_BTREE_LEAF;
+	right->count = n->count - half;
+	memcpy(right->u.leaf.key, n->u.leaf.key[half],
+	       right->count * DB_RECORD_USER_SIZE);
+	memcpy(right->u.leaf.record, n->u.leaf.record[half],
+	       right->count * DB_RECORD_SIZE);
+
+	memset(n->u.leaf.key[half], 0, right->count * DB_RECORD_USER_SIZE);
+	memset(n->u.leaf.record[half], 0, right->count * DB_RECORD_SIZE);
+	n->count = half;
+}
+
+/* Insert key at index i with child on its right */
+static void _db_btree_branch_insert(db_btree_node *n, unsigned int i,
+				    const char *key, uint32_t child)
+{
+	memmove(n->u.branch.key[i + 1], n->u.branch.key[i],
+		(n->count - i) * DB_RECORD_USER_SIZE);
+	memmove(&n->u.branch.child[i + 2], &n->u.branch.child[i + 1],
+		(n->count - i) * sizeof(*n->u.branch.child));
+
+	memcpy(n->u.branch.key[i], key, DB_RECORD_USER_SIZE);
+	n->u.branch.child[i + 1] = child;
+	n->count++;
+}
+
+/* Remove child c of a branch with at least two children;
+ * key separating it from its neighbour goes with it */
+static void _db_btree_branch_remove(db_btree_node *n, unsigned int c)
+{
+	const unsigned int k = c > 0 ? c - 1 : 0;
+
+	memmove(n->u.branch.key[k], n->u.branch.key[k + 1],
+		(n->count - k - 1) * DB_RECORD_USER_SIZE);
+	memmove(&n->u.branch.child[c], &n->u.branch.child[c + 1],
+		(n->count - c) * sizeof(*n->u.branch.child));
+
+	n->count--;
+	memset(n->u.branch.key[n->count], 0, DB_RECORD_USER_SIZE);
+	n->u.branch.child[n->count + 1] = 0;
+}
+
+/* Move upper half of full branch into empty node right;
+ * middle key moves up into key */
+static void _db_btree_branch_split(db_btree_node *n, db_btree_node *right,
+				   char *key)
+{
+	const unsigned int half = n->count / 2;
+
+	memcpy(key, n->u.branch.key[half], DB_RECORD_USER_SIZE);
+
+	right->type = DB_BTREE_BRANCH;
+	right->count = n->count - half - 1;
+	memcpy(right->u.branch.key, n->u.branch.key[half + 1],
+	       right->count * DB_RECORD_USER_SIZE);
+	memcpy(right->u.branch.child, &n->u.branch.child[half + 1],
+	       (right->count + 1) * sizeof(*n->u.branch.child));
+
+	memset(n->u.branch.key[half], 0,
+	       (n->count - half) * DB_RECORD_USER_SIZE);
+	memset(&n->u.branch.child[half + 1], 0,
+	       (n->count - half) * sizeof(*n->u.branch.child));
+	n->count = half;
+}
+
+/* Store record of username in the tree, or remove it if record
+ * is NULL. Pages on the path to its leaf are copied; a node which
+ * overflows is split and the new one is inserted into its parent.
+ * Nodes are not merged, only dropped when they become empty. */
+static int _db_btree_update(db_btree_txn *t, const char *db,
+			    const char *username, const unsigned char *record)
+{
+	unsigned int idx[DB_BTREE_DEPTH_MAX];
+	uint32_t no[DB_BTREE_DEPTH_MAX];
+	char sep[DB_RECORD_USER_SIZE], up[DB_RECORD_USER_SIZE];
+	uint32_t left_no = 0, right_no = 0, split_no;
+	db_btree_node *n, *right;
+	unsigned int pos, c;
+	int depth, d, found, empty = 0, ret;
+
+	if (t->meta.root == 0) {
+		if (!record)
+			return STATE_NO_USER_ENTRY;
+		n = _db_btree_alloc(t, &t->meta.root);
+		n->type = DB_BTREE_LEAF;
+		_db_btree_leaf_insert(n, 0, username, record);
+		t->meta.users++;
+		return 0;
+	}
+
+	/* Descend to the leaf */
+	no[0] = t->meta.root;
+	for (depth = 0; ; depth++) {
+		ret = _db_btree_read(t->fd, &t->meta, no[depth], &t->path[depth]);
+		if (ret != 0)
+			return ret;
+
+		n = &t->path[depth].node;
+		if (n->type == DB_BTREE_LEAF)
+			break;
+
+		if (depth + 1 == DB_BTREE_DEPTH_MAX) {
+			print(PRINT_ERROR, "B+tree database \"%s\" is too deep.\n", db);
+			return STATE_PARSE_ERROR;
+		}
+		idx[depth] = _db_btree_upper(n, username);
+		no[depth + 1] = n->u.branch.child[idx[depth]];
+	}
+
+	pos = _db_btree_lower(n, username, &found);
+	if (!record) {
+		if (!found)
+			return STATE_NO_USER_ENTRY;
+		_db_btree_leaf_remove(n, pos);
+		t->meta.users--;
+		empty = n->count == 0;
+	} else if (found) {
+		memcpy(n->u.leaf.record[pos], record, DB_RECORD_SIZE);
+	} else if (n->count < DB_BTREE_LEAF_MAX) {
+		_db_btree_leaf_insert(n, pos, username, record);
+		t->meta.users++;
+	} else {
+		right = _db_btree_alloc(t, &right_no);
+		_db_btree_leaf_split(n, right);
+		if (pos <= n->count)
+			_db_btree_leaf_insert(n, pos, username, record);
+		else
+			_db_btree_leaf_insert(right, pos - n->count, username, record);
+		memcpy(sep, right->u.leaf.key[0], sizeof(sep));
+		t->meta.users++;
+	}
+
+	t->freed[t->freed_count++] = no[depth];
+	if (!empty)
+		left_no = _db_btree_put(t, n);
+
+	/* Replace the path up to the root */
+	for (d = depth - 1; d >= 0; d--) {
+		n = &t->path[d].node;
+		c = idx[d];
+		t->freed[t->freed_count++] = no[d];
+
+		if (empty) {
+			/* Branch with a single child is gone with it */
+			if (n->count == 0)
+				continue;
+			_db_btree_branch_remove(n, c);
+			empty = 0;
+		} else {
+			n->u.branch.child[c] = left_no;
+			if (right_no) {
+				split_no = 0;
+				if (n->count < DB_BTREE_BRANCH_MAX) {
+					_db_btree_branch_insert(n, c, sep, right_no);
+				} else {
+					right = _db_btree_alloc(t, &split_no);
+					_db_btree_branch_split(n, right, up);
+					if (c <= n->count)
+						_db_btree_branch_insert(n, c, sep, right_no);
+					else
+						_db_btree_branch_insert(right, c - n->count - 1,
+									sep, right_no);
+					memcpy(sep, up, sizeof(sep));
+				}
+				right_no = split_no;
+			}
+		}
+
+		/* Root with a single child is replaced by it */
+		if (d == 0 && n->count == 0 && !right_no)
+			left_no = n->u.branch.child[0];
+		else
+			left_no = _db_btree_put(t, n);
+	}
+
+	if (empty) {
+		t->meta.root = 0;
+	} else if (right_no) {
+		if (depth + 1 == DB_BTREE_DEPTH_MAX) {
+			print(PRINT_ERROR, "B+tree database \"%s\" is too deep.\n", db);
+			return STATE_IO_ERROR;
+		}
+		n = _db_btree_alloc(t, &t->meta.root);
+		n->type = DB_BTREE_BRANCH;
+		n->count = 1;
+		memcpy(n->u.branch.key[0], sep, sizeof(sep));
+		n->u.branch.child[0] = left_no;
+		n->u.branch.child[1] = right_no;
+	} else {
+		t->meta.root = left_no;
+	}
+	return 0;
+}
+
+/* Write new pages, flush them and then commit by writing meta page
+ * in place of the older of the two. Until the meta page reaches the
+ * disk, the previous tree remains valid. */
+static int _db_btree_commit(db_btree_txn *t, const char *db)
+{
+	const int sync = cfg_get()->db_durability != CONFIG_DURABILITY_NONE;
+	db_btree_meta *m = &t->meta;
+	unsigned int kept = m->free_count - t->reused;
+	db_btree_page meta;
+	unsigned int i;
+
+	for (i = 0; i < t->dirty_count; i++) {
+		if (pwrite(t->fd, &t->dirty[i], sizeof(t->dirty[i]),
+			   (off_t) t->dirty_no[i] * DB_BTREE_PAGE_SIZE) !=
+		    sizeof(t->dirty[i]))
+			goto error;
+	}
+
+	if (sync && fdatasync(t->fd) != 0)
+		goto error;
+
+	/* Pages of the old tree are free once the new one is
+	 * committed; they can be reused by the next commit. */
+	memmove(m->free, m->free + t->reused, kept * sizeof(*m->free));
+	for (i = 0; i < t->freed_count && kept < DB_BTREE_FREE_MAX; i++)
+		m->free[kept++] = t->freed[i];
+	if (i < t->freed_count)
+		print(PRINT_NOTICE, "Free page list of database is full; "
+		      "%u pages left unused.\n", t->freed_count - i);
+	memset(m->free + kept, 0, (DB_BTREE_FREE_MAX - kept) * sizeof(*m->free));
+	m->free_count = kept;
+	m->generation++;
+
+	meta.meta = *m;
+	meta.meta.checksum = _db_btree_checksum(&meta);
+	if (pwrite(t->fd, &meta, sizeof(meta),
+		   (off_t) (m->generation % 2) * DB_BTREE_PAGE_SIZE) !=
+	    sizeof(meta))
+		goto error;
+
+	if (sync && fdatasync(t->fd) != 0)
+		goto error;
+	return 0;
+
+error:
+	print_perror(PRINT_ERROR, "Unable to write database %s", db);
+	return STATE_IO_ERROR;
+}
+
+/* Flush directory containing db, so a created file survives a crash */
+static int _db_btree_sync_dir(const char *db)
+{
+	char dir[STATE_PATH_SIZE];
+	const char *slash = strrchr(db, '/');
+	int fd, ret;
+
+	if (slash == NULL)
+		strcpy(dir, ".");
+	else if (slash == db)
+		strcpy(dir, "/");
+	else
+		snprintf(dir, sizeof(dir), "%.*s", (int) (slash - db), db);
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd == -1)
+		return 1;
+	ret = fsync(fd);
+	close(fd);
+	return ret != 0;
+}
+
+/* Open database for an update, creating it if required. New file
+ * gets an empty tree, so a crash during the first commit doesn't
+ * leave a file without valid meta page. */
+static int _db_btree_open(const char *db)
+{
+	const cfg_t *cfg = cfg_get();
+	db_btree_page meta;
+	struct stat st;
+	int fd;
+
+	fd = open(db, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		print_perror(PRINT_ERROR, "Unable to open %s for writing", db);
+		return -1;
+	}
+
+	if (fstat(fd, &st) != 0)
+		goto error;
+
+	/* Database created by root belongs to USER from config */
+	if (geteuid() == 0 && st.st_uid != cfg->user_uid &&
+	    fchown(fd, cfg->user_uid, cfg->user_gid) != 0)
+		goto error;
+
+	if (st.st_size > 0)
+		return fd;
+
+	memset(&meta, 0, sizeof(meta));
+	_db_btree_meta_init(&meta.meta);
+	meta.meta.checksum = _db_btree_checksum(&meta);
+	if (pwrite(fd, &meta, sizeof(meta), 0) != sizeof(meta))
+		goto error;
+
+	if (cfg->db_durability != CONFIG_DURABILITY_NONE &&
+	    (fdatasync(fd) != 0 || _db_btree_sync_dir(db) != 0))
+		goto error;
+	return fd;
+
+error:
+	print_perror(PRINT_ERROR, "Unable to initialize database %s", db);
+	close(fd);
+	return -1;
+}
+
+/**********************************************
+ * Interface functions for managing state files
+ **********************************************/
+int db_btree_locate(state *s)
+{
+	state_location *l = &s->location;
+	const cfg_t *cfg = cfg_get();
+
+	assert(s->username != NULL);
+
+	/* Config path is shorter than our buffers */
+	strcpy(l->db, cfg->btree_db_path);
+	strcpy(l->lck, l->db);
+	strcat(l->lck, ".lck");
+	l->tmp[0] = '\0';
+	l->home[0] = '\0';
+	l->uid = cfg->user_uid;
+	l->gid = cfg->user_gid;
+
+	l->status = 0;
+	return 0;
+}
+
+int db_btree_lock(state *s)
+{
+	const char *const lck = s->location.lck;
+	const off_t stripe = 1 + db_index_hash(s->username, strlen(s->username)) %
+		DB_BTREE_LOCK_STRIPES;
+	struct stat st;
+	int ret;
+	int fd;
+
+	assert(s->lock == -1);
+
+	if (s->location.status != 0)
+		return s->location.status;
+
+	ret = _db_btree_check(s);
+	switch (ret) {
+	case 0:
+	case STATE_NON_EXISTENT:
+		/* We might be locking for state creation */
+		break;
+	default:
+		print(PRINT_NOTICE, "File permission check failed\n");
+		ret = STATE_LOCK_ERROR;
+		goto cleanup;
+	}
+
+	fd = open(lck, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
+	if (fd == -1) {
+		print_perror(PRINT_NOTICE, "Unable to create %s lock file", lck);
+		ret = STATE_LOCK_ERROR;
+		goto cleanup;
+	}
+
+	if (geteuid() == 0 && fstat(fd, &st) == 0 &&
+	    st.st_uid != s->location.uid &&
+	    fchown(fd, s->location.uid, s->location.gid) != 0)
+		print_perror(PRINT_WARN, "Unable to set owner of %s", lck);
+
+	if (_db_btree_setlk(fd, F_WRLCK, stripe) != 0) {
+		close(fd);
+		print(PRINT_NOTICE, "Unable to lock opened state file\n");
+		ret = STATE_LOCK_ERROR;
+		goto cleanup;
+	}
+
+	s->lock = fd;
+	print(PRINT_NOTICE, "Got lock on state file\n");
+	ret = 0;
+
+cleanup:
+	if (ret != 0)
+		s->db_permissions = -1;
+	return ret;
+}
+
+int db_btree_unlock(state *s)
+{
+	struct flock fl;
+	int ret;
+
+	/* Operation ends; check permissions again during the next one */
+	s->db_permissions = -1;
+
+	if (s->lock < 0) {
+		print(PRINT_NOTICE, "No lock to release!\n");
+		return 0;
+	}
+
+	fl.l_type = F_UNLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = fl.l_len = 0;
+	fl.l_pid = 0;
+
+	ret = fcntl(s->lock, DB_BTREE_SETLK, &fl);
+	close(s->lock);
+	s->lock = -1;
+
+	if (ret != 0) {
+		print(PRINT_NOTICE, "Strange error while releasing lock\n");
+		return STATE_LOCK_ERROR;
+	}
+	return 0;
+}
+
+int db_btree_load(state *s)
+{
+	const char *const db = s->location.db;
+	db_btree_page page;
+	unsigned int pos;
+	int locked = 0;
+	int ret, fd;
+
+	if (s->location.status != 0)
+		return s->location.status;
+
+	ret = _db_btree_check(s);
+	if (ret != 0) {
+		s->db_permissions = -1;
+		return ret;
+	}
+
+	if (s->lock <= 0) {
+		print(PRINT_NOTICE,
+		      "State file not locked while reading from it\n");
+		ret = db_btree_lock(s);
+		if (ret != 0) {
+			print(PRINT_ERROR, "Unable to lock file for reading!\n");
+			return ret;
+		}
+		locked = 1;
+	}
+
+	fd = open(db, O_RDONLY);
+	if (fd == -1) {
+		ret = errno == ENOENT ? STATE_NON_EXISTENT : STATE_IO_ERROR;
+		print_perror(PRINT_ERROR, "Unable to open %s for reading.", db);
+		goto cleanup;
+	}
+
+	/* Pages are not reused while we hold the tree */
+	if (_db_btree_setlk(s->lock, F_RDLCK, DB_BTREE_LOCK_TREE) != 0) {
+		close(fd);
+		ret = STATE_LOCK_ERROR;
+		goto cleanup;
+	}
+	ret = _db_btree_find(fd, db, s->username, &page, &pos);
+	(void) _db_btree_setlk(s->lock, F_UNLCK, DB_BTREE_LOCK_TREE);
+	close(fd);
+
+	if (ret == 0)
+		ret = db_file_entry_decode(s, (char *) page.node.u.leaf.record[pos],
+					   DB_RECORD_SIZE, NULL);
+	memset(&page, 0, sizeof(page));
+
+cleanup:
+	if (locked && db_btree_unlock(s) != 0) {
+		print(PRINT_ERROR, "Error while unlocking state file!\n");
+		if (ret == 0)
+			ret = STATE_LOCK_ERROR;
+	}
+	return ret;
+}
+
+int db_btree_store(state *s, int remove)
+{
+	const char *const db = s->location.db;
+	unsigned char record[DB_RECORD_SIZE];
+	db_btree_txn *t = NULL;
+	int locked = 0, tree_locked = 0;
+	int ret;
+
+	if (s->location.status != 0)
+		return s->location.status;
+
+	if (!remove && db_file_entry_encode(s, (char *) record, sizeof(record), 1) !=
+	    DB_RECORD_SIZE) {
+		print(PRINT_ERROR, "Username is too long to be stored.\n");
+		return STATE_IO_ERROR;
+	}
+
+	if (s->lock <= 0) {
+		print(PRINT_NOTICE,
+		      "State file not locked while writing to it. Locking for write.\n");
+		ret = db_btree_lock(s);
+		if (ret != 0) {
+			print(PRINT_ERROR, "Unable to lock file for writing!\n");
+			goto cleanup;
+		}
+		locked = 1;
+	}
+
+	/* Pages of the path and the new ones; too much for PAM stack */
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		ret = STATE_NOMEM;
+		goto cleanup;
+	}
+	t->fd = -1;
+
+	/* Commits are serialized; sessions of other
+	 * users only wait for the update */
+	if (_db_btree_setlk(s->lock, F_WRLCK, DB_BTREE_LOCK_TREE) != 0) {
+		print(PRINT_ERROR, "Unable to lock database for update\n");
+		ret = STATE_LOCK_ERROR;
+		goto cleanup;
+	}
+	tree_locked = 1;
+
+	t->fd = _db_btree_open(db);
+	if (t->fd == -1) {
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	ret = _db_btree_read_meta(t->fd, db, &t->meta);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = _db_btree_update(t, db, s->username, remove ? NULL : record);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = _db_btree_commit(t, db);
+	if (ret == 0)
+		print(PRINT_NOTICE, "State data written\n");
+
+cleanup:
+	if (t) {
+		if (t->fd != -1)
+			close(t->fd);
+		memset(t, 0, sizeof(*t));
+		free(t);
+	}
+	if (tree_locked)
+		(void) _db_btree_setlk(s->lock, F_UNLCK, DB_BTREE_LOCK_TREE);
+	memset(record, 0, sizeof(record));
+
+	/* Database might have been created */
+	s->db_permissions = -1;
+
+	if (locked && db_btree_unlock(s) != 0) {
+		print(PRINT_ERROR, "Error while unlocking state file!\n");
+		if (ret == 0)
+			ret = STATE_LOCK_ERROR;
+	}
+	return ret;
+}
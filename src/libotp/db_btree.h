@@ -0,0 +1,97 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Page file layout of the B+tree database (DB=btree). File is a
+ *   sequence of fixed-size pages. Pages 0 and 1 are meta pages
+ *   written alternately; the valid one with the higher generation
+ *   describes the tree. Other pages are leaves, holding binary state
+ *   records sorted by username, and branches. Pages are never
+ *   modified in place: an update writes new copies of the pages on
+ *   the path to the leaf, flushes them and then commits by writing
+ *   a single meta page. Numbers are kept in host byte order, as in
+ *   the index.
+ **********************************************************************/
+
+#ifndef _DB_BTREE_H_
+#define _DB_BTREE_H_
+
+#include <stdint.h>
+#include "db_record.h"
+
+#define DB_BTREE_MAGIC 0x5442544fU /* "OTBT" */
+#define DB_BTREE_VERSION 1
+#define DB_BTREE_PAGE_SIZE 4096
+
+/** Deepest tree accepted; far more than 2^32 pages need */
+#define DB_BTREE_DEPTH_MAX 16
+
+enum {
+	DB_BTREE_LEAF = 1,
+	DB_BTREE_BRANCH = 2,
+};
+
+/** Entries of a leaf; keys are kept apart from records,
+ * so binary search doesn't touch the records */
+#define DB_BTREE_LEAF_MAX 9
+
+/** Separator keys of a branch; it has one child more */
+#define DB_BTREE_BRANCH_MAX 48
+
+/** Pages freed by earlier commits, which can be reused */
+#define DB_BTREE_FREE_MAX 1012
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t checksum;	/**< Of the page with this field zeroed */
+	uint64_t generation;	/**< Number of commits */
+	uint32_t page_size;
+	uint32_t root;		/**< 0 - empty tree */
+	uint32_t pages;		/**< Pages in use, including free ones */
+	uint32_t users;
+	uint32_t free_count;
+	uint32_t reserved;
+	uint32_t free[DB_BTREE_FREE_MAX];
+} db_btree_meta;
+
+typedef struct {
+	uint16_t type;
+	uint16_t count;		/**< Entries of leaf, keys of branch */
+	uint32_t reserved;
+	union {
+		struct {
+			char key[DB_BTREE_LEAF_MAX][DB_RECORD_USER_SIZE];
+			unsigned char record[DB_BTREE_LEAF_MAX][DB_RECORD_SIZE];
+		} leaf;
+		struct {
+			/** child[i] holds keys below key[i],
+			 * child[i + 1] ones from key[i] up */
+			uint32_t child[DB_BTREE_BRANCH_MAX + 1];
+			char key[DB_BTREE_BRANCH_MAX][DB_RECORD_USER_SIZE];
+		} branch;
+	} u;
+} db_btree_node;
+
+/** Page as read from and written to the file */
+typedef union {
+	db_btree_meta meta;
+	db_btree_node node;
+	unsigned char raw[DB_BTREE_PAGE_SIZE];
+} db_btree_page;
+
+#endif
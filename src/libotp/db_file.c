@@ -16,23 +16,32 @@
  * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
  **********************************************************************/
 
+#define _GNU_SOURCE	/* F_OFD_SETLK */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 
 #include <unistd.h>	/* usleep, open, close, unlink, getuid */
 #include <sys/types.h>
 #include <sys/stat.h>	/* stat */
+#include <sys/mman.h>	/* mmap */
+#include <dirent.h>	/* opendir */
 #include <pwd.h>	/* getpwnam */
 #include <fcntl.h>
+#include <time.h>	/* clock_gettime */
 
 #include "print.h"
 #include "state.h"
 #include "db.h"
 #include "config.h"
 #include "crypto.h"
+#include "db_index.h"
+#include "db_journal.h"
+#include "db_lease.h"
+#include "db_record.h"
 
 #if S_SPLINT_S
 #define PRIuMAX "llu"
@@ -41,26 +50,6 @@
 /******************
  * Static helpers
  ******************/
-static char *_strtok(char *input, const char *delim)
-{
-	static char *position = NULL;
-	char *token;
-	if (input != NULL)
-		position = input;
-
-	/* FIXME: valgrind doesn't like following line:
-	 * As of 0.7 valgrind doesn't seem to have a problem here. */
-	token = strsep(&position, delim); /* Non C99 function */
-
-	/* Cut token at any \n found */
-	if (token) {
-		char *pos = strchr(token, '\n');
-		if (pos)
-			*pos = '\0';
-	}
-	return token;
-}
-
 /* We might be run by root (from PAM) or suid to cfg->user_uid.
  *
  * 1) Check if db exists
@@ -131,6 +120,23 @@ static int _db_file_permissions(const char *db_path, const char *user_home)
 			return STATE_IO_ERROR;
 		}
 
+		/* Shards are kept in a directory of their own,
+		 * which must be protected likewise */
+		if (cfg->db_shards > 0) {
+			char dir[STATE_PATH_SIZE];
+			snprintf(dir, sizeof(dir), "%s" DB_FILE_SHARD_SUFFIX,
+				 cfg->global_db_path);
+			if (stat(dir, &st) != 0 || !S_ISDIR(st.st_mode) ||
+			    st.st_uid != cfg->user_uid ||
+			    (st.st_mode & (S_IWGRP | S_IWOTH))) {
+				print(PRINT_ERROR,
+				      "Directory \"%s\" of database shards must exist, "
+				      "be owned by USER and not writable by others. "
+				      "Create it with agent_otp --reshard-db.\n", dir);
+				return STATE_IO_ERROR;
+			}
+		}
+
 		/*** Directory checked, now check file itself ***/
 		if (stat(db_path, &st) != 0) {
 			/* Does not exists */
@@ -244,111 +250,420 @@ static int _db_file_permissions(const char *db_path, const char *user_home)
 	return 0;
 }
 
-/* Returns a name of current state + lock + temp file.
- * When DB=USER is set it also returns UID, GID and HOME of a given user
- */
-static int _db_path(const char *username, char **db, char **lck, char **tmp,
-                    uid_t *uid, gid_t *gid, char **home)
+/* Check permissions of database of s once per operation; result
+ * is kept in state until the lock is released */
+static int _db_file_check(state *s)
 {
-	int retval = 1;
-	static struct passwd *pwdata = NULL;
-	cfg_t *cfg = cfg_get();
+	const state_location *l = &s->location;
+	if (s->db_permissions == -1)
+		s->db_permissions = _db_file_permissions(
+			l->db, l->home[0] ? l->home : NULL);
+	return s->db_permissions;
+}
 
-	assert(username != NULL);
-	assert(cfg != NULL);
-	assert(*db == NULL && *lck == NULL && *tmp == NULL); /* Must be NULL */
+/* Flush file contents to disk unless disabled in config.
+ * fdatasync is enough - size is flushed too. */
+static int _db_file_sync(int fd)
+{
+	if (cfg_get()->db_durability == CONFIG_DURABILITY_NONE)
+		return 0;
+	return fdatasync(fd);
+}
 
-	if (uid)
-		*uid = (uid_t) -1;
-	if (gid)
-		*gid = (gid_t) -1;
+/* Flush directory containing path, so a rename
+ * within it survives a crash. */
+static int _db_file_sync_dir(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char *dir;
+	int fd, ret;
+
+	if (cfg_get()->db_durability == CONFIG_DURABILITY_NONE)
+		return 0;
+
+	if (slash == NULL)
+		dir = strdup(".");
+	else if (slash == path)
+		dir = strdup("/");
+	else
+		dir = strndup(path, slash - path);
+	if (!dir)
+		return STATE_NOMEM;
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	free(dir);
+	if (fd == -1)
+		return STATE_IO_ERROR;
+
+	ret = fsync(fd);
+	close(fd);
+	return ret == 0 ? 0 : STATE_IO_ERROR;
+}
 
-	/* Determine db location at first */
-	switch (cfg->db) {
-	case CONFIG_DB_USER:
-	{
-		char *userhome = NULL;
-		int length;
+/* Open lock file, creating it if needed. Lock file is persistent,
+ * so if root (PAM) creates it, it must get the owner of the database
+ * or later sessions without privileges won't be able to open it. */
+static int _db_file_open_lock(const char *lck, uid_t uid, gid_t gid)
+{
+	struct stat st;
+	int fd;
 
-		/* Get home */
-		pwdata = getpwnam(username);
-		if (pwdata && pwdata->pw_dir) {
-			userhome = pwdata->pw_dir;
-		} else {
-			return STATE_NO_SUCH_USER;
+	fd = open(lck, O_RDWR|O_CREAT, S_IWUSR|S_IRUSR);
+	if (fd == -1)
+		return -1;
+
+	if (geteuid() == 0 && uid != (uid_t) -1 &&
+	    fstat(fd, &st) == 0 && st.st_uid != uid) {
+		if (fchown(fd, uid, gid) != 0) {
+			print_perror(PRINT_WARN, "Unable to set owner of %s", lck);
 		}
+	}
+	return fd;
+}
 
-		/* Append a filename */
-		length = strlen(userhome);
-		length += strlen(cfg->user_db_path);
-		length += 2;
+/* Locks of open file description (Linux 3.15) belong to the descriptor
+ * and not to the process. Closing other descriptor of the lock file
+ * won't drop them, and two states locked in one process exclude each
+ * other. Fall back to process-associated locks elsewhere. */
+#ifdef F_OFD_SETLK
+#	define DB_FILE_SETLK F_OFD_SETLK
+#else
+#	define DB_FILE_SETLK F_SETLK
+#endif
 
-		*db = malloc(length);
-		if (!*db)
-			return STATE_NOMEM;
+/* Global database lock file layout: byte 0 is the structure lock,
+ * shared by every session and taken exclusively to rewrite the whole
+ * file. Following bytes are stripes; each user locks one of them
+ * selected by hash of the username, so sessions of different users
+ * don't wait for each other.
+ *
+ * Sessions of one stripe wait for their locks in order of arrival:
+ * each takes a ticket (counter of the stripe kept in lock file content
+ * at DB_FILE_QUEUE_TICKETS, guarded by the queue mutex byte), locks
+ * its slot in queue of the stripe and waits until the slot of its
+ * predecessor is released. Slot is held until the session gets its
+ * locks or gives up, so a crashed session never blocks the queue.
+ * Queues are per stripe, so a session waiting for a busy stripe
+ * delays only sessions of the same stripe. Writers waiting for the
+ * exclusive structure lock hold the gate byte, which stops new
+ * sessions from taking the shared structure lock, so they are not
+ * starved by a stream of logins. */
+#define DB_FILE_LOCK_STRUCTURE 0
+#define DB_FILE_LOCK_STRIPES 1024
+#define DB_FILE_LOCK_GATE (1 + DB_FILE_LOCK_STRIPES)
+#define DB_FILE_LOCK_QUEUE_MUTEX (DB_FILE_LOCK_GATE + 1)
+#define DB_FILE_LOCK_QUEUE 2048
+#define DB_FILE_LOCK_QUEUE_SLOTS 256
+#define DB_FILE_QUEUE_TICKETS 64
+
+/* Group commit of in-place updates and journal appends: sessions
+ * count their writes in lock file content (after the ticket counter,
+ * guarded by the sync mutex byte) and one of them, holding the leader
+ * byte of the file, flushes writes of all others at once. */
+#define DB_FILE_LOCK_SYNC_MUTEX (DB_FILE_LOCK_QUEUE_MUTEX + 1)
+#define DB_FILE_LOCK_SYNC_LEADER (DB_FILE_LOCK_SYNC_MUTEX + 1)
+#define DB_FILE_SYNC_COUNTERS 8
 
-		{
-			int ret = snprintf(*db, length, "%s/%s", userhome, cfg->user_db_path);
-			assert(ret == length - 1);
-		}
+enum {
+	DB_FILE_SYNC_DB = 0,
+	DB_FILE_SYNC_JOURNAL = 1,
+};
 
-		if (home) {
-			*home = strdup(userhome);
-			if (!*home) {
-				retval = STATE_NOMEM;
-				goto error;
-			}
+static off_t _db_file_lock_stripe(const char *username)
+{
+	return 1 + db_index_hash(username, strlen(username)) % DB_FILE_LOCK_STRIPES;
+}
+
+/* Monotonic time in seconds */
+static double _db_file_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* Deadline for lock acquisition started now */
+static double _db_file_deadline(void)
+{
+	return _db_file_now() + cfg_get()->db_lock_timeout / 1000.0;
+}
+
+/* Lock (or unlock) a range of the lock file, retrying until
+ * deadline. Sleeps between tries grow up to 1ms. */
+static int _db_file_setlk(int fd, short type, off_t start, off_t len,
+			  double deadline)
+{
+	struct flock fl;
+	useconds_t delay = 100;
+
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = start;
+	fl.l_len = len;
+	fl.l_pid = 0; /* Required for OFD locks */
+
+	for (;;) {
+		if (fcntl(fd, DB_FILE_SETLK, &fl) == 0)
+			return 0;
+		if (errno != EACCES && errno != EAGAIN) {
+			print_perror(PRINT_NOTICE, "Unable to lock");
+			return 1;
 		}
+		if (_db_file_now() >= deadline)
+			return 1;
+		usleep(delay);
+		if (delay < 1000)
+			delay *= 2;
+	}
+}
+
+static void _db_file_unlk(int fd, off_t start, off_t len)
+{
+	(void) _db_file_setlk(fd, F_UNLCK, start, len, 0.0);
+}
 
-		if (uid)
-			*uid = pwdata->pw_uid;
-		if (gid)
-			*gid = pwdata->pw_gid;
+/* Wait until predecessor in queue releases its slot. Kernel could
+ * block for us, but without a timeout; poll instead, so the wait
+ * ends at the deadline even if the predecessor is stuck. */
+static int _db_file_wait_free(int fd, off_t byte, double deadline)
+{
+	if (_db_file_setlk(fd, F_RDLCK, byte, 1, deadline) != 0)
+		return 1;
+	_db_file_unlk(fd, byte, 1);
+	return 0;
+}
 
-		break;
+/* Take a ticket of stripe and wait for sessions of the stripe which
+ * came before us. Returns 0 with *slot locked; release it with
+ * _db_file_unlk. */
+static int _db_file_queue_enter(int fd, off_t stripe, double deadline,
+				off_t *slot)
+{
+	const off_t at = DB_FILE_QUEUE_TICKETS + (stripe - 1) * sizeof(uint64_t);
+	const off_t queue = DB_FILE_LOCK_QUEUE + (stripe - 1) * DB_FILE_LOCK_QUEUE_SLOTS;
+	uint64_t ticket = 0, next;
+	off_t previous;
+	int ret;
+
+	if (_db_file_setlk(fd, F_WRLCK, DB_FILE_LOCK_QUEUE_MUTEX, 1, deadline) != 0)
+		return 1;
+
+	/* Fresh lock file has no counter yet */
+	if (pread(fd, &ticket, sizeof(ticket), at) != sizeof(ticket))
+		ticket = 0;
+	next = ticket + 1;
+	if (pwrite(fd, &next, sizeof(next), at) != sizeof(next)) {
+		print_perror(PRINT_NOTICE, "Unable to update lock queue");
+		_db_file_unlk(fd, DB_FILE_LOCK_QUEUE_MUTEX, 1);
+		return 1;
 	}
-	case CONFIG_DB_GLOBAL:
-		*db = strdup(cfg->global_db_path);
-		if (!*db) {
-			return STATE_NOMEM;
-		}
-		break;
 
-	case CONFIG_DB_MYSQL:
-	case CONFIG_DB_LDAP:
-	default:
-		/* We should not be called with this options never */
-		assert(0);
-		retval = 1;
-		goto error;
+	*slot = queue + ticket % DB_FILE_LOCK_QUEUE_SLOTS;
+	previous = queue +
+		(ticket + DB_FILE_LOCK_QUEUE_SLOTS - 1) % DB_FILE_LOCK_QUEUE_SLOTS;
+
+	/* Slot must be locked before successor can read its ticket */
+	ret = _db_file_setlk(fd, F_WRLCK, *slot, 1, deadline);
+	_db_file_unlk(fd, DB_FILE_LOCK_QUEUE_MUTEX, 1);
+	if (ret != 0)
+		return 1;
+
+	if (_db_file_wait_free(fd, previous, deadline) != 0) {
+		_db_file_unlk(fd, *slot, 1);
+		return 1;
 	}
+	return 0;
+}
 
-	{
-		const int db_len = strlen(*db);
-		/* Create lock filename; normal file + .lck */
+/* Get shared structure lock of global database (or downgrade the
+ * exclusive one). Passes through the gate, so it waits while
+ * a writer is waiting. */
+static int _db_file_lock_shared(int fd, double deadline)
+{
+	int ret;
+
+	if (_db_file_setlk(fd, F_RDLCK, DB_FILE_LOCK_GATE, 1, deadline) != 0)
+		return 1;
+	ret = _db_file_setlk(fd, F_RDLCK, DB_FILE_LOCK_STRUCTURE, 1, deadline);
+	_db_file_unlk(fd, DB_FILE_LOCK_GATE, 1);
+	return ret;
+}
 
-		retval = STATE_NOMEM;
-		*lck = malloc(db_len + 5 + 1);
-		*tmp = malloc(db_len + 5 + 1);
+/* Get exclusive structure lock of global database for rewriting
+ * the whole file. Gate is held while waiting and until the shared
+ * lock is restored.
+ *
+ * Shared lock is released before waiting for the exclusive one,
+ * otherwise two sessions upgrading at once would wait for each other.
+ * That's safe as entry of our user is protected by its stripe during
+ * the gap. Nobody waits for a stripe while holding the structure
+ * lock or the gate, because stripes are always taken first. */
+static int _db_file_lock_exclusive(int fd, double deadline)
+{
+	_db_file_unlk(fd, DB_FILE_LOCK_STRUCTURE, 1);
 
-		if (!*lck || !*tmp) {
-			goto error;
-		}
+	if (_db_file_setlk(fd, F_WRLCK, DB_FILE_LOCK_GATE, 1, deadline) != 0)
+		return 1;
 
-		strncpy(*lck, *db, db_len);
-		strncpy(*tmp, *db, db_len);
-		strcpy(*lck + db_len, ".lck");
-		strcpy(*tmp + db_len, ".tmp");
+	if (_db_file_setlk(fd, F_WRLCK, DB_FILE_LOCK_STRUCTURE, 1, deadline) != 0) {
+		_db_file_unlk(fd, DB_FILE_LOCK_GATE, 1);
+		return 1;
 	}
-	/* All ok */
 	return 0;
+}
 
-error:
-	free(*db), *db = NULL;
-	free(*tmp), *tmp = NULL;
-	free(*lck), *lck = NULL;
-	free(*home), *home = NULL;
-	return retval;
+/* Lock global database for a session of user */
+static int _db_file_lock_global(int fd, const char *username)
+{
+	const double start = _db_file_now();
+	const double deadline = _db_file_deadline();
+	const off_t stripe = _db_file_lock_stripe(username);
+	off_t slot;
+	int ret;
+
+	if (_db_file_queue_enter(fd, stripe, deadline, &slot) != 0) {
+		ret = 1;
+		goto end;
+	}
+
+	/* Stripe of the user first, then shared structure lock */
+	ret = _db_file_setlk(fd, F_WRLCK, stripe, 1, deadline);
+	if (ret == 0) {
+		ret = _db_file_lock_shared(fd, deadline);
+		if (ret != 0)
+			_db_file_unlk(fd, stripe, 1);
+	}
+
+	/* Let the next one try */
+	_db_file_unlk(fd, slot, 1);
+
+end:
+	if (ret != 0)
+		print(PRINT_WARN, "Unable to lock database within %d ms\n",
+		      cfg_get()->db_lock_timeout);
+	else
+		print(PRINT_NOTICE, "Waited %.1f ms for database lock\n",
+		      (_db_file_now() - start) * 1000.0);
+	return ret;
+}
+
+/* Flush file which we don't have opened */
+static int _db_file_sync_path(const char *path)
+{
+	int ret;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return 1;
+	ret = _db_file_sync(fd);
+	close(fd);
+	return ret;
+}
+
+/* Read counters of writes done and writes flushed to disk. Count
+ * our write if written is set; record flush of writes up to synced. */
+static int _db_file_sync_counters(int fd, int target, uint64_t counters[2],
+				  int written, uint64_t synced)
+{
+	const off_t at = DB_FILE_SYNC_COUNTERS + target * 2 * sizeof(*counters);
+	const size_t size = 2 * sizeof(*counters);
+	int ret = 0;
+
+	if (_db_file_setlk(fd, F_WRLCK, DB_FILE_LOCK_SYNC_MUTEX, 1,
+			   _db_file_deadline()) != 0)
+		return 1;
+
+	/* Fresh lock file has no counters yet */
+	if (pread(fd, counters, size, at) != (ssize_t)size)
+		counters[0] = counters[1] = 0;
+
+	if (written || synced > counters[1]) {
+		if (written)
+			counters[0]++;
+		if (synced > counters[1])
+			counters[1] = synced;
+		if (pwrite(fd, counters, size, at) != (ssize_t)size) {
+			print_perror(PRINT_NOTICE, "Unable to update sync counters");
+			ret = 1;
+		}
+	}
+
+	_db_file_unlk(fd, DB_FILE_LOCK_SYNC_MUTEX, 1);
+	return ret;
+}
+
+/* Flush our write to file of global database (target), together with
+ * writes of concurrent sessions. First session to get the leader byte
+ * flushes every write counted before the flush starts; sessions which
+ * waited for it usually find their write already flushed. If path is
+ * given, fd is ignored and the leader opens the file itself.
+ *
+ * Leader byte is awaited only until the lock deadline; a session
+ * which gives up flushes its write alone. */
+static int _db_file_group_sync(int lock_fd, int target, int fd, const char *path)
+{
+	uint64_t counters[2];
+	uint64_t mine, covered;
+	int ret;
+
+	if (cfg_get()->db_durability == CONFIG_DURABILITY_NONE)
+		return 0;
+
+	if (cfg_get()->db_group_commit != CONFIG_ENABLED ||
+	    _db_file_sync_counters(lock_fd, target, counters, 1, 0) != 0)
+		goto alone;
+	mine = counters[0];
+
+	/* Leader which doesn't finish in time is not waited for */
+	if (_db_file_setlk(lock_fd, F_WRLCK, DB_FILE_LOCK_SYNC_LEADER + target, 1,
+			   _db_file_deadline()) != 0)
+		goto alone;
+
+	ret = _db_file_sync_counters(lock_fd, target, counters, 0, 0);
+	if (ret == 0 && counters[1] >= mine) {
+		/* Flushed by previous leader */
+		print(PRINT_NOTICE, "Write flushed by another session\n");
+		goto end;
+	}
+
+	/* Writes counted until now were done before the flush */
+	covered = counters[0];
+	ret = path ? _db_file_sync_path(path) : _db_file_sync(fd);
+
+	if (ret == 0 && covered > mine)
+		print(PRINT_NOTICE, "Flushed writes of %u sessions at once\n",
+		      (unsigned int)(covered - counters[1]));
+
+	/* Failure here only makes next leader flush again */
+	if (ret == 0)
+		(void) _db_file_sync_counters(lock_fd, target, counters, 0, covered);
+
+end:
+	_db_file_unlk(lock_fd, DB_FILE_LOCK_SYNC_LEADER + target, 1);
+	return ret;
+
+alone:
+	return path ? _db_file_sync_path(path) : _db_file_sync(fd);
+}
+
+/* Write name of index or journal file of given database into
+ * buffer of given size. Returns 1 if it doesn't fit. */
+static int _db_sidecar_name(char *buff, size_t size, const char *db,
+			    const char *suffix)
+{
+	const int ret = snprintf(buff, size, "%s%s", db, suffix);
+	return ret < 0 || (size_t) ret >= size;
+}
+
+/* Returns name of index or journal file of given database */
+static char *_db_sidecar_path(const char *db, const char *suffix)
+{
+	const int db_len = strlen(db);
+	char *path = malloc(db_len + strlen(suffix) + 1);
+	if (!path)
+		return NULL;
+	strcpy(path, db);
+	strcpy(path + db_len, suffix);
+	return path;
 }
 
 /* State files constants */
@@ -357,6 +672,26 @@ static const char *_delim = ":"; /* Change it also in snprintf in store */
 
 static const int fields = 15;
 
+/* Version 2 entries have the same fields followed by a padding
+ * field of spaces, so each line takes exactly DB_FILE_SLOT_SIZE
+ * bytes (including \n) and can be overwritten in place. Padding
+ * ends with a seal: '#' and a hash of the slot before it, so an
+ * interrupted overwrite can be told from a valid entry. Older
+ * entries without the seal are still read. */
+static const int _version_fixed = 2;
+static const int fields_fixed = 16;
+#define DB_FILE_SLOT_SIZE 512
+#define DB_FILE_SEAL_LENGTH 17
+#define DB_FILE_SEAL_OFFSET (DB_FILE_SLOT_SIZE - 1 - DB_FILE_SEAL_LENGTH)
+
+/* Journal longer than this many times DB_JOURNAL records is compacted
+ * even if the session has to wait for others */
+#define DB_FILE_JOURNAL_LIMIT 4
+
+/* Times a reader re-reads an entry which is being overwritten */
+#define DB_FILE_TORN_RETRIES 10
+#define DB_FILE_TORN_DELAY 1000 /* us */
+
 enum {
 	FIELD_USER = 0,
 	FIELD_VERSION,
@@ -373,20 +708,28 @@ enum {
 	FIELD_SPASS_TIME,
 	FIELD_LABEL,
 	FIELD_CONTACT,
+	FIELD_PADDING,
 };
 
 /* Find entry in database for username. Unmodified line
  * is left in buffer.
  *
  * If out is given each line we pass without a match
- * is written into this file.
+ * is written into this file. If index is also given
+ * offsets of written entries are recorded in it.
+ *
+ * If greater is given, search stops at the first entry which
+ * should follow ours in a sorted database; *greater is then set
+ * and that entry is left in buffer without being written.
  */
 static int _db_find_user_entry(
 	const char *username, FILE *f, FILE *out,
+	db_index_builder *index, int *greater,
 	char *buff, size_t buff_size)
 {
 	size_t line_length;
 	char *first_sep;
+	int cmp;
 
 	assert(username != NULL);
 	assert(f != NULL);
@@ -424,16 +767,31 @@ static int _db_find_user_entry(
 			*first_sep = '\0';
 
 			/* Check the username */
-			if (username && (strcmp(buff, username) == 0)) {
+			cmp = strcmp(buff, username);
+			*first_sep = _delim[0];
+			if (cmp == 0) {
 				/* Found */
-				*first_sep = _delim[0];
 				return 0;
 			}
 
-			*first_sep = _delim[0];
+			if (greater && cmp > 0) {
+				/* Our entry belongs here */
+				*greater = 1;
+				return STATE_NO_USER_ENTRY;
+			}
 		}
 
 		if (out) {
+			if (index && first_sep) {
+				const long offset = ftell(out);
+				if (offset < 0 ||
+				    db_index_builder_add(index, buff, first_sep - buff, offset) != 0) {
+					print(PRINT_NOTICE,
+					      "Unable to record entry offset in index\n");
+					return STATE_NOMEM;
+				}
+			}
+
 			if (fputs(buff, out) < 0) {
 				print(PRINT_NOTICE,
 				      "Error while writing data to file!\n");
@@ -446,237 +804,356 @@ static int _db_find_user_entry(
 	return STATE_NO_USER_ENTRY;
 }
 
-static int _db_parse_user_entry(char *buff, char **field)
+/* Field of database entry; entry is split in place, so the
+ * field is also terminated with \0 */
+typedef struct {
+	char *str;
+	size_t length;
+} db_field;
+
+/* Split entry of given length, ending with \n, into at most max
+ * fields in a single pass. Returns number of fields or -1 if
+ * there are more of them. */
+static int _db_split_entry(char *entry, size_t length, db_field *field, int max)
 {
-	int i, ret;
-	/* Parse entry - split into fields, verify version */
-	for (i=0; i<fields; i++) {
-		field[i] = _strtok(i == 0 ? buff : NULL, _delim);
-		if (field[i] == NULL) {
-			print(PRINT_ERROR,
-			      "State file invalid. Not enough fields.\n");
-			return STATE_PARSE_ERROR;
-		}
+	char *const end = entry + length - 1;
+	char *start = entry, *pos;
+	int count = 0;
 
-		if (strlen(field[i]) > STATE_MAX_FIELD_SIZE) {
-			print(PRINT_ERROR,
-			      "State file corrupted. Entry too long\n");
-			return STATE_PARSE_ERROR;
-		}
+	assert(length > 0 && *end == '\n');
 
-		/* If we parsed field version, check it immediately */
-		if (i == FIELD_VERSION) {
-			if (sscanf(field[i], "%u", &ret) != 1) {
-				print(PRINT_ERROR,
-				      "Error while parsing state file "
-				      "version.\n");
-				return STATE_PARSE_ERROR;
-			}
+	for (pos = entry; ; pos++) {
+		if (pos != end && *pos != _delim[0])
+			continue;
 
-			if (ret != _version) {
-				print(PRINT_ERROR,
-				      "State file version is incompatible. "
-				      "Recreate key.\n");
-				return STATE_PARSE_ERROR;
-			}
+		if (count == max)
+			return -1;
+		field[count].str = start;
+		field[count].length = pos - start;
+		count++;
+
+		if (pos == end) {
+			*pos = '\0';
+			return count;
 		}
+		*pos = '\0';
+		start = pos + 1;
 	}
+}
 
-	if (_strtok(NULL, _delim) != NULL) {
-		print(PRINT_ERROR, "State file invalid. Too much fields.\n");
-		return STATE_PARSE_ERROR;
+/* Value of hexadecimal digit plus one; zero for other characters.
+ * Decimal digits have values 1-10. */
+static const unsigned char _hex_lut[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+};
+
+/* Decode field of exactly 2*size hexadecimal digits */
+static int _db_field_bytes(const db_field *f, unsigned char *out, size_t size)
+{
+	const unsigned char *hex = (const unsigned char *) f->str;
+	unsigned int hi, lo;
+	size_t i;
+
+	if (f->length != 2 * size)
+		return 1;
+
+	for (i = 0; i < size; i++) {
+		hi = _hex_lut[hex[2*i]];
+		lo = _hex_lut[hex[2*i + 1]];
+		if (!hi || !lo)
+			return 1;
+		out[i] = (hi - 1) << 4 | (lo - 1);
 	}
+	return 0;
+}
+
+/* Decode field of 1-32 hexadecimal digits into a number */
+static int _db_field_num(const db_field *f, num_t *n)
+{
+	const unsigned char *hex = (const unsigned char *) f->str;
+	unsigned int digit;
+	size_t i;
+
+	if (f->length < 1 || f->length > 32)
+		return 1;
 
+	n->hi = n->lo = 0;
+	for (i = 0; i < f->length; i++) {
+		digit = _hex_lut[hex[i]];
+		if (!digit)
+			return 1;
+		n->hi = n->hi << 4 | n->lo >> 60;
+		n->lo = n->lo << 4 | (digit - 1);
+	}
 	return 0;
 }
 
-/**********************************************
- * Interface functions for managing state files
- **********************************************/
-int db_file_load(state *s)
+/* Decode field holding a decimal (base 10) or hexadecimal (base 16)
+ * number not greater than max */
+static int _db_field_uint(const db_field *f, unsigned int base,
+			  uint64_t max, uint64_t *value)
 {
-	/* State file should never be larger than 160 bytes */
-	char buff[STATE_ENTRY_SIZE];
+	const unsigned char *str = (const unsigned char *) f->str;
+	unsigned int digit;
+	uint64_t v = 0;
+	size_t i;
 
-	/* Did we lock it here? */
-	int locked;
+	if (f->length == 0)
+		return 1;
 
-	/* Pointers to fields in file */
-	char *field[fields];
+	for (i = 0; i < f->length; i++) {
+		digit = _hex_lut[str[i]];
+		if (digit == 0 || digit > base)
+			return 1;
+		digit--;
+		if (v > (max - digit) / base)
+			return 1; /* Overflow */
+		v = v * base + digit;
+	}
 
-	/* Temporary variable for returned values */
-	int ret = 0;
+	*value = v;
+	return 0;
+}
 
-	/* State file */
-	FILE *f = NULL;
+/* Write the seal at the end of a fixed-width slot */
+static void _db_slot_seal(char *slot)
+{
+	char seal[DB_FILE_SEAL_LENGTH + 1];
+	snprintf(seal, sizeof(seal), "#%016" PRIx64,
+		 db_index_hash(slot, DB_FILE_SEAL_OFFSET));
+	memcpy(slot + DB_FILE_SEAL_OFFSET, seal, DB_FILE_SEAL_LENGTH);
+}
 
-	/* Value returned. */
-	int retval;
+/* Check if entry of given length (including \n) is a fixed-width
+ * record which can be overwritten */
+static int _db_is_fixed_entry(const char *entry, size_t length)
+{
+	const char *sep;
 
-	/* Iterator */
-	int i;
+	if (length != DB_FILE_SLOT_SIZE)
+		return 0;
 
-	/* Files: database, lock and temporary */
-	char *db = NULL, *lck = NULL, *tmp = NULL, *home = NULL;
-	ret = _db_path(s->username, &db, &lck, &tmp, NULL, NULL, &home);
-	if (ret != 0) {
-		return ret;
-	}
+	sep = memchr(entry, _delim[0], length);
+	return sep && sep + 2 < entry + length &&
+		sep[1] == '0' + _version_fixed && sep[2] == _delim[0];
+}
 
-	/* Permissions will be checked during locking
-	 * now, or was already checked */
-	retval = _db_file_permissions(db, home);
-	if (retval != 0) {
-		goto cleanup1;
-	}
+/* Check if fixed-width slot carries a seal, valid or not */
+static int _db_slot_is_sealed(const char *slot)
+{
+	return slot[DB_FILE_SEAL_OFFSET] == '#';
+}
 
-	/* DB file should always be locked before changing.
-	 * Locking can only be omitted when we want to discard
-	 * any changes or that we don't bother if somebody changes
-	 * them at the same time.
-	 * Here we just detect that it's not locked and lock it then
-	 */
-	if (s->lock <= 0) {
-		print(PRINT_NOTICE,
-		      "State file not locked while reading from it\n");
-		retval = db_file_lock(s);
-		if (retval != 0) {
-			print(PRINT_ERROR, "Unable to lock file for reading!\n");
-			goto cleanup1;
-		}
+/* Check if entry is a sealed slot whose seal doesn't match: it's
+ * being overwritten or the overwrite was interrupted */
+static int _db_slot_is_torn(const char *entry, size_t length)
+{
+	char seal[DB_FILE_SEAL_LENGTH + 1];
 
-		/* Locked locally, unlock locally later */
-		locked = 1;
-	} else {
-		locked = 0;
-	}
+	if (!_db_is_fixed_entry(entry, length) || !_db_slot_is_sealed(entry))
+		return 0;
 
-	f = fopen(db, "r");
-	if (!f) {
-		if (errno == ENOENT)
-			retval = STATE_NON_EXISTENT;
-		else
-			retval = STATE_IO_ERROR;
-		print_perror(PRINT_ERROR,
-			     "Unable to open %s for reading.",
-			     db);
-		goto cleanup;
+	snprintf(seal, sizeof(seal), "#%016" PRIx64,
+		 db_index_hash(entry, DB_FILE_SEAL_OFFSET));
+	return memcmp(entry + DB_FILE_SEAL_OFFSET, seal, DB_FILE_SEAL_LENGTH) != 0;
+}
+
+/* Split entry into fields and verify its version */
+static int _db_parse_user_entry(char *entry, size_t length, db_field *field)
+{
+	uint64_t version;
+	int count, expected, i;
+
+	if (_db_slot_is_torn(entry, length)) {
+		print(PRINT_ERROR, "State entry is damaged by an "
+		      "interrupted write.\n");
+		return STATE_PARSE_ERROR;
 	}
 
-	/* Read all file into a buffer */
-	ret = _db_find_user_entry(s->username, f, NULL, buff, sizeof(buff));
-	if (ret != 0) {
-		/* No entry, or file invalid */
-		retval = ret;
-		goto cleanup;
+	count = _db_split_entry(entry, length, field, fields_fixed);
+	if (count < 0) {
+		print(PRINT_ERROR, "State file invalid. Too much fields.\n");
+		return STATE_PARSE_ERROR;
 	}
 
-	ret = _db_parse_user_entry(buff, field);
-	if (ret != 0) {
-		/* Parse error */
-		retval = ret;
-		goto cleanup;
+	if (count <= FIELD_VERSION) {
+		print(PRINT_ERROR, "State file invalid. Not enough fields.\n");
+		return STATE_PARSE_ERROR;
 	}
 
-	/* Parse fields, if anybody bad happens return parse error */
-	retval = STATE_PARSE_ERROR;
+	if (_db_field_uint(&field[FIELD_VERSION], 10, UINT_MAX, &version) != 0) {
+		print(PRINT_ERROR, "Error while parsing state file version.\n");
+		return STATE_PARSE_ERROR;
+	}
 
-	/* Parse sequence key */
-	for (i = 0; i < 32; i++) {
-		char *pos = &field[FIELD_KEY][i*2];
-		int tmp;
-		if (!*pos || !*(pos+1)) {
-			print(PRINT_ERROR, "Error while parsing sequence key.\n");
-			goto cleanup;
-		}
-		if (sscanf(pos, "%02X", &tmp) != 1) {
-			print(PRINT_ERROR, "Error while parsing sequence key.\n");
-			goto cleanup;
-		}
-		s->sequence_key[i] = tmp;
+	if (version == (uint64_t) _version_fixed) {
+		expected = fields_fixed;
+	} else if (version == (uint64_t) _version) {
+		expected = fields;
+	} else {
+		print(PRINT_ERROR,
+		      "State file version is incompatible. "
+		      "Recreate key.\n");
+		return STATE_PARSE_ERROR;
 	}
 
-	if (num_import(&s->counter, field[FIELD_COUNTER], NUM_FORMAT_HEX) != 0) {
-		print(PRINT_ERROR, "Error while parsing counter.\n");
-		goto cleanup;
+	if (count < expected) {
+		print(PRINT_ERROR, "State file invalid. Not enough fields.\n");
+		return STATE_PARSE_ERROR;
 	}
 
-	if (num_import(&s->latest_card, field[FIELD_LATEST_CARD], NUM_FORMAT_HEX) != 0) {
-		print(PRINT_ERROR,
-		      "Error while parsing number "
-		      "of latest printed passcard\n");
-		goto cleanup;
+	if (count > expected) {
+		print(PRINT_ERROR, "State file invalid. Too much fields.\n");
+		return STATE_PARSE_ERROR;
 	}
 
-	/* TODO: Change sscanf to more simple function */
-	if (sscanf(field[FIELD_FAILURES], "%u", &s->failures) != 1) {
-		print(PRINT_ERROR, "Error while parsing failures count\n");
-		goto cleanup;
+	for (i = 0; i < count; i++) {
+		if (i != FIELD_PADDING && field[i].length > STATE_MAX_FIELD_SIZE) {
+			print(PRINT_ERROR,
+			      "State file corrupted. Entry too long\n");
+			return STATE_PARSE_ERROR;
+		}
 	}
 
-	if (sscanf(field[FIELD_RECENT_FAILURES], "%u", &s->recent_failures) != 1) {
-		print(PRINT_ERROR, "Error while parsing recent failure count\n");
-		goto cleanup;
-	}
+	return 0;
+}
 
-	if (sscanf(field[FIELD_CHANNEL_TIME], "%" PRIuMAX, &s->channel_time) != 1) {
-		print(PRINT_ERROR, "Error while parsing channel use time.\n");
-		goto cleanup;
-	}
+/* Global database mapped into memory. Mapping is private
+ * and writable, so an entry can be parsed in place;
+ * changes never reach the file. */
+typedef struct {
+	char *data;
+	size_t size;
+	struct stat st;
+} db_map;
 
-	if (sscanf(field[FIELD_CODE_LENGTH], "%u", &s->code_length) != 1) {
-		print(PRINT_ERROR, "Error while parsing passcode length\n");
-		goto cleanup;
+static int _db_map_open(int fd, db_map *m)
+{
+	m->data = NULL;
+	if (fstat(fd, &m->st) != 0) {
+		print_perror(PRINT_ERROR, "Unable to read database parameters");
+		return STATE_IO_ERROR;
 	}
 
-	if (sscanf(field[FIELD_ALPHABET], "%u", &s->alphabet) != 1) {
-		print(PRINT_ERROR, "Error while parsing alphabet\n");
-		goto cleanup;
-	}
+	/* Empty database can't be mapped */
+	m->size = m->st.st_size;
+	if (m->size == 0)
+		return 0;
 
-	if (sscanf(field[FIELD_FLAGS], "%x", &s->flags) != 1) {
-		print(PRINT_ERROR, "Error while parsing flags\n");
-		goto cleanup;
+	m->data = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (m->data == MAP_FAILED) {
+		print_perror(PRINT_ERROR, "Unable to map database");
+		m->data = NULL;
+		return STATE_IO_ERROR;
 	}
+	return 0;
+}
 
-	if (strlen(field[FIELD_SPASS]) == 0) {
-		s->spass_set = 0;
-	} else {
-		if (crypto_hex_to_binary(field[FIELD_SPASS], 80, s->spass) != 0) {
-			print(PRINT_ERROR, "Error while parsing static password.\n");
-			goto cleanup;
-		}
+static void _db_map_close(db_map *m)
+{
+	if (m->data)
+		munmap(m->data, m->size);
+	m->data = NULL;
+}
 
-		if (sscanf(field[FIELD_SPASS_TIME], "%" PRIuMAX, &s->spass_time) != 1) {
-			print(PRINT_ERROR, "Error while parsing static password change time.\n");
-			goto cleanup;
-		}
+/* Length of entry starting at offset, including its \n */
+static size_t _db_map_entry_length(const db_map *m, size_t offset)
+{
+	const char *end = memchr(m->data + offset, '\n', m->size - offset);
+	return end ? (size_t)(end - m->data) - offset + 1 : m->size - offset;
+}
 
-		s->spass_set = 1;
+/* Compare username of entry with username, like strcmp */
+static int _db_entry_cmp(const char *entry, size_t length, const char *username)
+{
+	const unsigned char *a = (const unsigned char *) entry;
+	const unsigned char *b = (const unsigned char *) username;
+	size_t i;
+
+	for (i = 0; i < length && a[i] != _delim[0] && a[i] != '\n'; i++) {
+		if (a[i] != b[i])
+			return a[i] < b[i] ? -1 : 1;
 	}
+	return b[i] == '\0' ? 0 : -1;
+}
 
-	/* Copy label and contact */
-	strncpy(s->label, field[FIELD_LABEL], sizeof(s->label)-1);
-	strncpy(s->contact, field[FIELD_CONTACT], sizeof(s->contact)-1);
+/* Find entry of username in mapped global database. Compaction
+ * keeps the database sorted, and new entries are inserted in order,
+ * so binary search usually finds it. Database written by older
+ * versions might be unsorted; the index and then a scan of
+ * whole mapping are used if search fails. */
+static int _db_map_find(const db_map *m, const char *db, const char *username,
+			size_t *offset, size_t *length)
+{
+	size_t lo = 0, hi = m->size, pos, len;
+	uint64_t idx_offset;
+	char idx[STATE_PATH_SIZE + sizeof(DB_INDEX_SUFFIX)];
+	int cmp;
+
+	while (lo < hi) {
+		/* Back to the start of entry; lo is always one */
+		pos = lo + (hi - lo) / 2;
+		while (pos > lo && m->data[pos - 1] != '\n')
+			pos--;
+
+		len = _db_map_entry_length(m, pos);
+		cmp = _db_entry_cmp(m->data + pos, len, username);
+		if (cmp == 0)
+			goto found;
+		if (cmp < 0)
+			lo = pos + len;
+		else
+			hi = pos;
+	}
 
-	if (s->label[sizeof(s->label)-1] != '\0') {
-		print(PRINT_ERROR, "Label field too long\n");
-		goto cleanup;
+	if (_db_sidecar_name(idx, sizeof(idx), db, DB_INDEX_SUFFIX) == 0 &&
+	    db_index_find(idx, &m->st, username, &idx_offset) == 0 &&
+	    idx_offset < m->size &&
+	    (idx_offset == 0 || m->data[idx_offset - 1] == '\n')) {
+		pos = idx_offset;
+		len = _db_map_entry_length(m, pos);
+		if (_db_entry_cmp(m->data + pos, len, username) == 0)
+			goto found;
 	}
 
-	if (s->contact[sizeof(s->contact)-1] != '\0') {
-		print(PRINT_ERROR, "Contact field too long\n");
-		goto cleanup;
+	for (pos = 0; pos < m->size; pos += len) {
+		len = _db_map_entry_length(m, pos);
+		if (_db_entry_cmp(m->data + pos, len, username) == 0)
+			goto found;
+	}
+	return STATE_NO_USER_ENTRY;
+
+found:
+	if (len >= STATE_ENTRY_SIZE || m->data[pos + len - 1] != '\n') {
+		print(PRINT_NOTICE, "Line too long inside the state file\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (len < 10) {
+		/* This can't hold correct state */
+		print(PRINT_NOTICE, "State file is invalid. Line too short.\n");
+		return STATE_PARSE_ERROR;
 	}
 
+	*offset = pos;
+	*length = len;
+	return 0;
+}
+
+/* Check values read from database entry of any version */
+static int _db_check_state(const state *s, const char *db)
+{
 	if (!state_validate_str(s->label)) {
 		print(PRINT_ERROR, "Illegal characters in label\n");
-		goto cleanup;
+		return STATE_PARSE_ERROR;
 	}
 
 	if (!state_validate_str(s->contact)) {
 		print(PRINT_ERROR, "Illegal characters in contact\n");
-		goto cleanup;
+		return STATE_PARSE_ERROR;
 	}
 
 	/* Everything is read. Now - check if it's correct */
@@ -684,324 +1161,2140 @@ int db_file_load(state *s)
 		print(PRINT_ERROR,
 		      "Read a negative counter. "
 		      "State file is corrupted.\n");
-		goto cleanup;
+		return STATE_PARSE_ERROR;
 	}
 
 	if (num_sgn(s->latest_card) == -1) {
 		print(PRINT_ERROR,
 		      "Latest printed card is negative. "
 		      "State file is corrupted.\n");
-		goto cleanup;
+		return STATE_PARSE_ERROR;
 	}
 
 	if (s->code_length < 2 || s->code_length > 16) {
 		print(PRINT_ERROR, "Illegal passcode length. %s is invalid\n",
 		      db);
-		goto cleanup;
+		return STATE_PARSE_ERROR;
 	}
 
 	if (s->flags > (FLAG_SHOW|FLAG_SALTED|FLAG_DISABLED)) {
 		print(PRINT_ERROR, "Unsupported set of flags. %s is invalid\n",
 		      db);
-		goto cleanup;
+		return STATE_PARSE_ERROR;
 
 	}
 
-	retval = 0;
-cleanup:
-	/* Clear memory */
-	memset(buff, 0, sizeof(buff));
-	/* Unlocked if locally locked */
-	if ((locked == 1) && (db_file_unlock(s) != 0)) {
-		print(PRINT_ERROR, "Error while unlocking state file!\n");
-		if (retval == 0)
-			retval = STATE_LOCK_ERROR;
+	return 0;
+}
+
+/* Parse database entry of given length (including its \n) into
+ * state. Entry is split in place; nothing is allocated. */
+static int _db_parse_state(state *s, char *entry, size_t length, const char *db)
+{
+	/* Fields within entry */
+	db_field field[fields_fixed];
+	uint64_t value;
+	int ret;
+
+	ret = _db_parse_user_entry(entry, length, field);
+	if (ret != 0) {
+		/* Parse error */
+		return ret;
 	}
-	if (f)
-		fclose(f);
 
-cleanup1:
-	free(db);
-	free(tmp);
-	free(lck);
-	free(home);
-	return retval;
+	if (_db_field_bytes(&field[FIELD_KEY], s->sequence_key,
+			    sizeof(s->sequence_key)) != 0) {
+		print(PRINT_ERROR, "Error while parsing sequence key.\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (_db_field_num(&field[FIELD_COUNTER], &s->counter) != 0) {
+		print(PRINT_ERROR, "Error while parsing counter.\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (_db_field_num(&field[FIELD_LATEST_CARD], &s->latest_card) != 0) {
+		print(PRINT_ERROR,
+		      "Error while parsing number "
+		      "of latest printed passcard\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (_db_field_uint(&field[FIELD_FAILURES], 10, UINT_MAX, &value) != 0) {
+		print(PRINT_ERROR, "Error while parsing failures count\n");
+		return STATE_PARSE_ERROR;
+	}
+	s->failures = value;
+
+	if (_db_field_uint(&field[FIELD_RECENT_FAILURES], 10, UINT_MAX, &value) != 0) {
+		print(PRINT_ERROR, "Error while parsing recent failure count\n");
+		return STATE_PARSE_ERROR;
+	}
+	s->recent_failures = value;
+
+	if (_db_field_uint(&field[FIELD_CHANNEL_TIME], 10, UINT64_MAX, &value) != 0) {
+		print(PRINT_ERROR, "Error while parsing channel use time.\n");
+		return STATE_PARSE_ERROR;
+	}
+	s->channel_time = value;
+
+	if (_db_field_uint(&field[FIELD_CODE_LENGTH], 10, UINT_MAX, &value) != 0) {
+		print(PRINT_ERROR, "Error while parsing passcode length\n");
+		return STATE_PARSE_ERROR;
+	}
+	s->code_length = value;
+
+	if (_db_field_uint(&field[FIELD_ALPHABET], 10, UINT_MAX, &value) != 0) {
+		print(PRINT_ERROR, "Error while parsing alphabet\n");
+		return STATE_PARSE_ERROR;
+	}
+	s->alphabet = value;
+
+	if (_db_field_uint(&field[FIELD_FLAGS], 16, UINT_MAX, &value) != 0) {
+		print(PRINT_ERROR, "Error while parsing flags\n");
+		return STATE_PARSE_ERROR;
+	}
+	s->flags = value;
+
+	if (field[FIELD_SPASS].length == 0) {
+		s->spass_set = 0;
+	} else {
+		if (_db_field_bytes(&field[FIELD_SPASS], s->spass,
+				    sizeof(s->spass)) != 0) {
+			print(PRINT_ERROR, "Error while parsing static password.\n");
+			return STATE_PARSE_ERROR;
+		}
+
+		if (_db_field_uint(&field[FIELD_SPASS_TIME], 10, UINT64_MAX, &value) != 0) {
+			print(PRINT_ERROR, "Error while parsing static password change time.\n");
+			return STATE_PARSE_ERROR;
+		}
+		s->spass_time = value;
+
+		s->spass_set = 1;
+	}
+
+	/* Copy label and contact with their \0 */
+	if (field[FIELD_LABEL].length >= sizeof(s->label)) {
+		print(PRINT_ERROR, "Label field too long\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (field[FIELD_CONTACT].length >= sizeof(s->contact)) {
+		print(PRINT_ERROR, "Contact field too long\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	memcpy(s->label, field[FIELD_LABEL].str, field[FIELD_LABEL].length + 1);
+	memcpy(s->contact, field[FIELD_CONTACT].str, field[FIELD_CONTACT].length + 1);
+
+	return _db_check_state(s, db);
 }
 
-static int _db_generate_user_entry(const state *s, char *buffer, int buff_length)
+/* Hash of state fields which can't be stored in the journal. With
+ * failures set failure counts and channel time are hashed too. */
+static uint64_t _db_state_hash(const state *s, int failures)
 {
-	int retval = 1;
-	int tmp;
+	struct {
+		unsigned int failures, recent_failures;
+		state_time_t channel_time;
+		unsigned char sequence_key[32];
+		num_t latest_card;
+		unsigned int code_length, alphabet, flags;
+		int spass_set;
+		unsigned char spass[STATE_SPASS_SIZE];
+		state_time_t spass_time;
+		char label[STATE_LABEL_SIZE];
+		char contact[STATE_CONTACT_SIZE];
+	} fields;
+	uint64_t hash;
+
+	memset(&fields, 0, sizeof(fields));
+	if (failures) {
+		fields.failures = s->failures;
+		fields.recent_failures = s->recent_failures;
+		fields.channel_time = s->channel_time;
+	}
+	memcpy(fields.sequence_key, s->sequence_key, sizeof(fields.sequence_key));
+	fields.latest_card = s->latest_card;
+	fields.code_length = s->code_length;
+	fields.alphabet = s->alphabet;
+	fields.flags = s->flags;
+	fields.spass_set = s->spass_set;
+	memcpy(fields.spass, s->spass, sizeof(fields.spass));
+	fields.spass_time = s->spass_time;
+	memcpy(fields.label, s->label, sizeof(fields.label));
+	memcpy(fields.contact, s->contact, sizeof(fields.contact));
+
+	hash = db_index_hash((const char *)&fields, sizeof(fields));
+	memset(&fields, 0, sizeof(fields));
+
+	/* 0 means "not loaded" */
+	return hash ? hash : 1;
+}
 
-	/* Converted state parts */
-	char sequence_key[65] = {0};
-	char counter[35] = {0};
-	char latest_card[35] = {0};
-	char spass[81] = {0};
+/* Hash of sequence key and flags; counter of a new key (salted
+ * with FLAG_SALTED) starts a sequence of its own */
+static uint64_t _db_key_hash(const state *s)
+{
+	struct {
+		unsigned char sequence_key[32];
+		unsigned int flags;
+	} fields;
+	uint64_t hash;
+
+	memset(&fields, 0, sizeof(fields));
+	memcpy(fields.sequence_key, s->sequence_key, sizeof(fields.sequence_key));
+	fields.flags = s->flags;
+
+	hash = db_index_hash((const char *)&fields, sizeof(fields));
+	memset(&fields, 0, sizeof(fields));
+	return hash;
+}
 
-	if (crypto_binary_to_hex(s->sequence_key, 32, sequence_key) != 0) {
-		print(PRINT_ERROR, "Strange error while converting sequence key into hex\n");
-		goto error;
+/* Stored counter is the end of lease; continue from
+ * the position within it if it's known. Lease file has no
+ * integrity protection, so a position before the start of the
+ * lease is never trusted - it would allow used passcodes again. */
+static void _db_file_lease_load(state *s)
+{
+	const cfg_t *cfg = cfg_get();
+	const num_t lease = num_i(cfg->db_lease);
+	db_lease l;
+
+	if (db_lease_read(cfg->db_lease_dir, s->username, &l, cfg->user_uid) == 0) {
+		const num_t position = num_ii(l.position_hi, l.position_lo);
+		if (num_cmp(num_ii(l.end_hi, l.end_lo), s->counter) == 0 &&
+		    num_cmp(position, s->counter) <= 0 &&
+		    (num_cmp(s->counter, lease) < 0 ||
+		     num_cmp(position, num_sub(s->counter, lease)) >= 0)) {
+			s->counter = position;
+			return;
+		}
+		print(PRINT_WARN, "Lease position of %s doesn't match database\n",
+		      s->username);
 	}
 
-	tmp = 0;
-	tmp += num_export(s->counter, counter, NUM_FORMAT_HEX);
-	tmp += num_export(s->latest_card, latest_card, NUM_FORMAT_HEX);
+	print(PRINT_NOTICE, "Lease position of %s unknown; continuing from "
+	      "stored counter (up to %d passcodes might be skipped)\n",
+	      s->username, cfg->db_lease);
+}
 
-	if (tmp != 0) {
-		print(PRINT_ERROR, "Error while converting numbers\n");
-		goto error;
+/* Remember position within lease which ends at stored counter */
+static void _db_file_lease_store(const state *s, const num_t position)
+{
+	const cfg_t *cfg = cfg_get();
+	db_lease l;
+
+	l.end_hi = s->db_counter.hi;
+	l.end_lo = s->db_counter.lo;
+	l.position_hi = position.hi;
+	l.position_lo = position.lo;
+
+	if (db_lease_write(cfg->db_lease_dir, s->username, &l,
+			   geteuid() == 0 ? cfg->user_uid : (uid_t) -1,
+			   cfg->user_gid) != 0) {
+		/* Outdated position must not be used; without it
+		 * user continues from the end of lease */
+		db_lease_remove(cfg->db_lease_dir, s->username);
+		print(PRINT_WARN, "Unable to store lease position of %s\n",
+		      s->username);
 	}
+}
 
-	if (s->spass_set) {
-		tmp = crypto_binary_to_hex(s->spass, 40, spass);
-		if (tmp != 0) {
-			print(PRINT_ERROR, "Error while converting static password data\n");
-			goto error;
-		}
+static void _db_journal_apply(state *s, const db_journal_record *r)
+{
+	s->counter = num_ii(r->counter_hi, r->counter_lo);
+	s->failures = r->failures;
+	s->recent_failures = r->recent_failures;
+	s->channel_time = r->channel_time;
+}
+
+/* Override entry read from the global database with the latest
+ * journal record of the user */
+static int _db_file_journal_replay(state *s, const char *db)
+{
+	db_journal_record r;
+	char jnl[STATE_PATH_SIZE + sizeof(DB_JOURNAL_SUFFIX)];
+	int ret;
+
+	if (_db_sidecar_name(jnl, sizeof(jnl), db, DB_JOURNAL_SUFFIX) != 0)
+		return STATE_IO_ERROR;
+
+	ret = db_journal_find(jnl, s->username, &r);
+
+	switch (ret) {
+	case 0:
+		_db_journal_apply(s, &r);
+		print(PRINT_NOTICE, "State updated from journal\n");
+		return 0;
+	case 1:
+		return 0;
+	default:
+		/* Ignoring the journal could bring back used passcodes */
+		return STATE_IO_ERROR;
 	}
+}
 
-	tmp = snprintf(buffer, buff_length,
-		       "%s:%d:"	             /* User, version */
-		       "%s:%s:%s:"           /* Key, counter, latest_card */
-		       "%u:%u:%" PRIuMAX ":" /* Failures, recent fails, channel time */
-		       "%u:%u:%x:%s:"        /* Codelength, alphabet, flags, spass */
-		       "%" PRIuMAX ":"	     /* Time of spass change */
-		       "%s:%s\n",            /* label, contact */
-		       s->username, _version,
-		       sequence_key, counter, latest_card,
-		       s->failures, s->recent_failures, s->channel_time,
-		       s->code_length, s->alphabet, s->flags, spass,
-		       s->spass_time,
-		       s->label, s->contact);
-	if (tmp < 10 || tmp == buff_length) {
-		print(PRINT_ERROR, "Error while writing data to state file.");
-		goto error;
+/* Append counter and failures of the state to the journal. Returns
+ * 1 if user can't be journaled (username too long). Number of
+ * records in journal is stored in records. */
+static int _db_file_journal_store(const state *s, const char *db,
+				  size_t *records)
+{
+	const cfg_t *cfg = cfg_get();
+	db_journal_record r;
+	char *jnl;
+	int ret;
+
+	if (db_journal_record_init(&r, s->username) != 0)
+		return 1;
+
+	r.counter_hi = s->counter.hi;
+	r.counter_lo = s->counter.lo;
+	r.failures = s->failures;
+	r.recent_failures = s->recent_failures;
+	r.channel_time = s->channel_time;
+	r.timestamp = time(NULL);
+
+	jnl = _db_sidecar_path(db, DB_JOURNAL_SUFFIX);
+	if (!jnl)
+		return STATE_NOMEM;
+
+	/* Flushed together with appends of other sessions */
+	ret = db_journal_append(jnl, &r, 0,
+				geteuid() == 0 ? cfg->user_uid : (uid_t) -1,
+				cfg->user_gid, records);
+	if (ret == 0)
+		ret = _db_file_group_sync(s->lock, DB_FILE_SYNC_JOURNAL, -1, jnl);
+	if (ret == 0 && *records == 1 && _db_file_sync_dir(jnl) != 0)
+		print_perror(PRINT_WARN, "Unable to flush directory of %s", jnl);
+	free(jnl);
+
+	if (ret != 0)
+		return STATE_IO_ERROR;
+
+	print(PRINT_NOTICE, "State update appended to journal\n");
+	return 0;
+}
+
+/* Check if state file holds a binary record */
+static int _db_file_is_record(FILE *f)
+{
+	char magic[4];
+	const size_t got = fread(magic, 1, sizeof(magic), f);
+	rewind(f);
+	return db_record_is_binary(magic, got);
+}
+
+/* Load state from database without copying the entry out of the
+ * mapping. Binary record of user state file is decoded directly. */
+static int _db_file_load_mapped(state *s, const char *db)
+{
+	size_t offset, length;
+	db_map m;
+	int fd, ret;
+
+	fd = open(db, O_RDONLY);
+	if (fd == -1) {
+		ret = errno == ENOENT ? STATE_NON_EXISTENT : STATE_IO_ERROR;
+		print_perror(PRINT_ERROR, "Unable to open %s for reading.", db);
+		return ret;
 	}
 
-	retval = 0;
-error:
-	memset(sequence_key, 0, sizeof(sequence_key));
-	return retval;
+	ret = _db_map_open(fd, &m);
+	close(fd);
+	if (ret != 0)
+		return ret;
+
+	if (cfg_get()->db == CONFIG_DB_USER && db_record_is_binary(m.data, m.size)) {
+		ret = db_record_decode(s, (const unsigned char *) m.data, m.size, NULL);
+		if (ret == 0)
+			ret = _db_check_state(s, db);
+		memset(m.data, 0, m.size);
+		_db_map_close(&m);
+		return ret;
+	}
+
+	ret = _db_map_find(&m, db, s->username, &offset, &length);
+	if (ret == 0 && _db_is_fixed_entry(m.data + offset, length)) {
+		/* Slot can be overwritten in place while we read it. Pages
+		 * of the mapping which we didn't write to follow the file,
+		 * so the entry is copied out and its seal checked on the
+		 * copy. */
+		char slot[DB_FILE_SLOT_SIZE];
+		int attempt;
+
+		for (attempt = 0; ; attempt++) {
+			memcpy(slot, m.data + offset, sizeof(slot));
+			if (!_db_slot_is_torn(slot, sizeof(slot)) ||
+			    attempt == DB_FILE_TORN_RETRIES)
+				break;
+			usleep(DB_FILE_TORN_DELAY);
+		}
+		ret = _db_parse_state(s, slot, sizeof(slot), db);
+		memset(slot, 0, sizeof(slot));
+	} else if (ret == 0) {
+		/* Entry is split within our private pages */
+		ret = _db_parse_state(s, m.data + offset, length, db);
+		memset(m.data + offset, 0, length);
+	}
+
+	_db_map_close(&m);
+	return ret;
 }
 
-int db_file_store(state *s, int remove)
+/**********************************************
+ * Interface functions for managing state files
+ **********************************************/
+int db_file_locate(state *s)
 {
-	/* Return value, by default return error */
+	state_location *l = &s->location;
+	const cfg_t *cfg = cfg_get();
+	const struct passwd *pwdata;
 	int ret;
 
-	/* State file */
-	FILE *in = NULL, *out = NULL;
+	assert(s->username != NULL);
+	assert(cfg != NULL);
+
+	l->uid = (uid_t) -1;
+	l->gid = (gid_t) -1;
+	l->home[0] = '\0';
+
+	/* Determine db location at first */
+	switch (cfg->db) {
+	case CONFIG_DB_USER:
+		/* Get home */
+		pwdata = getpwnam(s->username);
+		if (!pwdata || !pwdata->pw_dir) {
+			l->status = STATE_NO_SUCH_USER;
+			return l->status;
+		}
+
+		/* Append a filename */
+		ret = snprintf(l->db, sizeof(l->db), "%s/%s",
+			       pwdata->pw_dir, cfg->user_db_path);
+		if (ret < 0 || ret >= (int) sizeof(l->db)) {
+			print(PRINT_ERROR, "Path of state file is too long\n");
+			l->status = STATE_IO_ERROR;
+			return l->status;
+		}
+
+		/* Home is a prefix of db */
+		strcpy(l->home, pwdata->pw_dir);
+		l->uid = pwdata->pw_uid;
+		l->gid = pwdata->pw_gid;
+		break;
+
+	case CONFIG_DB_GLOBAL:
+		/* Config path is shorter than our buffer,
+		 * even with the shard appended */
+		ret = db_file_shard_path(cfg->global_db_path, cfg->db_shards,
+					 s->username, l->db, sizeof(l->db));
+		assert(ret == 0);
+		break;
+
+	case CONFIG_DB_MYSQL:
+	case CONFIG_DB_LDAP:
+	default:
+		/* We should not be called with this options never */
+		assert(0);
+		l->status = 1;
+		return l->status;
+	}
+
+	/* Lock and temporary filenames; normal file + .lck/.tmp.
+	 * Buffers are larger than db by the length of suffix. */
+	strcpy(l->lck, l->db);
+	strcat(l->lck, ".lck");
+	strcpy(l->tmp, l->db);
+	strcat(l->tmp, ".tmp");
+
+	l->status = 0;
+	return 0;
+}
+
+int db_file_load(state *s)
+{
+	/* Did we lock it here? */
+	int locked;
+
+	/* Temporary variable for returned values */
+	int ret = 0;
+
+	/* Value returned. */
+	int retval;
+
+	/* Database located by state_init */
+	const char *db = s->location.db;
+	if (s->location.status != 0) {
+		return s->location.status;
+	}
+
+	/* Permissions are checked once; locking
+	 * below won't check them again */
+	retval = _db_file_check(s);
+	if (retval != 0) {
+		s->db_permissions = -1;
+		return retval;
+	}
+
+	/* DB file should always be locked before changing.
+	 * Locking can only be omitted when we want to discard
+	 * any changes or that we don't bother if somebody changes
+	 * them at the same time.
+	 * Here we just detect that it's not locked and lock it then
+	 */
+	if (s->lock <= 0) {
+		print(PRINT_NOTICE,
+		      "State file not locked while reading from it\n");
+		retval = db_file_lock(s);
+		if (retval != 0) {
+			print(PRINT_ERROR, "Unable to lock file for reading!\n");
+			return retval;
+		}
+
+		/* Locked locally, unlock locally later */
+		locked = 1;
+	} else {
+		locked = 0;
+	}
+
+	/* Entry is searched and parsed in memory */
+	ret = _db_file_load_mapped(s, db);
+	if (ret != 0) {
+		/* No entry, or file invalid */
+		retval = ret;
+		goto cleanup;
+	}
+
+	/* Newer counter might be waiting in the journal */
+	if (cfg_get()->db == CONFIG_DB_GLOBAL) {
+		retval = _db_file_journal_replay(s, db);
+		if (retval != 0)
+			goto cleanup;
+	}
+
+	s->db_hash = _db_state_hash(s, 0);
+	s->db_counter_hash = _db_state_hash(s, 1);
+	s->db_counter = s->counter;
+	s->db_key_hash = _db_key_hash(s);
+
+	if (cfg_get()->db == CONFIG_DB_GLOBAL && cfg_get()->db_lease > 0)
+		_db_file_lease_load(s);
+
+	retval = 0;
+cleanup:
+	/* Unlocked if locally locked */
+	if ((locked == 1) && (db_file_unlock(s) != 0)) {
+		print(PRINT_ERROR, "Error while unlocking state file!\n");
+		if (retval == 0)
+			retval = STATE_LOCK_ERROR;
+	}
+	return retval;
+}
+
+/* Generate entry line of given version. Fixed-width entry which
+ * wouldn't fit in a slot is generated in version 1 instead. */
+static int _db_generate_user_entry(const state *s, char *buffer, int buff_length,
+				   int version)
+{
+	int retval = 1;
+	int tmp;
+
+	/* Converted state parts */
+	char sequence_key[65] = {0};
+	char counter[35] = {0};
+	char latest_card[35] = {0};
+	char spass[81] = {0};
+
+	if (crypto_binary_to_hex(s->sequence_key, 32, sequence_key) != 0) {
+		print(PRINT_ERROR, "Strange error while converting sequence key into hex\n");
+		goto error;
+	}
+
+	tmp = 0;
+	tmp += num_export(s->counter, counter, NUM_FORMAT_HEX);
+	tmp += num_export(s->latest_card, latest_card, NUM_FORMAT_HEX);
+
+	if (tmp != 0) {
+		print(PRINT_ERROR, "Error while converting numbers\n");
+		goto error;
+	}
+
+	if (s->spass_set) {
+		tmp = crypto_binary_to_hex(s->spass, 40, spass);
+		if (tmp != 0) {
+			print(PRINT_ERROR, "Error while converting static password data\n");
+			goto error;
+		}
+	}
+
+	tmp = snprintf(buffer, buff_length,
+		       "%s:%d:"	             /* User, version */
+		       "%s:%s:%s:"           /* Key, counter, latest_card */
+		       "%u:%u:%" PRIuMAX ":" /* Failures, recent fails, channel time */
+		       "%u:%u:%x:%s:"        /* Codelength, alphabet, flags, spass */
+		       "%" PRIuMAX ":"	     /* Time of spass change */
+		       "%s:%s",              /* label, contact */
+		       s->username, version,
+		       sequence_key, counter, latest_card,
+		       s->failures, s->recent_failures, s->channel_time,
+		       s->code_length, s->alphabet, s->flags, spass,
+		       s->spass_time,
+		       s->label, s->contact);
+	if (tmp < 10 || tmp + 2 > buff_length) {
+		print(PRINT_ERROR, "Error while writing data to state file.");
+		goto error;
+	}
+
+	if (version == _version_fixed) {
+		/* Separator, seal and \n must fit in the slot */
+		if (tmp + 1 > DB_FILE_SEAL_OFFSET) {
+			print(PRINT_NOTICE, "Entry too long for a fixed-width "
+			      "record; using version %d\n", _version);
+			retval = _db_generate_user_entry(s, buffer, buff_length, _version);
+			goto error;
+		}
+		buffer[tmp++] = _delim[0];
+		memset(buffer + tmp, ' ', DB_FILE_SLOT_SIZE - 1 - tmp);
+		_db_slot_seal(buffer);
+		tmp = DB_FILE_SLOT_SIZE - 1;
+	}
+	buffer[tmp++] = '\n';
+	buffer[tmp] = '\0';
+
+	retval = 0;
+error:
+	memset(sequence_key, 0, sizeof(sequence_key));
+	return retval;
+}
+
+/* Overwrite fixed-width entry of the user in place. Returns 1 if
+ * the entry is missing or can't be overwritten safely, so the
+ * database has to be rewritten.
+ *
+ * Only sealed slots starting at a multiple of DB_FILE_SLOT_SIZE are
+ * overwritten: such a slot covers whole sectors, which storage writes
+ * atomically, so a crash leaves either the old or the new entry. Slots
+ * moved off the boundary by version 1 entries before them are
+ * rewritten with the whole file until `otpasswd --convert-db'. Readers
+ * which don't take the lock may still see a slot while it's being
+ * written; the seal won't match then and they read it again. */
+static int _db_file_store_inplace(const state *s, const char *db)
+{
+	char new_entry[STATE_ENTRY_SIZE];
+	struct stat st_after;
+	size_t offset, length;
+	char *idx = NULL;
+	db_map m;
+	int fd;
+	int ret = 1;
+
+	fd = open(db, O_RDWR);
+	if (fd == -1)
+		return 1;
+
+	if (_db_map_open(fd, &m) != 0)
+		goto cleanup;
+
+	if (_db_map_find(&m, db, s->username, &offset, &length) != 0 ||
+	    !_db_is_fixed_entry(m.data + offset, length) ||
+	    !_db_slot_is_sealed(m.data + offset) ||
+	    _db_slot_is_torn(m.data + offset, length) ||
+	    offset % DB_FILE_SLOT_SIZE != 0)
+		goto cleanup;
+
+	if (_db_generate_user_entry(s, new_entry, sizeof(new_entry),
+				    _version_fixed) != 0 ||
+	    !_db_is_fixed_entry(new_entry, strlen(new_entry)))
+		goto cleanup;
+
+	/* From now on failures can't be recovered by rewriting */
+	ret = STATE_IO_ERROR;
+	if (pwrite(fd, new_entry, DB_FILE_SLOT_SIZE, offset)
+	    != DB_FILE_SLOT_SIZE) {
+		print_perror(PRINT_ERROR, "Unable to update entry in %s", db);
+		goto cleanup;
+	}
+
+	if (_db_file_group_sync(s->lock, DB_FILE_SYNC_DB, fd, NULL) != 0 ||
+	    fstat(fd, &st_after) != 0) {
+		print_perror(PRINT_ERROR, "Unable to flush %s", db);
+		goto cleanup;
+	}
+
+	/* No entry moved; update index only if it was valid */
+	idx = _db_sidecar_path(db, DB_INDEX_SUFFIX);
+	if (!idx || db_index_touch(idx, &m.st, &st_after) != 0)
+		print(PRINT_NOTICE, "Database index not updated\n");
+
+	print(PRINT_NOTICE, "State entry updated in place\n");
+	ret = 0;
+
+cleanup:
+	memset(new_entry, 0, sizeof(new_entry));
+	free(idx);
+	_db_map_close(&m);
+	close(fd);
+	return ret;
+}
+
+/* Write index of a freshly stored global database */
+static void _db_file_store_index(const char *db, const db_index_builder *index)
+{
+	struct stat st;
+	char *idx;
+	uid_t uid = (uid_t) -1;
+	gid_t gid = (gid_t) -1;
+
+	if (stat(db, &st) != 0) {
+		print_perror(PRINT_WARN, "Unable to read database parameters");
+		return;
+	}
+
+	/* Index should be owned by the same user as database */
+	if (geteuid() == 0) {
+		uid = st.st_uid;
+		gid = st.st_gid;
+	}
+
+	idx = _db_sidecar_path(db, DB_INDEX_SUFFIX);
+	if (!idx || db_index_write(index, idx, &st, uid, gid) != 0)
+		print(PRINT_WARN, "Unable to update database index\n");
+	free(idx);
+}
+
+/* Entry of the user was stored in the database; if the journal holds
+ * any records, append the stored values too, so older records of the
+ * user don't override the entry. */
+static int _db_file_journal_supersede(const state *s, const char *db)
+{
+	size_t records;
+	int ret;
+	char *jnl = _db_sidecar_path(db, DB_JOURNAL_SUFFIX);
+	if (!jnl)
+		return STATE_NOMEM;
+	records = db_journal_records(jnl);
+	free(jnl);
+
+	if (records == 0)
+		return 0;
+
+	/* Users which can't be journaled have no records */
+	ret = _db_file_journal_store(s, db, &records);
+	return ret == 1 ? 0 : ret;
+}
+
+static int _db_journal_cmp(const void *a, const void *b)
+{
+	const db_journal_record *ra = *(const db_journal_record * const *)a;
+	const db_journal_record *rb = *(const db_journal_record * const *)b;
+	const int ret = strcmp(ra->username, rb->username);
+	if (ret != 0)
+		return ret;
+	/* Records are in order of appending */
+	return ra < rb ? -1 : ra > rb;
+}
+
+/* Entry of mapped database, for sorting */
+typedef struct {
+	const char *data;
+	size_t length;		/* Including \n */
+	size_t name_length;
+} db_map_entry;
+
+static int _db_map_entry_cmp(const void *a, const void *b)
+{
+	const db_map_entry *ea = a, *eb = b;
+	const size_t length = ea->name_length < eb->name_length ?
+		ea->name_length : eb->name_length;
+	const int ret = memcmp(ea->data, eb->data, length);
+	if (ret != 0)
+		return ret;
+	return ea->name_length < eb->name_length ? -1 :
+		ea->name_length > eb->name_length;
+}
+
+/* Number of entries in mapped database */
+static size_t _db_map_count(const db_map *m)
+{
+	size_t pos, count = 0;
+	for (pos = 0; pos < m->size; pos += _db_map_entry_length(m, pos))
+		count++;
+	return count;
+}
+
+/* Describe all entries of mapped database in entries, which has
+ * room for _db_map_count of them. Entries are validated. */
+static int _db_map_collect(const db_map *m, db_map_entry *entries)
+{
+	size_t pos;
+	const char *sep;
+
+	for (pos = 0; pos < m->size; pos += entries->length, entries++) {
+		entries->data = m->data + pos;
+		entries->length = _db_map_entry_length(m, pos);
+		sep = memchr(entries->data, _delim[0], entries->length);
+		if (entries->data[entries->length - 1] != '\n' || !sep ||
+		    entries->length >= STATE_ENTRY_SIZE) {
+			print(PRINT_ERROR, "Database entry is invalid\n");
+			return STATE_PARSE_ERROR;
+		}
+		entries->name_length = sep - entries->data;
+	}
+	return 0;
+}
+
+/* Sort entries by username; every user must have a single entry */
+static int _db_map_sort(db_map_entry *entries, size_t count)
+{
+	size_t i;
+
+	qsort(entries, count, sizeof(*entries), _db_map_entry_cmp);
+	for (i = 1; i < count; i++) {
+		if (_db_map_entry_cmp(&entries[i - 1], &entries[i]) == 0) {
+			print(PRINT_ERROR, "Double user entry in database\n");
+			return STATE_PARSE_ERROR;
+		}
+	}
+	return 0;
+}
+
+static int _db_journal_find_cmp(const void *key, const void *b)
+{
+	const db_map_entry *e = key;
+	const db_journal_record *rb = *(const db_journal_record * const *)b;
+	return _db_entry_cmp(e->data, e->length, rb->username);
+}
+
+/* Fold journal into global database and sort its entries by
+ * username. Database must be locked exclusively. */
+static int _db_file_compact(const char *db)
+{
+	char buff[STATE_ENTRY_SIZE];
+	char entry[STATE_ENTRY_SIZE];
+	db_journal_record *records = NULL;
+	db_journal_record **latest = NULL;
+	db_map_entry *entries = NULL;
+	db_index_builder index;
+	size_t count, users = 0, applied = 0, entry_count = 0, i;
+	db_map m;
+	FILE *out = NULL;
+	char *jnl = NULL, *tmp = NULL;
+	const int sync = cfg_get()->db_durability != CONFIG_DURABILITY_NONE;
+	int ret = STATE_NOMEM;
+	int fd;
+
+	db_index_builder_init(&index);
+	m.data = NULL;
+
+	jnl = _db_sidecar_path(db, DB_JOURNAL_SUFFIX);
+	tmp = _db_sidecar_path(db, ".tmp");
+	if (!jnl || !tmp)
+		goto cleanup;
+
+	if (db_journal_read(jnl, &records, &count) != 0) {
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	/* Keep only the latest record of each user */
+	latest = malloc((count + 1) * sizeof(*latest));
+	if (!latest)
+		goto cleanup;
+	for (i = 0; i < count; i++)
+		latest[i] = &records[i];
+	qsort(latest, count, sizeof(*latest), _db_journal_cmp);
+	for (i = 0; i < count; i++) {
+		if (i + 1 < count &&
+		    strcmp(latest[i]->username, latest[i + 1]->username) == 0)
+			continue;
+		latest[users++] = latest[i];
+	}
+
+	ret = STATE_IO_ERROR;
+	fd = open(db, O_RDONLY);
+	if (fd == -1) {
+		print_perror(PRINT_ERROR, "Unable to open %s for reading", db);
+		goto cleanup;
+	}
+	ret = _db_map_open(fd, &m);
+	close(fd);
+	if (ret != 0)
+		goto cleanup;
+
+	/* Collect entries and sort them */
+	ret = STATE_NOMEM;
+	entry_count = _db_map_count(&m);
+	entries = malloc((entry_count + 1) * sizeof(*entries));
+	if (!entries)
+		goto cleanup;
+
+	ret = _db_map_collect(&m, entries);
+	if (ret == 0)
+		ret = _db_map_sort(entries, entry_count);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = STATE_IO_ERROR;
+	out = fopen(tmp, "w");
+	if (!out) {
+		print_perror(PRINT_ERROR, "Unable to open %s for writing", tmp);
+		goto cleanup;
+	}
+
+	if (fchmod(fileno(out), m.st.st_mode & 0777) != 0 ||
+	    (geteuid() == 0 &&
+	     fchown(fileno(out), m.st.st_uid, m.st.st_gid) != 0)) {
+		print_perror(PRINT_ERROR, "Unable to set permissions of %s", tmp);
+		goto cleanup;
+	}
+
+	for (i = 0; i < entry_count; i++) {
+		const db_map_entry *e = &entries[i];
+		const char *data = e->data;
+		size_t length = e->length;
+		db_journal_record **found;
+		long offset;
+
+		found = bsearch(e, latest, users, sizeof(*latest),
+				_db_journal_find_cmp);
+
+		if (found) {
+			state entry_s;
+			memset(&entry_s, 0, sizeof(entry_s));
+			entry_s.username = (*found)->username;
+
+			/* Parsing modifies the line */
+			memcpy(entry, e->data, e->length);
+			ret = _db_parse_state(&entry_s, entry, e->length, db);
+			if (ret == 0) {
+				_db_journal_apply(&entry_s, *found);
+				ret = _db_generate_user_entry(
+					&entry_s, buff, sizeof(buff),
+					_db_is_fixed_entry(e->data, e->length) ?
+					_version_fixed : _version);
+			}
+			memset(&entry_s, 0, sizeof(entry_s));
+			if (ret != 0) {
+				print(PRINT_ERROR, "Unable to apply journal "
+				      "to entry of %s\n", (*found)->username);
+				ret = STATE_PARSE_ERROR;
+				goto cleanup;
+			}
+			ret = STATE_IO_ERROR;
+			data = buff;
+			length = strlen(buff);
+			applied++;
+		}
+
+		offset = ftell(out);
+		if (offset < 0 ||
+		    db_index_builder_add(&index, e->data, e->name_length,
+					 offset) != 0) {
+			ret = STATE_NOMEM;
+			goto cleanup;
+		}
+
+		if (fwrite(data, 1, length, out) != length) {
+			print_perror(PRINT_ERROR, "Error while writing %s", tmp);
+			goto cleanup;
+		}
+	}
+
+	if (fflush(out) != 0 || _db_file_sync(fileno(out)) != 0) {
+		print_perror(PRINT_ERROR, "Error while flushing %s", tmp);
+		goto cleanup;
+	}
+
+	ret = fclose(out);
+	out = NULL;
+	if (ret != 0 || rename(tmp, db) != 0) {
+		print_perror(PRINT_ERROR, "Unable to replace database");
+		unlink(tmp);
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	if (_db_file_sync_dir(db) != 0)
+		print_perror(PRINT_WARN, "Unable to flush directory of %s", db);
+
+	_db_file_store_index(db, &index);
+
+	/* Replaying records again after a crash here is harmless */
+	if (db_journal_truncate(jnl, sync) != 0) {
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	print(PRINT_NOTICE, "Compacted %u journal records into %u of %u "
+	      "sorted entries\n", (unsigned int) count,
+	      (unsigned int) applied, (unsigned int) entry_count);
+	ret = 0;
+
+cleanup:
+	memset(buff, 0, sizeof(buff));
+	memset(entry, 0, sizeof(entry));
+	if (out) {
+		fclose(out);
+		unlink(tmp);
+	}
+	_db_map_close(&m);
+	free(entries);
+	free(latest);
+	free(records);
+	free(jnl);
+	free(tmp);
+	db_index_builder_fini(&index);
+	return ret;
+}
+
+int db_file_store(state *s, int remove)
+{
+	/* Return value, by default return error */
+	int ret;
+
+	/* State file */
+	FILE *in = NULL, *out = NULL;
+
+	/* Did we lock the file? */
+	int locked = 0;
+
+	/* Do we hold global database exclusively? */
+	int structure_locked = 0;
+
+	/* Was the update appended to the journal? */
+	int journaled = 0;
+
+	cfg_t *cfg = cfg_get();
+
+	/* With counter leasing end of lease is stored instead of
+	 * the counter, which becomes position within the lease */
+	int leasing = cfg->db == CONFIG_DB_GLOBAL && remove == 0 &&
+		cfg->db_lease > 0;
+	const num_t position = s->counter;
+	int position_only = 0;
+
+	/* User state file might be written as a binary record */
+	const int binary = cfg->db == CONFIG_DB_USER &&
+		cfg->db_format == CONFIG_FORMAT_BINARY;
+
+	char user_entry_buff[STATE_ENTRY_SIZE];
+
+	/* Entry which follows ours in sorted global database */
+	char next_entry_buff[STATE_ENTRY_SIZE];
+	int greater = 0;
+
+	/* Offsets of entries for the global database index */
+	db_index_builder index_builder;
+	db_index_builder *index = NULL;
+
+	/* Files: database and temporary */
+	const char *const db = s->location.db, *const tmp = s->location.tmp;
+	if (s->location.status != 0) {
+		return s->location.status;
+	}
+
+	db_index_builder_init(&index_builder);
+	if (cfg->db == CONFIG_DB_GLOBAL)
+		index = &index_builder;
+
+	if (s->lock <= 0) {
+		print(PRINT_NOTICE,
+		      "State file not locked while writing to it. Locking for write.\n");
+		ret = db_file_lock(s);
+		if (ret != 0) {
+			print(PRINT_ERROR, "Unable to lock file for writing!\n");
+			goto cleanup_free;
+		}
+		locked = 1;
+	}
+
+	/* New key, salt or flags: lease of the old key must not be
+	 * stored with it. Real counter is stored and lease forgotten. */
+	if (leasing && s->db_hash != 0 && s->db_key_hash != _db_key_hash(s)) {
+		print(PRINT_NOTICE, "Key changed; lease dropped\n");
+		db_lease_remove(cfg->db_lease_dir, s->username);
+		leasing = 0;
+	}
+
+	if (leasing) {
+		if (s->db_hash != 0 && num_cmp(s->counter, s->db_counter) < 0) {
+			/* Still within lease. If nothing else
+			 * changed, database is left untouched. */
+			if (s->db_counter_hash == _db_state_hash(s, 1)) {
+				position_only = 1;
+				ret = 0;
+				goto cleanup_lock;
+			}
+			s->counter = s->db_counter;
+		} else {
+			s->counter = num_add(s->counter, num_i(cfg->db_lease));
+			print(PRINT_NOTICE, "Leasing next %d passcodes\n",
+			      cfg->db_lease);
+		}
+	}
+
+	/* Changes of counter and failures are only appended to the
+	 * journal if nothing else changed since the state was loaded */
+	if (cfg->db == CONFIG_DB_GLOBAL && remove == 0 && cfg->db_journal > 0 &&
+	    s->db_hash != 0 && s->db_hash == _db_state_hash(s, 0)) {
+		size_t records = 0;
+		ret = _db_file_journal_store(s, db, &records);
+		if (ret == 0 && records >= (size_t) cfg->db_journal) {
+			/* Update is already durable; compaction can fail.
+			 * Other sessions aren't waited for; a later session
+			 * or agent_otp --compact-db will compact. Unless the
+			 * journal, scanned by every load, grew too long. */
+			const double deadline =
+				records >= (size_t) cfg->db_journal * DB_FILE_JOURNAL_LIMIT ?
+				_db_file_deadline() : 0.0;
+			structure_locked = 1;
+			if (_db_file_lock_exclusive(s->lock, deadline) != 0)
+				print(PRINT_NOTICE, "Database busy, journal "
+				      "compaction postponed\n");
+			else if (_db_file_compact(db) != 0)
+				print(PRINT_WARN, "Unable to compact database journal\n");
+		}
+		if (ret != 1) {
+			journaled = 1;
+			goto cleanup_lock;
+		}
+	}
+
+	/* Updates of existing fixed-width entries
+	 * don't need to rewrite whole database */
+	if (cfg->db == CONFIG_DB_GLOBAL && remove == 0) {
+		ret = _db_file_store_inplace(s, db);
+		if (ret != 1)
+			goto cleanup_lock;
+	}
+
+	/* Rewrite of global database excludes all other sessions */
+	if (cfg->db == CONFIG_DB_GLOBAL) {
+		const double start = _db_file_now();
+
+		/* Shared lock is restored in cleanup even if this fails */
+		structure_locked = 1;
+		if (_db_file_lock_exclusive(s->lock, _db_file_deadline()) != 0) {
+			print(PRINT_ERROR, "Unable to lock database for rewrite\n");
+			ret = STATE_LOCK_ERROR;
+			goto cleanup_lock;
+		}
+		print(PRINT_NOTICE, "Waited %.1f ms for exclusive database lock\n",
+		      (_db_file_now() - start) * 1000.0);
+	}
+
+	if (cfg->db == CONFIG_DB_USER && remove) {
+		ret = unlink(db);
+		if (ret != 0) {
+			ret = STATE_IO_ERROR;
+			print_perror(PRINT_ERROR,
+				     "Unable to unlink state file\n");
+		} else {
+			ret = 0;
+		}
+		goto cleanup_lock;
+	}
+
+	in = fopen(db, "r");
+	if (!in) {
+		/* User=db and file doesn't exist - ok. */
+
+		/* Probably doesn't exists, if not... */
+		if (errno != ENOENT) {
+			/* FIXME: better rewrite to use stat */
+			print_perror(PRINT_ERROR,
+				     "Unable to open %s for reading", db);
+
+			ret = STATE_IO_ERROR;
+			goto cleanup;
+		}
+	}
+
+	/* User state file holds only our entry, so it's replaced
+	 * as a whole when it's binary or is to become binary */
+	if (in && cfg->db == CONFIG_DB_USER && (binary || _db_file_is_record(in))) {
+		fclose(in);
+		in = NULL;
+	}
+
+	out = fopen(tmp, "w");
+	if (!out) {
+		print_perror(PRINT_ERROR,
+			     "Unable to open %s for writing",
+			     tmp);
+
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+
+	}
+
+	/* Temporary file opened.
+	 * it's owner/group should match owner of original file
+	 * or if this one doesn't exist - the user we are working with.
+	 */
+	if (geteuid() == 0) {
+		struct stat st;
+
+		ret = stat(db, &st);
+		if (ret != 0) {
+			/* That's fine only for DB_USER */
+			if (cfg->db != CONFIG_DB_USER) {
+				print_perror(PRINT_ERROR, "Unable to read state file parameters and DB!=USER:");
+				ret = STATE_IO_ERROR;
+				goto cleanup;
+			}
+			st.st_uid = s->location.uid;
+			st.st_gid = s->location.gid;
+		}
+
+
+		if (chown(tmp, st.st_uid, st.st_gid) != 0) {
+			print_perror(PRINT_ERROR, "Unable to ensure owner/group of temporary file\n");
+			ret = STATE_IO_ERROR;
+			goto cleanup;
+		}
+	}
+
+
+	if (in) {
+		/* 1) Copy entries before our username. Global
+		 * database is kept sorted by username. */
+		ret = _db_find_user_entry(s->username, in, out, index,
+					  index ? &greater : NULL,
+					  user_entry_buff, sizeof(user_entry_buff));
+		if (ret != STATE_NO_USER_ENTRY && ret != 0) {
+			/* Error happened. */
+			goto cleanup;
+		}
+		if (greater)
+			memcpy(next_entry_buff, user_entry_buff, sizeof(next_entry_buff));
+	}
+
+	/* 2) Generate our new entry and store it into file */
+	if (remove == 0 && binary) {
+		ret = db_record_encode(s, (unsigned char *) user_entry_buff);
+		if (ret != 0) {
+			ret = STATE_IO_ERROR;
+			goto cleanup;
+		}
+
+		if (fwrite(user_entry_buff, 1, DB_RECORD_SIZE, out) != DB_RECORD_SIZE) {
+			print(PRINT_ERROR, "Error while writing user "
+			      "record to state file\n");
+			ret = STATE_IO_ERROR;
+			goto cleanup;
+		}
+	} else if (remove == 0) {
+		/* Global database is kept in fixed-width records */
+		ret = _db_generate_user_entry(s, user_entry_buff,
+					      sizeof(user_entry_buff),
+					      cfg->db == CONFIG_DB_GLOBAL ?
+					      _version_fixed : _version);
+		if (ret != 0) {
+			print(PRINT_ERROR,
+			      "Strange error while generating new user "
+			      "entry line\n");
+			goto cleanup;
+		}
+
+		if (index) {
+			const long offset = ftell(out);
+			if (offset < 0 ||
+			    db_index_builder_add(index, s->username,
+						 strlen(s->username), offset) != 0) {
+				print(PRINT_ERROR, "Unable to record entry offset in index\n");
+				ret = STATE_NOMEM;
+				goto cleanup;
+			}
+		}
+
+		if (fputs(user_entry_buff, out) < 0) {
+			print(PRINT_ERROR, "Error while writing user "
+			      "entry to database\n");
+			ret = STATE_IO_ERROR;
+			goto cleanup;
+		}
+	}
+
+	/* 3) Copy rest of the file */
+	if (in) {
+		if (greater) {
+			const long offset = ftell(out);
+			if (offset < 0 ||
+			    db_index_builder_add(index, next_entry_buff,
+						 strcspn(next_entry_buff, _delim),
+						 offset) != 0) {
+				print(PRINT_ERROR, "Unable to record entry offset in index\n");
+				ret = STATE_NOMEM;
+				goto cleanup;
+			}
+
+			if (fputs(next_entry_buff, out) < 0) {
+				print(PRINT_ERROR, "Error while writing data to file!\n");
+				ret = STATE_IO_ERROR;
+				goto cleanup;
+			}
+		}
+
+		ret = _db_find_user_entry(s->username, in, out, index, NULL,
+					  user_entry_buff, sizeof(user_entry_buff));
+
+		/* Old entry in unsorted database is dropped */
+		if (ret == 0 && greater)
+			ret = _db_find_user_entry(s->username, in, out, index, NULL,
+						  user_entry_buff, sizeof(user_entry_buff));
+		if (ret == 0) {
+			print(PRINT_ERROR, "Duplicate entry for user %s in state file\n", s->username);
+			goto cleanup;
+		}
+
+		if (ret != STATE_NO_USER_ENTRY) {
+			/* Double user entry. */
+			print(PRINT_NOTICE, "Double user entry in state file.\n");
+			ret = STATE_PARSE_ERROR;
+			goto cleanup;
+		}
+	}
+
+	/* 4) Flush, save... then rename in cleanup part.
+	 * Data must reach the disk before rename */
+	ret = fflush(out);
+	ret += _db_file_sync(fileno(out));
+	ret += fclose(out);
+	out = NULL;
+	if (ret != 0) {
+		print_perror(PRINT_ERROR, "Error while flushing/closing state file");
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	ret = 0; /* We are fine! */
+
+cleanup:
+	memset(next_entry_buff, 0, sizeof(next_entry_buff));
+	if (in)
+		fclose(in);
+	if (out) {
+		fflush(out);
+		fclose(out);
+	}
+
+	if (ret == 0) {
+		/* If everything went fine, rename tmp to normal file */
+		if (rename(tmp, db) != 0) {
+			print_perror(PRINT_WARN,
+				     "Unable to rename temporary state "
+				     "file and save state.");
+			ret = STATE_IO_ERROR;
+		} else {
+			if (_db_file_sync_dir(db) != 0) {
+				print_perror(PRINT_WARN,
+					     "Unable to flush directory of %s", db);
+			}
+
+			/* When state updated via PAM (root)
+			 * we must set correct file owner. */
+			if (_db_file_permissions(db, NULL) != 0) {
+				print(PRINT_WARN,
+				      "Unable to set state file permissions. "
+				      "Key might be world-readable!\n");
+			}
+			print(PRINT_NOTICE, "State file written correctly\n");
+
+			/* Index must describe the renamed file; if it can't
+			 * be written the old one is detected as outdated. */
+			if (index)
+				_db_file_store_index(db, index);
+		}
+
+	} else if (unlink(tmp) != 0) {
+		print_perror(PRINT_WARN, "Unable to unlink temporary state file %s",
+			     tmp);
+	}
+
+cleanup_lock:
+	if (ret == 0 && cfg->db == CONFIG_DB_GLOBAL && remove == 0 &&
+	    !position_only) {
+		if (!journaled)
+			ret = _db_file_journal_supersede(s, db);
+		if (ret == 0) {
+			s->db_hash = _db_state_hash(s, 0);
+			s->db_counter_hash = _db_state_hash(s, 1);
+			s->db_counter = s->counter;
+			s->db_key_hash = _db_key_hash(s);
+		}
+	}
+
+	if (leasing) {
+		s->counter = position;
+		if (ret == 0)
+			_db_file_lease_store(s, position);
+	}
+
+	if (structure_locked &&
+	    _db_file_lock_shared(s->lock, _db_file_deadline()) != 0) {
+		print(PRINT_ERROR, "Unable to release database structure lock\n");
+	}
+
+	if (locked && db_file_unlock(s) != 0) {
+		print(PRINT_ERROR, "Error while unlocking state file!\n");
+	}
+
+cleanup_free:
+	db_index_builder_fini(&index_builder);
+	return ret;
+}
+
+/* Lock database at given path exclusively, as a whole. Returns
+ * descriptor of the lock file, -1 on lock error and -2 on lack of
+ * memory. */
+static int _db_file_lock_path(const char *db, const struct stat *st_db)
+{
+	char *lck = _db_sidecar_path(db, ".lck");
+	int lock_fd;
+
+	if (!lck)
+		return -2;
+
+	lock_fd = _db_file_open_lock(lck, st_db->st_uid, st_db->st_gid);
+	if (lock_fd == -1 ||
+	    _db_file_lock_exclusive(lock_fd, _db_file_deadline()) != 0) {
+		print_perror(PRINT_ERROR, "Unable to lock %s", lck);
+		if (lock_fd != -1)
+			close(lock_fd);
+		lock_fd = -1;
+	}
+
+	free(lck);
+	return lock_fd;
+}
+
+int db_file_compact(const char *db)
+{
+	struct stat st_db;
+	int lock_fd;
+	int ret;
+
+	if (stat(db, &st_db) != 0) {
+		print_perror(PRINT_ERROR, "Unable to read database parameters");
+		return errno == ENOENT ? STATE_NON_EXISTENT : STATE_IO_ERROR;
+	}
+
+	lock_fd = _db_file_lock_path(db, &st_db);
+	if (lock_fd < 0)
+		return lock_fd == -1 ? STATE_LOCK_ERROR : STATE_NOMEM;
+
+	ret = _db_file_compact(db);
+	close(lock_fd);
+	return ret;
+}
+
+int db_file_convert(const char *db)
+{
+	char buff[STATE_ENTRY_SIZE];
+	db_index_builder index;
+	FILE *in = NULL, *out = NULL;
+	struct stat st, st_db;
+	char *tmp = NULL;
+	int converted = 0, entries = 0;
+	int ret = STATE_IO_ERROR;
+	int lock_fd;
+
+	db_index_builder_init(&index);
+
+	if (stat(db, &st_db) != 0) {
+		print_perror(PRINT_ERROR, "Unable to read database parameters");
+		return errno == ENOENT ? STATE_NON_EXISTENT : STATE_IO_ERROR;
+	}
+
+	tmp = _db_sidecar_path(db, ".tmp");
+	if (!tmp)
+		return STATE_NOMEM;
+
+	/* Exclude all sessions */
+	lock_fd = _db_file_lock_path(db, &st_db);
+	if (lock_fd < 0) {
+		free(tmp);
+		return lock_fd == -1 ? STATE_LOCK_ERROR : STATE_NOMEM;
+	}
+
+	in = fopen(db, "r");
+	if (!in) {
+		print_perror(PRINT_ERROR, "Unable to open %s for reading", db);
+		ret = errno == ENOENT ? STATE_NON_EXISTENT : STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	if (fstat(fileno(in), &st) != 0) {
+		print_perror(PRINT_ERROR, "Unable to read database parameters");
+		goto cleanup;
+	}
+
+	out = fopen(tmp, "w");
+	if (!out) {
+		print_perror(PRINT_ERROR, "Unable to open %s for writing", tmp);
+		goto cleanup;
+	}
+
+	/* Keep owner and mode of the database */
+	if (fchmod(fileno(out), st.st_mode & 0777) != 0 ||
+	    (geteuid() == 0 && fchown(fileno(out), st.st_uid, st.st_gid) != 0)) {
+		print_perror(PRINT_ERROR, "Unable to set permissions of %s", tmp);
+		goto cleanup;
+	}
+
+	while (fgets(buff, sizeof(buff), in) != NULL) {
+		const size_t length = strlen(buff);
+		char *sep = strchr(buff, _delim[0]);
+		long offset;
+
+		if (buff[length-1] != '\n' || !sep) {
+			print(PRINT_ERROR, "Database entry %d is invalid\n", entries + 1);
+			ret = STATE_PARSE_ERROR;
+			goto cleanup;
+		}
+
+		/* Version 1 entry becomes version 2 by changing the version
+		 * field and appending the padding. */
+		if (sep[1] == '0' + _version && sep[2] == _delim[0] &&
+		    length <= DB_FILE_SEAL_OFFSET) {
+			sep[1] = '0' + _version_fixed;
+			buff[length - 1] = _delim[0];
+			memset(buff + length, ' ', DB_FILE_SLOT_SIZE - 1 - length);
+			buff[DB_FILE_SLOT_SIZE - 1] = '\n';
+			buff[DB_FILE_SLOT_SIZE] = '\0';
+			_db_slot_seal(buff);
+			converted++;
+		} else if (_db_is_fixed_entry(buff, length) &&
+			   !_db_slot_is_sealed(buff) &&
+			   strspn(buff + DB_FILE_SEAL_OFFSET, " ") ==
+			   DB_FILE_SEAL_LENGTH) {
+			/* Version 2 entry written before seals */
+			_db_slot_seal(buff);
+			converted++;
+		} else if (!_db_is_fixed_entry(buff, length) &&
+			   !(sep[1] == '0' + _version && sep[2] == _delim[0])) {
+			print(PRINT_ERROR, "Database entry %d has unknown version\n",
+			      entries + 1);
+			ret = STATE_PARSE_ERROR;
+			goto cleanup;
+		}
+
+		offset = ftell(out);
+		if (offset < 0 ||
+		    db_index_builder_add(&index, buff, sep - buff, offset) != 0) {
+			ret = STATE_NOMEM;
+			goto cleanup;
+		}
+
+		if (fputs(buff, out) < 0) {
+			print_perror(PRINT_ERROR, "Error while writing %s", tmp);
+			goto cleanup;
+		}
+		entries++;
+	}
+
+	if (ferror(in)) {
+		print_perror(PRINT_ERROR, "Error while reading %s", db);
+		goto cleanup;
+	}
+
+	if (fflush(out) != 0 || _db_file_sync(fileno(out)) != 0) {
+		print_perror(PRINT_ERROR, "Error while flushing %s", tmp);
+		goto cleanup;
+	}
+
+	ret = fclose(out);
+	out = NULL;
+	if (ret != 0 || rename(tmp, db) != 0) {
+		print_perror(PRINT_ERROR, "Unable to replace database");
+		unlink(tmp);
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	if (_db_file_sync_dir(db) != 0)
+		print_perror(PRINT_WARN, "Unable to flush directory of %s", db);
+
+	_db_file_store_index(db, &index);
+	print(PRINT_NOTICE, "Converted %d of %d entries to fixed-width records\n",
+	      converted, entries);
+	ret = 0;
+
+cleanup:
+	memset(buff, 0, sizeof(buff));
+	if (out) {
+		fclose(out);
+		unlink(tmp);
+	}
+	if (in)
+		fclose(in);
+	close(lock_fd);
+	free(tmp);
+	db_index_builder_fini(&index);
+	return ret;
+}
+
+/* Stable hash of username selecting its shard. It must never change,
+ * as users would be searched in wrong shards. (FNV-1a) */
+static uint32_t _db_shard_hash(const char *username, size_t length)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= (unsigned char) username[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* Path of file number i of database with given number of shards */
+static int _db_layout_name(const char *db, int shards, int i,
+			   char *path, size_t size)
+{
+	if (shards == 0) {
+		const int ret = snprintf(path, size, "%s", db);
+		return ret < 0 || (size_t) ret >= size;
+	}
+	return db_file_shard_name(db, i, path, size);
+}
+
+/* Path of shard number shard within directory dir */
+static int _db_shard_file(const char *dir, int shard, char *path, size_t size)
+{
+	const int ret = snprintf(path, size, "%s/%02d", dir, shard);
+	return ret < 0 || (size_t) ret >= size;
+}
+
+int db_file_shard_name(const char *db, int shard, char *path, size_t size)
+{
+	char dir[STATE_PATH_SIZE];
+
+	if (_db_sidecar_name(dir, sizeof(dir), db, DB_FILE_SHARD_SUFFIX) != 0)
+		return 1;
+	return _db_shard_file(dir, shard, path, size);
+}
+
+int db_file_shard_path(const char *db, int shards, const char *username,
+		       char *path, size_t size)
+{
+	if (shards == 0)
+		return _db_layout_name(db, 0, 0, path, size);
+
+	return db_file_shard_name(
+		db, _db_shard_hash(username, strlen(username)) % shards,
+		path, size);
+}
+
+/* Remove file of database layout with its index and journal */
+static void _db_layout_remove(const char *path)
+{
+	char sidecar[STATE_PATH_SIZE + 8];
+
+	if (unlink(path) != 0 && errno != ENOENT)
+		print_perror(PRINT_WARN, "Unable to remove %s", path);
+
+	if (_db_sidecar_name(sidecar, sizeof(sidecar), path, DB_INDEX_SUFFIX) == 0)
+		unlink(sidecar);
+	if (_db_sidecar_name(sidecar, sizeof(sidecar), path, DB_JOURNAL_SUFFIX) == 0)
+		unlink(sidecar);
+}
+
+/* Remove directory of shards with all files in it, lock files
+ * included. Missing directory is not an error. */
+static int _db_layout_remove_dir(const char *dir)
+{
+	char path[STATE_PATH_SIZE + 8];
+	struct dirent *de;
+	DIR *d;
+	int ret = 0;
+
+	d = opendir(dir);
+	if (!d) {
+		if (errno == ENOENT)
+			return 0;
+		print_perror(PRINT_WARN, "Unable to read %s", dir);
+		return 1;
+	}
+
+	while ((de = readdir(d)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (snprintf(path, sizeof(path), "%s/%s", dir, de->d_name)
+		    >= (int) sizeof(path) || unlink(path) != 0) {
+			print_perror(PRINT_WARN, "Unable to remove %s", path);
+			ret = 1;
+		}
+	}
+	closedir(d);
+
+	if (rmdir(dir) != 0) {
+		print_perror(PRINT_WARN, "Unable to remove %s", dir);
+		ret = 1;
+	}
+	return ret;
+}
+
+#if DEBUG
+/* Testcases make resharding fail before writing this shard */
+int db_file_reshard_fail = -1;
+#endif
 
-	/* Did we lock the file? */
-	int locked = 0;
+/* Write entries of one shard (all of them if shards is 0) into a new
+ * file at path with owner and mode of st, along with its index */
+static int _db_file_write_shard(const char *path, int shards, int shard,
+				const db_map_entry *entries, size_t count,
+				const struct stat *st)
+{
+	char tmp[STATE_PATH_SIZE + 8];
+	db_index_builder index;
+	FILE *out = NULL;
+	size_t i, written = 0;
+	long offset;
+	int ret = STATE_IO_ERROR;
 
-	cfg_t *cfg = cfg_get();
+	db_index_builder_init(&index);
 
-	char user_entry_buff[STATE_ENTRY_SIZE];
+	if (_db_sidecar_name(tmp, sizeof(tmp), path, ".tmp") != 0)
+		goto cleanup;
 
-	/* Files: database, lock and temporary */
-	char *db = NULL, *lck = NULL, *tmp = NULL;
-	uid_t user_uid;
-	gid_t user_gid;
-	ret = _db_path(s->username, &db, &lck, &tmp, &user_uid, &user_gid, NULL);
-	if (ret != 0) {
-		return ret;
+	out = fopen(tmp, "w");
+	if (!out) {
+		print_perror(PRINT_ERROR, "Unable to open %s for writing", tmp);
+		goto cleanup;
 	}
 
-	if (s->lock <= 0) {
-		print(PRINT_NOTICE,
-		      "State file not locked while writing to it. Locking for write.\n");
-		ret = db_file_lock(s);
-		if (ret != 0) {
-			print(PRINT_ERROR, "Unable to lock file for writing!\n");
-			goto cleanup_free;
-		}
-		locked = 1;
+	if (fchmod(fileno(out), st->st_mode & 0777) != 0 ||
+	    (geteuid() == 0 &&
+	     fchown(fileno(out), st->st_uid, st->st_gid) != 0)) {
+		print_perror(PRINT_ERROR, "Unable to set permissions of %s", tmp);
+		goto cleanup;
 	}
 
-	if (cfg->db == CONFIG_DB_USER && remove) {
-		ret = unlink(db);
-		if (ret != 0) {
-			ret = STATE_IO_ERROR;
-			print_perror(PRINT_ERROR,
-				     "Unable to unlink state file\n");
-		} else {
-			ret = 0;
+	/* Entries are sorted, so each shard is sorted too */
+	for (i = 0; i < count; i++) {
+		const db_map_entry *e = &entries[i];
+		if (shards > 0 &&
+		    _db_shard_hash(e->data, e->name_length) % shards != (uint32_t) shard)
+			continue;
+
+		offset = ftell(out);
+		if (offset < 0 ||
+		    db_index_builder_add(&index, e->data, e->name_length, offset) != 0) {
+			ret = STATE_NOMEM;
+			goto cleanup;
 		}
-		goto cleanup_lock;
-	}
-
-	in = fopen(db, "r");
-	if (!in) {
-		/* User=db and file doesn't exist - ok. */
-
-		/* Probably doesn't exists, if not... */
-		if (errno != ENOENT) {
-			/* FIXME: better rewrite to use stat */
-			print_perror(PRINT_ERROR,
-				     "Unable to open %s for reading", db);
 
-			ret = STATE_IO_ERROR;
+		if (fwrite(e->data, 1, e->length, out) != e->length) {
+			print_perror(PRINT_ERROR, "Error while writing %s", tmp);
 			goto cleanup;
 		}
+		written++;
 	}
 
-	out = fopen(tmp, "w");
-	if (!out) {
-		print_perror(PRINT_ERROR,
-			     "Unable to open %s for writing",
-			     tmp);
+	if (fflush(out) != 0 || _db_file_sync(fileno(out)) != 0) {
+		print_perror(PRINT_ERROR, "Error while flushing %s", tmp);
+		goto cleanup;
+	}
 
+	ret = fclose(out);
+	out = NULL;
+	if (ret != 0 || rename(tmp, path) != 0) {
+		print_perror(PRINT_ERROR, "Unable to replace %s", path);
+		unlink(tmp);
 		ret = STATE_IO_ERROR;
 		goto cleanup;
-
 	}
 
-	/* Temporary file opened.
-	 * it's owner/group should match owner of original file
-	 * or if this one doesn't exist - the user we are working with.
-	 */
-	if (geteuid() == 0) {
-		struct stat st;
+	_db_file_store_index(path, &index);
+	print(PRINT_NOTICE, "Wrote %u entries into %s\n",
+	      (unsigned int) written, path);
+	ret = 0;
 
-		ret = stat(db, &st);
-		if (ret != 0) {
-			/* That's fine only for DB_USER */
-			if (cfg->db != CONFIG_DB_USER) {
-				print_perror(PRINT_ERROR, "Unable to read state file parameters and DB!=USER:");
-				ret = STATE_IO_ERROR;
-				goto cleanup;
+cleanup:
+	if (out) {
+		fclose(out);
+		unlink(tmp);
+	}
+	db_index_builder_fini(&index);
+	return ret;
+}
+
+int db_file_reshard(const char *db, int from, int to)
+{
+	const int sources = from > 0 ? from : 1;
+	char path[STATE_PATH_SIZE];
+	char dir[STATE_PATH_SIZE], dir_new[STATE_PATH_SIZE], dir_old[STATE_PATH_SIZE];
+	int lock_fd[CONFIG_MAX_SHARDS];
+	db_map map[CONFIG_MAX_SHARDS];
+	db_map_entry *entries = NULL;
+	size_t count = 0, collected = 0;
+	struct stat st, st_db;
+	int locked = 0, mapped = 0, created = 0, moved = 0;
+	int ret = STATE_IO_ERROR;
+	int i, fd;
+
+	assert(from >= 0 && from <= CONFIG_MAX_SHARDS);
+	assert(to >= 0 && to <= CONFIG_MAX_SHARDS);
+
+	/* Set from the first file of the old layout */
+	memset(&st_db, 0, sizeof(st_db));
+
+	if (_db_sidecar_name(dir, sizeof(dir), db, DB_FILE_SHARD_SUFFIX) != 0 ||
+	    _db_sidecar_name(dir_new, sizeof(dir_new), dir, ".new") != 0 ||
+	    _db_sidecar_name(dir_old, sizeof(dir_old), dir, ".old") != 0)
+		return STATE_IO_ERROR;
+
+	/* Interrupted resharding might have left the old directory of
+	 * shards moved aside (bring it back, nothing used the new one)
+	 * or an incomplete new one */
+	if (access(dir_old, F_OK) == 0) {
+		if (access(dir, F_OK) != 0 && errno == ENOENT) {
+			print(PRINT_WARN, "Restoring %s left by interrupted "
+			      "resharding\n", dir);
+			if (rename(dir_old, dir) != 0) {
+				print_perror(PRINT_ERROR, "Unable to restore %s", dir);
+				return STATE_IO_ERROR;
 			}
-			st.st_uid = user_uid;
-			st.st_gid = user_gid;
+		} else if (_db_layout_remove_dir(dir_old) != 0) {
+			return STATE_IO_ERROR;
 		}
+	}
+	if (_db_layout_remove_dir(dir_new) != 0)
+		return STATE_IO_ERROR;
 
+	/* Exclude all sessions using the current layout
+	 * and fold journals into the files */
+	for (i = 0; i < sources; i++) {
+		if (_db_layout_name(db, from, i, path, sizeof(path)) != 0)
+			goto cleanup;
 
-		if (chown(tmp, st.st_uid, st.st_gid) != 0) {
-			print_perror(PRINT_ERROR, "Unable to ensure owner/group of temporary file\n");
-			ret = STATE_IO_ERROR;
+		if (stat(path, &st) != 0) {
+			print_perror(PRINT_ERROR, "Unable to read parameters of %s", path);
+			ret = errno == ENOENT ? STATE_NON_EXISTENT : STATE_IO_ERROR;
+			goto cleanup;
+		}
+
+		/* New files inherit owner and mode of the first one */
+		if (i == 0)
+			st_db = st;
+
+		lock_fd[i] = _db_file_lock_path(path, &st);
+		if (lock_fd[i] < 0) {
+			ret = lock_fd[i] == -1 ? STATE_LOCK_ERROR : STATE_NOMEM;
 			goto cleanup;
 		}
+		locked++;
+
+		ret = _db_file_compact(path);
+		if (ret != 0)
+			goto cleanup;
 	}
 
+	/* Gather entries of all files */
+	for (i = 0; i < sources; i++) {
+		ret = STATE_IO_ERROR;
+		if (_db_layout_name(db, from, i, path, sizeof(path)) != 0)
+			goto cleanup;
 
-	if (in) {
-		/* 1) Copy entries before our username */
-		ret = _db_find_user_entry(s->username, in, out,	user_entry_buff, sizeof(user_entry_buff));
-		if (ret != STATE_NO_USER_ENTRY && ret != 0) {
-			/* Error happened. */
+		fd = open(path, O_RDONLY);
+		if (fd == -1) {
+			print_perror(PRINT_ERROR, "Unable to open %s for reading", path);
 			goto cleanup;
 		}
+		ret = _db_map_open(fd, &map[i]);
+		close(fd);
+		if (ret != 0)
+			goto cleanup;
+		mapped++;
+		count += _db_map_count(&map[i]);
 	}
 
-	/* 2) Generate our new entry and store it into file */
-	if (remove == 0) {
-		ret = _db_generate_user_entry(s, user_entry_buff,
-					      sizeof(user_entry_buff));
-		if (ret != 0) {
-			print(PRINT_ERROR,
-			      "Strange error while generating new user "
-			      "entry line\n");
+	ret = STATE_NOMEM;
+	entries = malloc((count + 1) * sizeof(*entries));
+	if (!entries)
+		goto cleanup;
+
+	for (i = 0; i < sources; i++) {
+		ret = _db_map_collect(&map[i], entries + collected);
+		if (ret != 0)
+			goto cleanup;
+		collected += _db_map_count(&map[i]);
+	}
+
+	ret = _db_map_sort(entries, count);
+	if (ret != 0)
+		goto cleanup;
+
+	if (to == 0) {
+		/* Single file replaces the database by a rename */
+		ret = _db_file_write_shard(db, 0, 0, entries, count, &st_db);
+		if (ret != 0)
+			goto cleanup;
+	} else {
+		/* Shards are written into a new directory, protected as
+		 * the database, which replaces the old one only when all
+		 * of them are written. Until then the old layout is
+		 * left intact. */
+		ret = STATE_IO_ERROR;
+		if (mkdir(dir_new, S_IRWXU) != 0) {
+			print_perror(PRINT_ERROR, "Unable to create %s", dir_new);
+			goto cleanup;
+		}
+		created = 1;
+		if (geteuid() == 0 && chown(dir_new, st_db.st_uid, st_db.st_gid) != 0) {
+			print_perror(PRINT_ERROR, "Unable to set owner of %s", dir_new);
 			goto cleanup;
 		}
 
-		if (fputs(user_entry_buff, out) < 0) {
-			print(PRINT_ERROR, "Error while writing user "
-			      "entry to database\n");
+		for (i = 0; i < to; i++) {
 			ret = STATE_IO_ERROR;
+			if (_db_shard_file(dir_new, i, path, sizeof(path)) != 0)
+				goto cleanup;
+#if DEBUG
+			if (i == db_file_reshard_fail) {
+				print(PRINT_ERROR, "Failure injected before %s\n", path);
+				goto cleanup;
+			}
+#endif
+			ret = _db_file_write_shard(path, to, i, entries, count, &st_db);
+			if (ret != 0)
+				goto cleanup;
+		}
+
+		ret = STATE_IO_ERROR;
+		if (_db_file_sync_dir(path) != 0) {
+			print_perror(PRINT_ERROR, "Unable to flush %s", dir_new);
 			goto cleanup;
 		}
-	}
 
-	/* 3) Copy rest of the file */
-	if (in) {
-		ret = _db_find_user_entry(s->username, in, out,	user_entry_buff, sizeof(user_entry_buff));
-		if (ret == 0) {
-			print(PRINT_ERROR, "Duplicate entry for user %s in state file\n", s->username);
+		/* Directory can't be replaced by a rename; the old one
+		 * is moved aside first. Crash in between is undone by
+		 * the next resharding. */
+		if (rename(dir, dir_old) == 0) {
+			moved = 1;
+		} else if (errno != ENOENT) {
+			print_perror(PRINT_ERROR, "Unable to move %s aside", dir);
 			goto cleanup;
 		}
 
-		if (ret != STATE_NO_USER_ENTRY) {
-			/* Double user entry. */
-			print(PRINT_NOTICE, "Double user entry in state file.\n");
-			ret = STATE_PARSE_ERROR;
+		if (rename(dir_new, dir) != 0) {
+			print_perror(PRINT_ERROR, "Unable to replace %s", dir);
+			if (moved && rename(dir_old, dir) != 0)
+				print_perror(PRINT_ERROR, "Unable to restore %s", dir);
 			goto cleanup;
 		}
+		created = 0;
 	}
 
-	/* 4) Flush, save... then rename in cleanup part */
-	ret = fflush(out);
-	ret += fclose(out);
-	out = NULL;
-	if (ret != 0) {
-		print_perror(PRINT_ERROR, "Error while flushing/closing state file");
-		ret = STATE_IO_ERROR;
-		goto cleanup;
-	}
+	if (_db_file_sync_dir(db) != 0)
+		print_perror(PRINT_WARN, "Unable to flush directory of %s", db);
 
-	ret = 0; /* We are fine! */
+	/* New layout is in place. Files of the old one are removed;
+	 * sessions still using them find no database and fail, rather
+	 * than use a stale copy of state. */
+	if (from == 0 && to > 0)
+		_db_layout_remove(db);
+	else if (from > 0 && to == 0)
+		_db_layout_remove_dir(dir);
+	if (moved)
+		_db_layout_remove_dir(dir_old);
+
+	print(PRINT_NOTICE, "Distributed %u entries into %d files\n",
+	      (unsigned int) count, to > 0 ? to : 1);
+	ret = 0;
 
 cleanup:
-	if (in)
-		fclose(in);
-	if (out) {
-		fflush(out);
-		fclose(out);
+	if (created)
+		_db_layout_remove_dir(dir_new);
+	free(entries);
+	for (i = 0; i < mapped; i++)
+		_db_map_close(&map[i]);
+	for (i = 0; i < locked; i++)
+		close(lock_fd[i]);
+	return ret;
+}
+
+int db_file_entry_decode(state *s, char *entry, size_t length, char *username)
+{
+	const char *sep;
+	int ret;
+
+	if (db_record_is_binary(entry, length)) {
+		ret = db_record_decode(s, (const unsigned char *) entry, length,
+				       username);
+		return ret != 0 ? ret : _db_check_state(s, "State entry");
 	}
 
-	sync(); /* Flush to disk required before rename */
-	if (ret == 0) {
-		/* If everything went fine, rename tmp to normal file */
-		if (rename(tmp, db) != 0) {
-			print_perror(PRINT_WARN,
-				     "Unable to rename temporary state "
-				     "file and save state.");
-			ret = STATE_IO_ERROR;
-		} else {
-			/* When state updated via PAM (root)
-			 * we must set correct file owner. */
-			if (_db_file_permissions(db, NULL) != 0) {
-				print(PRINT_WARN,
-				      "Unable to set state file permissions. "
-				      "Key might be world-readable!\n");
-			}
-			print(PRINT_NOTICE, "State file written correctly\n");
+	/* Single text entry */
+	sep = memchr(entry, _delim[0], length);
+	if (!sep || length == 0 || length >= STATE_ENTRY_SIZE ||
+	    memchr(entry, '\n', length) != entry + length - 1) {
+		print(PRINT_ERROR, "State entry is invalid\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (username) {
+		if (sep - entry >= DB_RECORD_USER_SIZE) {
+			print(PRINT_ERROR, "Username of state entry is too long\n");
+			return STATE_PARSE_ERROR;
 		}
+		memcpy(username, entry, sep - entry);
+		username[sep - entry] = '\0';
+	} else if (_db_entry_cmp(entry, length, s->username) != 0) {
+		print(PRINT_ERROR, "State entry belongs to other user\n");
+		return STATE_PARSE_ERROR;
+	}
 
-	} else if (unlink(tmp) != 0) {
-		print_perror(PRINT_WARN, "Unable to unlink temporary state file %s",
-			     tmp);
+	return _db_parse_state(s, entry, length, "State entry");
+}
+
+int db_file_entry_encode(const state *s, char *buffer, size_t size, int binary)
+{
+	if (binary) {
+		if (size < DB_RECORD_SIZE ||
+		    db_record_encode(s, (unsigned char *) buffer) != 0)
+			return -1;
+		return DB_RECORD_SIZE;
 	}
 
-cleanup_lock:
-	if (locked && db_file_unlock(s) != 0) {
-		print(PRINT_ERROR, "Error while unlocking state file!\n");
+	if (_db_generate_user_entry(s, buffer, size, _version) != 0)
+		return -1;
+	return strlen(buffer);
+}
+
+int db_file_convert_state(const char *path, int binary)
+{
+	char entry[STATE_ENTRY_SIZE];
+	char username[DB_RECORD_USER_SIZE];
+	struct stat st;
+	size_t length;
+	char *tmp = NULL;
+	int lock_fd = -1, fd = -1;
+	int ret;
+	state s;
+	FILE *f;
+
+	memset(&s, 0, sizeof(s));
+	s.username = username;
+
+	if (stat(path, &st) != 0) {
+		print_perror(PRINT_ERROR, "Unable to read state file parameters");
+		return errno == ENOENT ? STATE_NON_EXISTENT : STATE_IO_ERROR;
 	}
 
-cleanup_free:
-	free(db);
-	free(lck);
+	tmp = _db_sidecar_path(path, ".tmp");
+	if (!tmp)
+		return STATE_NOMEM;
+
+	/* Sessions lock the whole lock file */
+	lock_fd = _db_file_lock_path(path, &st);
+	if (lock_fd < 0) {
+		free(tmp);
+		return lock_fd == -1 ? STATE_LOCK_ERROR : STATE_NOMEM;
+	}
+
+	ret = STATE_IO_ERROR;
+	f = fopen(path, "r");
+	if (!f) {
+		print_perror(PRINT_ERROR, "Unable to open %s for reading", path);
+		goto cleanup;
+	}
+	length = fread(entry, 1, sizeof(entry), f);
+	fclose(f);
+
+	if (length == sizeof(entry)) {
+		print(PRINT_ERROR, "State file %s holds more than one entry\n", path);
+		ret = STATE_PARSE_ERROR;
+		goto cleanup;
+	}
+
+	ret = db_file_entry_decode(&s, entry, length, username);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = db_file_entry_encode(&s, entry, sizeof(entry), binary);
+	if (ret < 0) {
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+	length = ret;
+
+	ret = STATE_IO_ERROR;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+	if (fd == -1) {
+		print_perror(PRINT_ERROR, "Unable to open %s for writing", tmp);
+		goto cleanup;
+	}
+
+	/* Keep owner and mode of the state file */
+	if (fchmod(fd, st.st_mode & 0777) != 0 ||
+	    (geteuid() == 0 && fchown(fd, st.st_uid, st.st_gid) != 0)) {
+		print_perror(PRINT_ERROR, "Unable to set permissions of %s", tmp);
+		goto cleanup;
+	}
+
+	if (write(fd, entry, length) != (ssize_t) length ||
+	    _db_file_sync(fd) != 0) {
+		print_perror(PRINT_ERROR, "Error while writing %s", tmp);
+		goto cleanup;
+	}
+
+	ret = close(fd);
+	fd = -1;
+	if (ret != 0 || rename(tmp, path) != 0) {
+		print_perror(PRINT_ERROR, "Unable to replace state file");
+		ret = STATE_IO_ERROR;
+		goto cleanup;
+	}
+
+	if (_db_file_sync_dir(path) != 0)
+		print_perror(PRINT_WARN, "Unable to flush directory of %s", path);
+
+	print(PRINT_NOTICE, "State file of %s converted to %s format\n",
+	      username, binary ? "binary" : "text");
+	ret = 0;
+
+cleanup:
+	if (fd != -1)
+		close(fd);
+	if (ret != 0)
+		unlink(tmp);
+	memset(entry, 0, sizeof(entry));
+	memset(&s, 0, sizeof(s));
+	close(lock_fd);
 	free(tmp);
 	return ret;
 }
 
 int db_file_lock(state *s)
 {
-	struct flock fl;
+	cfg_t *cfg = cfg_get();
+	uid_t uid;
+	gid_t gid;
 	int ret;
-	int cnt;
 	int fd;
 
-	/* Files: database, lock and temporary */
-	char *db = NULL, *lck = NULL, *tmp = NULL, *home=NULL;
+	/* Lock file */
+	const char *const lck = s->location.lck;
 
 	/* Check that the lock already is not set */
 	assert(s->lock == -1);
 
-	ret = _db_path(s->username, &db, &lck, &tmp, NULL, NULL, &home);
-	if (ret != 0) {
-		return ret;
+	if (s->location.status != 0) {
+		return s->location.status;
+	}
+	uid = s->location.uid;
+	gid = s->location.gid;
+
+	/* Lock file of the global database belongs to USER from config */
+	if (cfg->db == CONFIG_DB_GLOBAL) {
+		uid = cfg->user_uid;
+		gid = cfg->user_gid;
 	}
 
 	/*
@@ -1010,7 +3303,7 @@ int db_file_lock(state *s)
 	 *
 	 * Will also fail if the user doesn't have a home directory.
 	 */
-	ret = _db_file_permissions(db, home);
+	ret = _db_file_check(s);
 	switch (ret) {
 	case STATE_IO_ERROR:
 		print(PRINT_NOTICE, "File permission check failed\n");
@@ -1026,12 +3319,8 @@ int db_file_lock(state *s)
 		break;
 	}
 
-	fl.l_type = F_WRLCK;
-	fl.l_whence = SEEK_SET;
-	fl.l_start = fl.l_len = 0;
-
 	/* Open/create lock file */
-	fd = open(lck, O_WRONLY|O_CREAT, S_IWUSR|S_IRUSR);
+	fd = _db_file_open_lock(lck, uid, gid);
 
 	if (fd == -1) {
 		/* Unable to create file, therefore unable to obtain lock */
@@ -1040,20 +3329,14 @@ int db_file_lock(state *s)
 		goto cleanup;
 	}
 
-	/*
-	 * Trying to lock the file 20 times.
-	 * Any working otpasswd session shouldn't lock it for so long.
-	 * If it does - system has some problem.
-	 */
-	for (cnt = 0; cnt < 20; cnt++) {
-		ret = fcntl(fd, F_SETLK, &fl);
-		if (ret == 0)
-			break;
-		usleep(700);
+	if (cfg->db == CONFIG_DB_GLOBAL) {
+		ret = _db_file_lock_global(fd, s->username);
+	} else {
+		/* Whole file */
+		ret = _db_file_setlk(fd, F_WRLCK, 0, 0, _db_file_deadline());
 	}
 
 	if (ret != 0) {
-		/* Unable to lock for 10 times */
 		close(fd);
 		print(PRINT_NOTICE, "Unable to lock opened state file\n");
 		ret = STATE_LOCK_ERROR;
@@ -1066,11 +3349,8 @@ int db_file_lock(state *s)
 	ret = 0; /* Got lock  */
 
 cleanup:
-	free(db);
-	free(lck);
-	free(tmp);
-	free(home);
-
+	if (ret != 0)
+		s->db_permissions = -1;
 	return ret;
 }
 
@@ -1081,27 +3361,24 @@ int db_file_unlock(state *s)
 	struct flock fl;
 	int retval = STATE_LOCK_ERROR;
 
-	/* Files: database, lock and temporary */
-	char *db = NULL, *lck = NULL, *tmp = NULL;
-	retval = _db_path(s->username, &db, &lck, &tmp, NULL, NULL, NULL);
-	if (retval != 0) {
-		return retval;
-	}
-
+	/* Operation ends; check permissions again during the next one */
+	s->db_permissions = -1;
 
 	if (s->lock < 0) {
+		/* Nothing to do */
 		print(PRINT_NOTICE, "No lock to release!\n");
-		goto error;
+		return 0;
 	}
 
 	fl.l_type = F_UNLCK;
 	fl.l_whence = SEEK_SET;
 	fl.l_start = fl.l_len = 0;
+	fl.l_pid = 0;
 
-	/* First unlink, then unlock to solve race condition */
-	unlink(lck);
-
-	retval = fcntl(s->lock, F_SETLK, &fl);
+	/* Lock file is never removed: locks must always be taken on the
+	 * same inode, and creating it anew on every lock would modify
+	 * the directory (user HOME in DB=user) twice per operation. */
+	retval = fcntl(s->lock, DB_FILE_SETLK, &fl);
 
 	close(s->lock);
 	s->lock = -1;
@@ -1115,8 +3392,5 @@ int db_file_unlock(state *s)
 
 	retval = 0;
 error:
-	free(db);
-	free(lck);
-	free(tmp);
 	return retval;
 }
@@ -0,0 +1,311 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Hash index sidecar of the global database. File layout:
+ *   header followed by a power of two number of slots forming an
+ *   open addressing hash table with linear probing. Slot is a pair
+ *   of hash and offset+1 (0 marks an empty slot). Numbers are kept
+ *   in host byte order; index is local to the machine anyway.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "print.h"
+#include "db_index.h"
+
+#define DB_INDEX_MAGIC "OTPIDX01"
+
+/* Slots read at once while probing */
+#define DB_INDEX_PROBE 8
+
+typedef struct {
+	char magic[8];
+	uint32_t byte_order;	/* 0x01020304 written in host order */
+	uint32_t buckets;	/* Power of two */
+	uint64_t entries;
+	uint64_t db_inode;
+	uint64_t db_size;
+	int64_t db_mtime_sec;
+	int64_t db_mtime_nsec;
+} db_index_header;
+
+typedef struct {
+	uint64_t hash;
+	uint64_t offset;	/* Offset + 1; 0 - empty slot */
+} db_index_slot;
+
+uint64_t db_index_hash(const char *username, size_t length)
+{
+	/* FNV-1a */
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < length; i++) {
+		hash ^= (unsigned char)username[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static void _db_index_header_fill(db_index_header *h, const struct stat *db_st)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, DB_INDEX_MAGIC, sizeof(h->magic));
+	h->byte_order = 0x01020304;
+	h->db_inode = db_st->st_ino;
+	h->db_size = db_st->st_size;
+	h->db_mtime_sec = db_st->st_mtim.tv_sec;
+	h->db_mtime_nsec = db_st->st_mtim.tv_nsec;
+}
+
+/* Check if index describes given database */
+static int _db_index_header_valid(const db_index_header *h, const struct stat *db_st)
+{
+	db_index_header expected;
+	_db_index_header_fill(&expected, db_st);
+
+	if (memcmp(h->magic, expected.magic, sizeof(h->magic)) != 0)
+		return 0;
+	if (h->byte_order != expected.byte_order)
+		return 0;
+	if (h->buckets == 0 || (h->buckets & (h->buckets - 1)) != 0)
+		return 0;
+
+	return h->db_inode == expected.db_inode &&
+		h->db_size == expected.db_size &&
+		h->db_mtime_sec == expected.db_mtime_sec &&
+		h->db_mtime_nsec == expected.db_mtime_nsec;
+}
+
+void db_index_builder_init(db_index_builder *b)
+{
+	memset(b, 0, sizeof(*b));
+}
+
+void db_index_builder_fini(db_index_builder *b)
+{
+	free(b->hashes);
+	free(b->offsets);
+	memset(b, 0, sizeof(*b));
+}
+
+int db_index_builder_add(db_index_builder *b, const char *username,
+			 size_t length, uint64_t offset)
+{
+	if (b->count == b->allocated) {
+		const unsigned int allocated = b->allocated ? b->allocated * 2 : 256;
+		uint64_t *hashes, *offsets;
+
+		hashes = realloc(b->hashes, allocated * sizeof(*hashes));
+		if (!hashes)
+			return 1;
+		b->hashes = hashes;
+
+		offsets = realloc(b->offsets, allocated * sizeof(*offsets));
+		if (!offsets)
+			return 1;
+		b->offsets = offsets;
+
+		b->allocated = allocated;
+	}
+
+	b->hashes[b->count] = db_index_hash(username, length);
+	b->offsets[b->count] = offset;
+	b->count++;
+	return 0;
+}
+
+int db_index_write(const db_index_builder *b, const char *idx_path,
+		   const struct stat *db_st, uid_t uid, gid_t gid)
+{
+	db_index_header header;
+	db_index_slot *slots = NULL;
+	char tmp_path[512];
+	unsigned int buckets = 16;
+	unsigned int i;
+	size_t size;
+	int fd = -1;
+	int ret = 1;
+
+	if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", idx_path)
+	    >= (int)sizeof(tmp_path))
+		return 1;
+
+	/* Keep load factor at most 1/2 so probing stays short */
+	while (buckets < 2 * b->count)
+		buckets *= 2;
+
+	slots = calloc(buckets, sizeof(*slots));
+	if (!slots)
+		return 1;
+
+	for (i = 0; i < b->count; i++) {
+		unsigned int pos = b->hashes[i] & (buckets - 1);
+		while (slots[pos].offset != 0)
+			pos = (pos + 1) & (buckets - 1);
+		slots[pos].hash = b->hashes[i];
+		slots[pos].offset = b->offsets[i] + 1;
+	}
+
+	_db_index_header_fill(&header, db_st);
+	header.buckets = buckets;
+	header.entries = b->count;
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		print_perror(PRINT_NOTICE, "Unable to create index %s", tmp_path);
+		goto cleanup;
+	}
+
+	if (uid != (uid_t)-1 && fchown(fd, uid, gid) != 0) {
+		print_perror(PRINT_NOTICE, "Unable to set owner of index");
+		goto cleanup;
+	}
+
+	size = buckets * sizeof(*slots);
+	if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+	    write(fd, slots, size) != (ssize_t)size) {
+		print_perror(PRINT_NOTICE, "Unable to write index");
+		goto cleanup;
+	}
+
+	if (close(fd) != 0) {
+		fd = -1;
+		print_perror(PRINT_NOTICE, "Unable to write index");
+		goto cleanup;
+	}
+	fd = -1;
+
+	if (rename(tmp_path, idx_path) != 0) {
+		print_perror(PRINT_NOTICE, "Unable to rename index");
+		goto cleanup;
+	}
+
+	ret = 0;
+cleanup:
+	if (fd != -1)
+		close(fd);
+	if (ret != 0)
+		unlink(tmp_path);
+	free(slots);
+	return ret;
+}
+
+int db_index_touch(const char *idx_path, const struct stat *db_before,
+		   const struct stat *db_after)
+{
+	db_index_header header;
+	uint32_t buckets;
+	uint64_t entries;
+	int ret = 1;
+	int fd;
+
+	fd = open(idx_path, O_RDWR);
+	if (fd == -1)
+		return 1;
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+		goto cleanup;
+
+	if (!_db_index_header_valid(&header, db_before))
+		goto cleanup;
+
+	buckets = header.buckets;
+	entries = header.entries;
+	_db_index_header_fill(&header, db_after);
+	header.buckets = buckets;
+	header.entries = entries;
+
+	/* Header fits in a single sector, so it's written atomically */
+	if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+		print_perror(PRINT_NOTICE, "Unable to update index");
+		goto cleanup;
+	}
+
+	ret = 0;
+cleanup:
+	close(fd);
+	return ret;
+}
+
+int db_index_find(const char *idx_path, const struct stat *db_st,
+		  const char *username, uint64_t *offset)
+{
+	db_index_header header;
+	db_index_slot slots[DB_INDEX_PROBE];
+	const uint64_t hash = db_index_hash(username, strlen(username));
+	unsigned int pos, probed;
+	int ret = 1;
+	int fd;
+
+	fd = open(idx_path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			print_perror(PRINT_NOTICE, "Unable to open index %s", idx_path);
+		return 1;
+	}
+
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header))
+		goto cleanup;
+
+	if (!_db_index_header_valid(&header, db_st)) {
+		print(PRINT_NOTICE, "Database index is outdated\n");
+		goto cleanup;
+	}
+
+	/* Read a run of slots at once; usually the first one matches */
+	pos = hash & (header.buckets - 1);
+	for (probed = 0; probed < header.buckets; ) {
+		const off_t at = sizeof(header) + (off_t)pos * sizeof(*slots);
+		unsigned int run = header.buckets - pos;
+		unsigned int i;
+		ssize_t got;
+
+		if (run > DB_INDEX_PROBE)
+			run = DB_INDEX_PROBE;
+
+		got = pread(fd, slots, run * sizeof(*slots), at);
+		if (got != (ssize_t)(run * sizeof(*slots)))
+			goto cleanup;
+
+		for (i = 0; i < run; i++) {
+			if (slots[i].offset == 0) {
+				/* Not indexed */
+				goto cleanup;
+			}
+			if (slots[i].hash == hash) {
+				*offset = slots[i].offset - 1;
+				ret = 0;
+				goto cleanup;
+			}
+		}
+
+		probed += run;
+		pos = (pos + run) & (header.buckets - 1);
+	}
+
+cleanup:
+	close(fd);
+	return ret;
+}
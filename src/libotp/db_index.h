@@ -0,0 +1,73 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Index of the global database kept in a sidecar file (<db>.idx).
+ *   Maps hash of a username to byte offset of its entry. Index is
+ *   only a cache: it's valid as long as inode, size and modification
+ *   time of the database match ones recorded in it, and any entry
+ *   found through it must still be verified by the caller.
+ **********************************************************************/
+
+#ifndef _DB_INDEX_H_
+#define _DB_INDEX_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+/** Suffix appended to database path */
+#define DB_INDEX_SUFFIX ".idx"
+
+/** Offsets collected while database is written */
+typedef struct {
+	uint64_t *hashes;
+	uint64_t *offsets;
+	unsigned int count;
+	unsigned int allocated;
+} db_index_builder;
+
+/** Hash of username used as index key */
+extern uint64_t db_index_hash(const char *username, size_t length);
+
+extern void db_index_builder_init(db_index_builder *b);
+extern void db_index_builder_fini(db_index_builder *b);
+
+/** Remember that entry of username starts at offset.
+ * Username doesn't have to be NUL-terminated. */
+extern int db_index_builder_add(db_index_builder *b, const char *username,
+				size_t length, uint64_t offset);
+
+/** Write index for database described by db_st into idx_path.
+ * Index is written into temporary file and renamed, so readers
+ * never see it partially written. If uid is not -1 owner
+ * of the index is changed. Returns 0 on success. */
+extern int db_index_write(const db_index_builder *b, const char *idx_path,
+			  const struct stat *db_st, uid_t uid, gid_t gid);
+
+/** Update index after database was modified in place without moving
+ * any entry. Index is updated only if it matched db_before, so an
+ * outdated index is never made valid. Returns 0 on success. */
+extern int db_index_touch(const char *idx_path, const struct stat *db_before,
+			  const struct stat *db_after);
+
+/** Find offset of username entry. Returns 0 if found, 1 if index is
+ * missing, doesn't match the database or doesn't contain user. */
+extern int db_index_find(const char *idx_path, const struct stat *db_st,
+			 const char *username, uint64_t *offset);
+
+#endif
@@ -0,0 +1,312 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Counter journal of the global database. Records are appended
+ *   with O_APPEND, so concurrent writers never overwrite each other.
+ *   A record torn by a crash is detected by its checksum; readers
+ *   then search byte by byte for the next valid record, so records
+ *   appended after a torn one are still found. Numbers are kept in
+ *   host byte order, as in the index.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "print.h"
+#include "db_journal.h"
+
+#define DB_JOURNAL_MAGIC 0x4a50544fU /* "OTPJ" */
+
+/* FNV-1a over 64 bit words; every record is verified while
+ * loading the state, so it should be cheap */
+static uint32_t _db_journal_checksum(const db_journal_record *r)
+{
+	union {
+		db_journal_record r;
+		uint64_t words[sizeof(db_journal_record) / sizeof(uint64_t)];
+	} tmp;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	unsigned int i;
+
+	tmp.r = *r;
+	tmp.r.checksum = 0;
+	for (i = 0; i < sizeof(tmp.words) / sizeof(*tmp.words); i++) {
+		hash ^= tmp.words[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return (uint32_t) (hash ^ (hash >> 32));
+}
+
+static int _db_journal_valid(const db_journal_record *r)
+{
+	return r->magic == DB_JOURNAL_MAGIC &&
+		r->username[DB_JOURNAL_USER_SIZE - 1] == '\0' &&
+		r->checksum == _db_journal_checksum(r);
+}
+
+/* Read whole journal into memory. Missing journal is empty. */
+static int _db_journal_load(const char *path, char **data, size_t *size)
+{
+	struct stat st;
+	ssize_t got;
+	int fd;
+
+	*data = NULL;
+	*size = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		print_perror(PRINT_ERROR, "Unable to open journal %s", path);
+		return 1;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		print_perror(PRINT_ERROR, "Unable to read journal parameters");
+		close(fd);
+		return 1;
+	}
+
+	if (st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	*data = malloc(st.st_size);
+	if (!*data) {
+		close(fd);
+		return 1;
+	}
+
+	/* Records appended meanwhile are of other users; ignore them */
+	got = pread(fd, *data, st.st_size, 0);
+	close(fd);
+	if (got < 0) {
+		print_perror(PRINT_ERROR, "Unable to read journal %s", path);
+		free(*data);
+		*data = NULL;
+		return 1;
+	}
+
+	*size = got;
+	return 0;
+}
+
+/* Get next valid record starting at *pos. Returns 0 if found. */
+static int _db_journal_next(const char *data, size_t size, size_t *pos,
+			    db_journal_record *r)
+{
+	while (*pos + sizeof(*r) <= size) {
+		memcpy(r, data + *pos, sizeof(*r));
+		if (_db_journal_valid(r)) {
+			*pos += sizeof(*r);
+			return 0;
+		}
+
+		/* Torn record; resynchronize */
+		(*pos)++;
+	}
+	return 1;
+}
+
+int db_journal_record_init(db_journal_record *r, const char *username)
+{
+	const size_t length = strlen(username);
+
+	memset(r, 0, sizeof(*r));
+	if (length >= DB_JOURNAL_USER_SIZE)
+		return 1;
+
+	memcpy(r->username, username, length);
+	return 0;
+}
+
+int db_journal_append(const char *path, db_journal_record *r,
+		      int sync, uid_t uid, gid_t gid, size_t *records)
+{
+	struct stat st;
+	int ret = 1;
+	int fd;
+
+	r->magic = DB_JOURNAL_MAGIC;
+	r->checksum = _db_journal_checksum(r);
+
+	fd = open(path, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd == -1) {
+		print_perror(PRINT_ERROR, "Unable to open journal %s", path);
+		return 1;
+	}
+
+	if (fstat(fd, &st) != 0) {
+		print_perror(PRINT_ERROR, "Unable to read journal parameters");
+		goto cleanup;
+	}
+
+	/* Journal created by root belongs to the database owner */
+	if (uid != (uid_t)-1 && st.st_uid != uid &&
+	    fchown(fd, uid, gid) != 0) {
+		print_perror(PRINT_ERROR, "Unable to set owner of journal");
+		goto cleanup;
+	}
+
+	if (write(fd, r, sizeof(*r)) != sizeof(*r)) {
+		print_perror(PRINT_ERROR, "Unable to append to journal %s", path);
+		goto cleanup;
+	}
+
+	if (sync && fdatasync(fd) != 0) {
+		print_perror(PRINT_ERROR, "Unable to flush journal %s", path);
+		goto cleanup;
+	}
+
+	if (records) {
+		if (fstat(fd, &st) != 0)
+			goto cleanup;
+		*records = st.st_size / sizeof(*r);
+	}
+
+	ret = 0;
+cleanup:
+	close(fd);
+	return ret;
+}
+
+int db_journal_find(const char *path, const char *username,
+		    db_journal_record *r)
+{
+	/* Journal is read in chunks, so nothing is allocated
+	 * while loading the state */
+	char data[64 * sizeof(db_journal_record)];
+	db_journal_record tmp;
+	struct stat st;
+	size_t size = 0, pos;
+	off_t offset = 0;
+	ssize_t got;
+	int ret = 1;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 1;
+		print_perror(PRINT_ERROR, "Unable to open journal %s", path);
+		return -1;
+	}
+
+	/* Records appended meanwhile are of other users; ignore them */
+	if (fstat(fd, &st) != 0) {
+		print_perror(PRINT_ERROR, "Unable to read journal parameters");
+		close(fd);
+		return -1;
+	}
+
+	while (offset < st.st_size) {
+		got = st.st_size - offset;
+		if ((size_t) got > sizeof(data) - size)
+			got = sizeof(data) - size;
+
+		got = pread(fd, data + size, got, offset);
+		if (got <= 0) {
+			print_perror(PRINT_ERROR, "Unable to read journal %s", path);
+			ret = -1;
+			break;
+		}
+		offset += got;
+		size += got;
+
+		pos = 0;
+		while (_db_journal_next(data, size, &pos, &tmp) == 0) {
+			if (strcmp(tmp.username, username) == 0) {
+				*r = tmp;
+				ret = 0;
+			}
+		}
+
+		/* Keep the tail, shorter than a record; it might
+		 * start one continued in the next chunk */
+		memmove(data, data + pos, size - pos);
+		size -= pos;
+	}
+
+	close(fd);
+	return ret;
+}
+
+int db_journal_read(const char *path, db_journal_record **records,
+		    size_t *count)
+{
+	size_t size, pos = 0;
+	char *data;
+
+	*records = NULL;
+	*count = 0;
+
+	if (_db_journal_load(path, &data, &size) != 0)
+		return 1;
+
+	if (size == 0)
+		return 0;
+
+	/* At most that many records fit */
+	*records = malloc((size / sizeof(**records) + 1) * sizeof(**records));
+	if (!*records) {
+		free(data);
+		return 1;
+	}
+
+	while (_db_journal_next(data, size, &pos, &(*records)[*count]) == 0)
+		(*count)++;
+
+	free(data);
+	return 0;
+}
+
+size_t db_journal_records(const char *path)
+{
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return 0;
+	/* Torn tail counts as a record; journal isn't empty */
+	return (st.st_size + sizeof(db_journal_record) - 1) /
+		sizeof(db_journal_record);
+}
+
+int db_journal_truncate(const char *path, int sync)
+{
+	int ret = 0;
+	int fd;
+
+	fd = open(path, O_WRONLY);
+	if (fd == -1)
+		return errno == ENOENT ? 0 : 1;
+
+	if (ftruncate(fd, 0) != 0 || (sync && fdatasync(fd) != 0)) {
+		print_perror(PRINT_ERROR, "Unable to truncate journal %s", path);
+		ret = 1;
+	}
+
+	close(fd);
+	return ret;
+}
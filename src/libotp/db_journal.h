@@ -0,0 +1,80 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Journal of counter updates of the global database kept in a
+ *   sidecar file (<db>.jnl). Each update is a single fixed-size
+ *   record appended to the file; the latest record of a user
+ *   overrides counter and failure data of the database entry until
+ *   the journal is compacted into the database.
+ **********************************************************************/
+
+#ifndef _DB_JOURNAL_H_
+#define _DB_JOURNAL_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Suffix appended to database path */
+#define DB_JOURNAL_SUFFIX ".jnl"
+
+/** Space for username with terminating \0 */
+#define DB_JOURNAL_USER_SIZE 80
+
+/** Journal record. Holds absolute values, so replaying
+ * a record more than once is harmless. */
+typedef struct {
+	uint32_t magic;
+	uint32_t checksum;
+	uint64_t counter_hi;
+	uint64_t counter_lo;
+	uint32_t failures;
+	uint32_t recent_failures;
+	int64_t channel_time;
+	int64_t timestamp;	/**< Time of the update */
+	char username[DB_JOURNAL_USER_SIZE];
+} db_journal_record;
+
+/** Clear record and set its username. Returns 1 if
+ * username is too long to be journaled. */
+extern int db_journal_record_init(db_journal_record *r, const char *username);
+
+/** Append record to journal, creating it if required. If uid is not
+ * -1 owner of a created journal is changed. If sync is set the data
+ * is flushed to disk before returning. Number of records in journal
+ * after the append is stored in records. Returns 0 on success. */
+extern int db_journal_append(const char *path, db_journal_record *r,
+			     int sync, uid_t uid, gid_t gid, size_t *records);
+
+/** Find the latest record of username. Returns 0 if found,
+ * 1 if there's none and -1 if journal couldn't be read. */
+extern int db_journal_find(const char *path, const char *username,
+			   db_journal_record *r);
+
+/** Read all valid records in order of appending. Records must be
+ * freed by the caller. Missing journal has no records.
+ * Returns 0 on success. */
+extern int db_journal_read(const char *path, db_journal_record **records,
+			   size_t *count);
+
+/** Number of records in journal; 0 if it's empty or doesn't exist */
+extern size_t db_journal_records(const char *path);
+
+/** Remove all records. Returns 0 on success. */
+extern int db_journal_truncate(const char *path, int sync);
+
+#endif
@@ -0,0 +1,171 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Lease position files. Each user has a file named after him in
+ *   the lease directory, holding a checksummed db_lease in host
+ *   byte order. Files are overwritten in place under the database
+ *   lock of the user; unlocked readers which see a partially
+ *   written file treat it as missing.
+ **********************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "print.h"
+#include "db_index.h"
+#include "db_lease.h"
+
+#define DB_LEASE_MAGIC 0x4c50544fU /* "OTPL" */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t checksum;
+	db_lease lease;
+} db_lease_file;
+
+static uint32_t _db_lease_checksum(const db_lease *l)
+{
+	return (uint32_t) db_index_hash((const char *)l, sizeof(*l));
+}
+
+/* Username becomes a file name; refuse ones which
+ * could point outside the lease directory */
+static int _db_lease_path(const char *dir, const char *username,
+			  char *path, size_t size)
+{
+	if (username[0] == '\0' || username[0] == '.' ||
+	    strchr(username, '/') != NULL)
+		return 1;
+
+	return snprintf(path, size, "%s/%s", dir, username) >= (int)size;
+}
+
+int db_lease_read(const char *dir, const char *username, db_lease *l,
+		  uid_t owner)
+{
+	char path[512];
+	db_lease_file file;
+	struct stat st;
+	ssize_t got;
+	int fd;
+
+	if (_db_lease_path(dir, username, path, sizeof(path)) != 0)
+		return 1;
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			print_perror(PRINT_NOTICE, "Unable to open lease %s", path);
+		return 1;
+	}
+
+	/* Anybody able to change the position could reuse passcodes */
+	if (fstat(fd, &st) != 0 || st.st_uid != owner ||
+	    (st.st_mode & (S_IRWXG | S_IRWXO)) != 0 ||
+	    stat(dir, &st) != 0 || st.st_uid != owner ||
+	    (st.st_mode & (S_IWGRP | S_IWOTH)) != 0) {
+		print(PRINT_WARN, "Lease position of %s has unsafe permissions; "
+		      "ignoring it\n", username);
+		close(fd);
+		return 1;
+	}
+
+	got = pread(fd, &file, sizeof(file), 0);
+	close(fd);
+
+	if (got != sizeof(file) || file.magic != DB_LEASE_MAGIC ||
+	    file.checksum != _db_lease_checksum(&file.lease)) {
+		print(PRINT_NOTICE, "Lease position of %s is invalid\n", username);
+		return 1;
+	}
+
+	*l = file.lease;
+	return 0;
+}
+
+int db_lease_write(const char *dir, const char *username,
+		   const db_lease *l, uid_t uid, gid_t gid)
+{
+	char path[512];
+	db_lease_file file;
+	int ret = 1;
+	int fd;
+
+	if (_db_lease_path(dir, username, path, sizeof(path)) != 0)
+		return 1;
+
+	memset(&file, 0, sizeof(file));
+	file.magic = DB_LEASE_MAGIC;
+	file.lease = *l;
+	file.checksum = _db_lease_checksum(&file.lease);
+
+	fd = open(path, O_WRONLY | O_NOFOLLOW);
+	if (fd == -1 && errno == ENOENT) {
+		/* Directory on tmpfs is gone after reboot */
+		if (mkdir(dir, S_IRWXU) == 0) {
+			if (uid != (uid_t)-1 && chown(dir, uid, gid) != 0) {
+				print_perror(PRINT_ERROR,
+					     "Unable to set owner of %s", dir);
+				return 1;
+			}
+		} else if (errno != EEXIST) {
+			print_perror(PRINT_ERROR,
+				     "Unable to create lease directory %s", dir);
+			return 1;
+		}
+
+		fd = open(path, O_WRONLY | O_CREAT | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+		if (fd != -1 && uid != (uid_t)-1 && fchown(fd, uid, gid) != 0) {
+			print_perror(PRINT_ERROR, "Unable to set owner of lease");
+			goto cleanup;
+		}
+	}
+
+	if (fd == -1) {
+		print_perror(PRINT_ERROR, "Unable to open lease %s", path);
+		return 1;
+	}
+
+	/* No fsync: losing the position only skips passcodes */
+	if (pwrite(fd, &file, sizeof(file), 0) != sizeof(file)) {
+		print_perror(PRINT_ERROR, "Unable to write lease %s", path);
+		goto cleanup;
+	}
+
+	ret = 0;
+cleanup:
+	close(fd);
+	return ret;
+}
+
+void db_lease_remove(const char *dir, const char *username)
+{
+	char path[512];
+
+	if (_db_lease_path(dir, username, path, sizeof(path)) != 0)
+		return;
+
+	if (unlink(path) != 0 && errno != ENOENT)
+		print_perror(PRINT_WARN, "Unable to remove lease %s", path);
+}
@@ -0,0 +1,57 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Counter leases. With leasing the counter stored in the database
+ *   is the end of a block of reserved passcodes, while the position
+ *   within this block is kept in a small per-user file which is
+ *   never flushed to disk. Lease directory is expected to be on
+ *   tmpfs, so after a crash the position is missing and the user
+ *   continues from the end of the lease.
+ **********************************************************************/
+
+#ifndef _DB_LEASE_H_
+#define _DB_LEASE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/** Lease position of a user */
+typedef struct {
+	uint64_t end_hi;	/**< Counter stored in the database */
+	uint64_t end_lo;
+	uint64_t position_hi;	/**< Next passcode to use */
+	uint64_t position_lo;
+} db_lease;
+
+/** Read lease position of username from dir. Position file and dir
+ * must be owned by owner and writable only by him. Returns 0 if
+ * found, 1 if it's missing, invalid or unsafe. */
+extern int db_lease_read(const char *dir, const char *username, db_lease *l,
+			 uid_t owner);
+
+/** Write lease position of username, creating dir if required. If uid
+ * is not -1 owner of created files is changed. Data is not flushed
+ * to disk. Returns 0 on success, 1 on error or if username can't be
+ * used as a file name. */
+extern int db_lease_write(const char *dir, const char *username,
+			  const db_lease *l, uid_t uid, gid_t gid);
+
+/** Forget lease position of username */
+extern void db_lease_remove(const char *dir, const char *username);
+
+#endif
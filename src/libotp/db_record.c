@@ -0,0 +1,242 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Encoding and decoding of binary state records. Integers are
+ *   assembled from bytes, so records are portable between hosts
+ *   of different byte order.
+ **********************************************************************/
+
+#include <string.h>
+#include <assert.h>
+
+#include "print.h"
+#include "db_record.h"
+
+/* "\177OTB" - DEL can't be a part of username */
+static const unsigned char _magic[4] = { 0x7f, 'O', 'T', 'B' };
+
+/* Record layout */
+enum {
+	REC_MAGIC = 0,
+	REC_VERSION = 4,
+	REC_CRC = 8,
+	REC_FLAGS = 12,
+	REC_KEY = 16,
+	REC_COUNTER = 48,		/* lo, hi */
+	REC_LATEST_CARD = 64,		/* lo, hi */
+	REC_FAILURES = 80,
+	REC_RECENT_FAILURES = 84,
+	REC_CHANNEL_TIME = 88,
+	REC_CODE_LENGTH = 96,
+	REC_ALPHABET = 100,
+	REC_SPASS_SET = 104,
+	REC_RESERVED = 108,
+	REC_SPASS_TIME = 112,
+	REC_SPASS = 120,
+	REC_USERNAME = REC_SPASS + STATE_SPASS_SIZE,
+	REC_LABEL = REC_USERNAME + DB_RECORD_USER_SIZE,
+	REC_CONTACT = REC_LABEL + STATE_LABEL_SIZE,
+	REC_END = REC_CONTACT + STATE_CONTACT_SIZE,
+};
+
+static void _put32(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void _put64(unsigned char *p, uint64_t v)
+{
+	_put32(p, (uint32_t) v);
+	_put32(p + 4, (uint32_t) (v >> 32));
+}
+
+static uint32_t _get32(const unsigned char *p)
+{
+	return (uint32_t) p[0] | (uint32_t) p[1] << 8 |
+		(uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t _get64(const unsigned char *p)
+{
+	return (uint64_t) _get32(p) | (uint64_t) _get32(p + 4) << 32;
+}
+
+/* Tables for CRC computed four bytes at a time */
+static uint32_t _crc_table[4][256];
+
+static void _db_record_crc_init(void)
+{
+	unsigned int i, t;
+
+	for (i = 0; i < 256; i++) {
+		uint32_t c = i;
+		int bit;
+		for (bit = 0; bit < 8; bit++)
+			c = (c & 1) ? 0xedb88320U ^ (c >> 1) : c >> 1;
+		_crc_table[0][i] = c;
+	}
+
+	for (i = 0; i < 256; i++) {
+		for (t = 1; t < 4; t++) {
+			const uint32_t c = _crc_table[t - 1][i];
+			_crc_table[t][i] = _crc_table[0][c & 0xff] ^ (c >> 8);
+		}
+	}
+}
+
+/* CRC-32 (IEEE 802.3) of record with CRC field taken as zero */
+static uint32_t _db_record_crc(const unsigned char *record)
+{
+	uint32_t crc = 0xffffffffU;
+	unsigned int i;
+
+	if (_crc_table[0][1] == 0)
+		_db_record_crc_init();
+
+	for (i = 0; i < DB_RECORD_SIZE; i += 4) {
+		crc ^= i == REC_CRC ? 0 : _get32(record + i);
+		crc = _crc_table[3][crc & 0xff] ^
+			_crc_table[2][(crc >> 8) & 0xff] ^
+			_crc_table[1][(crc >> 16) & 0xff] ^
+			_crc_table[0][crc >> 24];
+	}
+	return crc ^ 0xffffffffU;
+}
+
+/* Copy string field; fails if it's not terminated within size */
+static int _get_str(char *dst, const unsigned char *src, size_t size)
+{
+	if (memchr(src, '\0', size) == NULL)
+		return 1;
+	memcpy(dst, src, size);
+	return 0;
+}
+
+/* Copy string into zeroed field; at most size - 1 characters,
+ * so the field stays terminated */
+static void _put_str(unsigned char *dst, const char *src, size_t size)
+{
+	const char *end = memchr(src, '\0', size - 1);
+	memcpy(dst, src, end ? (size_t)(end - src) : size - 1);
+}
+
+int db_record_is_binary(const char *data, size_t size)
+{
+	return size >= sizeof(_magic) && memcmp(data, _magic, sizeof(_magic)) == 0;
+}
+
+int db_record_encode(const state *s, unsigned char *record)
+{
+	const size_t length = strlen(s->username);
+
+	assert(REC_END <= DB_RECORD_SIZE);
+
+	if (length >= DB_RECORD_USER_SIZE) {
+		print(PRINT_ERROR, "Username too long for binary state record\n");
+		return 1;
+	}
+
+	memset(record, 0, DB_RECORD_SIZE);
+	memcpy(record + REC_MAGIC, _magic, sizeof(_magic));
+	_put32(record + REC_VERSION, DB_RECORD_VERSION);
+	_put32(record + REC_FLAGS, s->flags);
+	memcpy(record + REC_KEY, s->sequence_key, sizeof(s->sequence_key));
+	_put64(record + REC_COUNTER, s->counter.lo);
+	_put64(record + REC_COUNTER + 8, s->counter.hi);
+	_put64(record + REC_LATEST_CARD, s->latest_card.lo);
+	_put64(record + REC_LATEST_CARD + 8, s->latest_card.hi);
+	_put32(record + REC_FAILURES, s->failures);
+	_put32(record + REC_RECENT_FAILURES, s->recent_failures);
+	_put64(record + REC_CHANNEL_TIME, (uint64_t) s->channel_time);
+	_put32(record + REC_CODE_LENGTH, s->code_length);
+	_put32(record + REC_ALPHABET, s->alphabet);
+	if (s->spass_set) {
+		_put32(record + REC_SPASS_SET, 1);
+		_put64(record + REC_SPASS_TIME, (uint64_t) s->spass_time);
+		memcpy(record + REC_SPASS, s->spass, STATE_SPASS_SIZE);
+	}
+	memcpy(record + REC_USERNAME, s->username, length);
+	_put_str(record + REC_LABEL, s->label, STATE_LABEL_SIZE);
+	_put_str(record + REC_CONTACT, s->contact, STATE_CONTACT_SIZE);
+
+	_put32(record + REC_CRC, _db_record_crc(record));
+	return 0;
+}
+
+int db_record_decode(state *s, const unsigned char *record,
+		     size_t size, char *username)
+{
+	const unsigned char *name = record + REC_USERNAME;
+
+	if (size < DB_RECORD_SIZE ||
+	    memcmp(record + REC_MAGIC, _magic, sizeof(_magic)) != 0) {
+		print(PRINT_ERROR, "State record is truncated or invalid\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (_get32(record + REC_VERSION) != DB_RECORD_VERSION) {
+		print(PRINT_ERROR,
+		      "State file version is incompatible. Recreate key.\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (_get32(record + REC_CRC) != _db_record_crc(record)) {
+		print(PRINT_ERROR, "State record is damaged (CRC mismatch)\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (memchr(name, '\0', DB_RECORD_USER_SIZE) == NULL) {
+		print(PRINT_ERROR, "State record is invalid\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (username) {
+		memcpy(username, name, DB_RECORD_USER_SIZE);
+	} else if (strcmp((const char *) name, s->username) != 0) {
+		print(PRINT_ERROR, "State record belongs to other user\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	if (_get_str(s->label, record + REC_LABEL, STATE_LABEL_SIZE) != 0 ||
+	    _get_str(s->contact, record + REC_CONTACT, STATE_CONTACT_SIZE) != 0) {
+		print(PRINT_ERROR, "Label or contact field too long\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	s->flags = _get32(record + REC_FLAGS);
+	memcpy(s->sequence_key, record + REC_KEY, sizeof(s->sequence_key));
+	s->counter.lo = _get64(record + REC_COUNTER);
+	s->counter.hi = _get64(record + REC_COUNTER + 8);
+	s->latest_card.lo = _get64(record + REC_LATEST_CARD);
+	s->latest_card.hi = _get64(record + REC_LATEST_CARD + 8);
+	s->failures = _get32(record + REC_FAILURES);
+	s->recent_failures = _get32(record + REC_RECENT_FAILURES);
+	s->channel_time = (state_time_t) _get64(record + REC_CHANNEL_TIME);
+	s->code_length = _get32(record + REC_CODE_LENGTH);
+	s->alphabet = _get32(record + REC_ALPHABET);
+
+	s->spass_set = _get32(record + REC_SPASS_SET) != 0;
+	if (s->spass_set) {
+		s->spass_time = (state_time_t) _get64(record + REC_SPASS_TIME);
+		memcpy(s->spass, record + REC_SPASS, STATE_SPASS_SIZE);
+	}
+	return 0;
+}
@@ -0,0 +1,56 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Binary state record (version 3). Fields are at fixed offsets,
+ *   integers are little-endian, key and static password are kept
+ *   as raw bytes and the record is protected by CRC-32, so it's
+ *   decoded without any parsing. Used for state files of DB=user.
+ **********************************************************************/
+
+#ifndef _DB_RECORD_H_
+#define _DB_RECORD_H_
+
+#include <stddef.h>
+#include "state.h"
+
+/** Record version; follows versions of text entries */
+#define DB_RECORD_VERSION 3
+
+/** Size of encoded record */
+#define DB_RECORD_SIZE 336
+
+/** Space for username with terminating \0 */
+#define DB_RECORD_USER_SIZE 80
+
+/** Check if data starts with a binary record. Text entries
+ * start with a username, which can't contain magic bytes. */
+extern int db_record_is_binary(const char *data, size_t size);
+
+/** Encode state into DB_RECORD_SIZE bytes of record. Returns
+ * 1 if username is too long to be stored. */
+extern int db_record_encode(const state *s, unsigned char *record);
+
+/** Decode record into state. Username stored in record is copied
+ * into username (DB_RECORD_USER_SIZE bytes) if it's given, otherwise
+ * it must match s->username. Values are not validated beyond
+ * string termination. Returns 0 on success and STATE_PARSE_ERROR
+ * if record is damaged, of different version or of other user. */
+extern int db_record_decode(state *s, const unsigned char *record,
+			    size_t size, char *username);
+
+#endif
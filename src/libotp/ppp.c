@@ -33,6 +33,7 @@
 #include "print.h"
 #include "config.h"
 #include "nls.h"
+#include "db.h"
 
 /* Number of combinations calculated for 4 passcodes */
 /* 64 characters -> 16 777 216 */
@@ -67,6 +68,74 @@ static const char *alphabets[] = {
 
 const int ppp_alphabet_count = sizeof(alphabets) / sizeof(*alphabets);
 
+/* Alphabet descriptors, filled once by _ppp_alphabets_init */
+static ppp_alphabet_t alphabet_descs[sizeof(alphabets) / sizeof(*alphabets)];
+static int alphabet_descs_ready = 0;
+
+static void _ppp_alphabets_init(void)
+{
+	const cfg_t *cfg = cfg_get();
+	const int min = cfg->alphabet_min_length;
+	const int max = cfg->alphabet_max_length;
+	int id;
+
+	for (id = 0; id < ppp_alphabet_count; id++) {
+		ppp_alphabet_t *a = &alphabet_descs[id];
+
+		a->id = id;
+		if (id == 0) {
+			/* 0 - custom */
+			a->chars = cfg->alphabet_custom;
+		} else {
+			a->chars = alphabets[id];
+		}
+		a->length = strlen(a->chars);
+
+		/* Fail also if changing is denied and this
+		 * alphabet is not default one */
+		if (cfg->alphabet_change == CONFIG_DISALLOW &&
+		    cfg->alphabet_def != id)
+			a->policy = PPP_ERROR_POLICY;
+		else if (a->length < min || a->length > max)
+			a->policy = PPP_ERROR_POLICY;
+		else
+			a->policy = 0;
+	}
+
+	alphabet_descs_ready = 1;
+}
+
+const ppp_alphabet_t *ppp_alphabet_desc(int id)
+{
+	if (id < 0 || id >= ppp_alphabet_count)
+		return NULL;
+
+	/* Normally done in ppp_init */
+	if (!alphabet_descs_ready)
+		_ppp_alphabets_init();
+
+	return &alphabet_descs[id];
+}
+
+/* Descriptor of state alphabet. Cached pointer is used unless
+ * alphabet was changed by hand after ppp_calculate. */
+static inline const ppp_alphabet_t *_ppp_state_alphabet(const state *s)
+{
+	if (s->alphabet_desc && s->alphabet_desc->id == (int)s->alphabet)
+		return s->alphabet_desc;
+	return ppp_alphabet_desc(s->alphabet);
+}
+
+/* Conversion kernel for state; like above tolerates stale cache */
+static inline const ppp_kernel_t *_ppp_state_kernel(const state *s,
+						    const ppp_alphabet_t *alphabet)
+{
+	if (s->kernel &&
+	    ppp_kernel_matches(s->kernel, alphabet->length, s->code_length))
+		return s->kernel;
+	return ppp_kernel_select(alphabet->length, s->code_length);
+}
+
 
 int ppp_init(int print_flags, const char *print_logfile)
 {
@@ -113,6 +182,17 @@ int ppp_init(int print_flags, const char *print_logfile)
 	if (retval != 0) 
 		return retval;
 
+	/* Backend not supported by this machine isn't fatal */
+	if (crypto_aes_set_backend(cfg->crypto_backend) != 0) {
+		print(PRINT_WARN, "Crypto backend '%s' is not available, "
+		      "using default one\n",
+		      crypto_aes_backend_name(cfg->crypto_backend));
+		crypto_aes_set_backend(CRYPTO_AES_AUTO);
+	}
+
+	/* Config won't change any more */
+	_ppp_alphabets_init();
+
 	/* All ok */
 	retval = 0;
 
@@ -146,38 +226,14 @@ int ppp_verify_code_length(int length)
 
 int ppp_verify_alphabet(int id)
 {
-	const cfg_t *cfg = cfg_get();
-	const int min = cfg->alphabet_min_length;
-	const int max = cfg->alphabet_max_length;
-	const char *alphabet = NULL;
+	const ppp_alphabet_t *a = ppp_alphabet_desc(id);
 
 	/* Check if it's legal */
-	if (id < 0 || id >= ppp_alphabet_count)
+	if (a == NULL)
 		return PPP_ERROR_RANGE;
 
-	/* Fail also if changing is denied and this
-	 * alphabet is not default one */
-	if  (cfg->alphabet_change == CONFIG_DISALLOW &&
-	     cfg->alphabet_def != id)
-		return PPP_ERROR_POLICY;
-
-
-	if (id == 0) {
-		/* 0 - custom */
-		alphabet = cfg->alphabet_custom;
-	} else {
-		alphabet = alphabets[id];
-	}
-
-
-	{
-		const int len = strlen(alphabet);
-		if (len<min || len>max)
-			return PPP_ERROR_POLICY;
-	}
-
-	/* OK */
-	return 0;
+	/* Policy verdict was calculated once */
+	return a->policy;
 }
 
 int ppp_verify_range(const state *s)
@@ -252,8 +308,11 @@ int ppp_state_verify(const state *s)
 	if (ppp_verify_flags(s->flags) != 0)
 		return PPP_ERROR_POLICY;
 
-	if (ppp_verify_alphabet(s->alphabet) != 0)
-		return PPP_ERROR_POLICY;
+	{
+		const ppp_alphabet_t *a = _ppp_state_alphabet(s);
+		if (a == NULL || a->policy != 0)
+			return PPP_ERROR_POLICY;
+	}
 
 	if (ppp_verify_code_length(s->code_length) != 0)
 		return PPP_ERROR_POLICY;
@@ -267,24 +326,17 @@ int ppp_state_verify(const state *s)
 
 int ppp_alphabet_get(int id, const char **alphabet)
 {
-	const cfg_t *cfg = cfg_get();
-	const int verify = ppp_verify_alphabet(id);
+	const ppp_alphabet_t *a = ppp_alphabet_desc(id);
 	assert(alphabet != NULL);
 
-	if (verify == PPP_ERROR_RANGE) {
+	if (a == NULL) {
 		*alphabet = NULL;
 		return PPP_ERROR_RANGE;
 	}
 
 	/* In range, but might be denied */
-	if (id == 0) {
-		/* 0 - custom */
-		*alphabet = cfg->alphabet_custom;
-	} else {
-		*alphabet = alphabets[id];
-	}
-
-	return verify;
+	*alphabet = a->chars;
+	return a->policy;
 }
 
 void ppp_alphabet_print(void)
@@ -332,13 +384,10 @@ int ppp_get_passcode(const state *s, const num_t counter, char *passcode)
 	unsigned char cnt_bin[16] = {'\0'};
 	unsigned char cipher_bin[16] = {'\0'};
 	num_t cipher = num_i(0);
-	num_t quotient = num_i(0);
 	num_t salted_counter = num_i(0);
-	const char *alphabet = NULL;
+	const ppp_alphabet_t *alphabet = _ppp_state_alphabet(s);
+	const ppp_kernel_t *kernel;
 	int ret;
-	int i;
-
-	const cfg_t *cfg = cfg_get();
 
 	/* Check for illegal data */
 	assert(s->code_length >= 2 && s->code_length <= 16);
@@ -346,6 +395,12 @@ int ppp_get_passcode(const state *s, const num_t counter, char *passcode)
 	if (!passcode)
 		return 2;
 
+	if (alphabet == NULL || alphabet->policy != 0) {
+		print(PRINT_ERROR, "State contains invalid alphabet\n");
+		return 1;
+	}
+	kernel = _ppp_state_kernel(s, alphabet);
+
 	/* Counter might be salted or unsalted, so make sure
 	 * we work with salted version */
 	salted_counter = counter;
@@ -354,8 +409,8 @@ int ppp_get_passcode(const state *s, const num_t counter, char *passcode)
 	/* Convert numbers to binary */
 	num_export(salted_counter, (char *)cnt_bin, NUM_FORMAT_BIN);
 
-	/* Encrypt counter with key */
-	ret = crypto_aes_encrypt(s->sequence_key, cnt_bin, cipher_bin);
+	/* Encrypt counter with key expanded during state load */
+	ret = crypto_aes_encrypt_ctx(&s->key_ctx, cnt_bin, cipher_bin);
 	if (ret != 0) {
 		goto clear;
 	}
@@ -363,35 +418,75 @@ int ppp_get_passcode(const state *s, const num_t counter, char *passcode)
 	/* Convert result back to number */
 	num_import(&cipher, (char *)cipher_bin, NUM_FORMAT_BIN);
 
-	if (ppp_verify_alphabet(s->alphabet) != 0) {
+	kernel->convert(cipher, alphabet, s->code_length, passcode);
+
+clear:
+	memset(cnt_bin, 0, sizeof(cnt_bin));
+	memset(cipher_bin, 0, sizeof(cipher_bin));
+
+	num_clear(salted_counter);
+	num_clear(cipher);
+	return ret;
+}
+
+int ppp_get_passcodes(const state *s, const num_t first_counter,
+		      const int count, char *passcodes)
+{
+	unsigned char cnt_bin[PPP_BATCH_BLOCKS * 16];
+	unsigned char cipher_bin[PPP_BATCH_BLOCKS * 16];
+	num_t counter = first_counter;
+	num_t salted_counter = num_i(0);
+	const ppp_alphabet_t *alphabet = _ppp_state_alphabet(s);
+	const ppp_kernel_t *kernel;
+	int done = 0;
+	int ret = 0;
+	int i;
+
+	const int stride = s->code_length + 1;
+
+	/* Check for illegal data */
+	assert(s->code_length >= 2 && s->code_length <= 16);
+
+	if (!passcodes || count < 0)
+		return 2;
+
+	if (alphabet == NULL || alphabet->policy != 0) {
 		print(PRINT_ERROR, "State contains invalid alphabet\n");
-		goto clear;
+		return 1;
 	}
+	kernel = _ppp_state_kernel(s, alphabet);
 
-	if (s->alphabet == 0) {
-		alphabet = cfg->alphabet_custom;
-	} else {
-		alphabet = alphabets[s->alphabet];
-	}
+	while (done < count) {
+		int blocks = count - done;
+		if (blocks > PPP_BATCH_BLOCKS)
+			blocks = PPP_BATCH_BLOCKS;
 
+		/* Salt and export whole run of counters */
+		for (i = 0; i < blocks; i++) {
+			salted_counter = counter;
+			ppp_add_salt(s, &salted_counter);
+			num_export(salted_counter, (char *)cnt_bin + 16*i,
+				   NUM_FORMAT_BIN);
+			counter = num_add_i(counter, 1);
+		}
 
-	for (i=0; i<s->code_length; i++) {
-		const int alphabet_len = strlen(alphabet);
-		unsigned long int r = num_div_i(&quotient, cipher, alphabet_len);
-		cipher = quotient;
+		ret = crypto_aes_encrypt_blocks(&s->key_ctx, cnt_bin,
+						cipher_bin, blocks);
+		if (ret != 0)
+			goto clear;
 
-		passcode[i] = alphabet[r];
-	}
+		/* Convert the run into passcodes */
+		ppp_convert_blocks(kernel, alphabet, s->code_length, cipher_bin,
+				   blocks, passcodes + done * stride, stride);
 
-	passcode[i] = '\0';
+		done += blocks;
+	}
 
 clear:
 	memset(cnt_bin, 0, sizeof(cnt_bin));
 	memset(cipher_bin, 0, sizeof(cipher_bin));
 
 	num_clear(salted_counter);
-	num_clear(quotient);
-	num_clear(cipher);
 	return ret;
 }
 
@@ -406,11 +501,57 @@ int ppp_get_current(const state *s, char *passcode)
 	return 0;
 }
 
-int ppp_authenticate(const state *s, const char *passcode)
+/* Compare passcodes in time independent of their contents */
+static int _ppp_passcode_differ(const char *a, const char *b, const int length)
+{
+	unsigned char diff = 0;
+	int i;
+
+	for (i = 0; i < length; i++)
+		diff |= a[i] ^ b[i];
+
+	return diff != 0;
+}
+
+/* Number of passcodes compared during authentication: configured
+ * lookahead limited by passcodes left on the last card */
+static int _ppp_lookahead(const state *s)
+{
+	const cfg_t *cfg = cfg_get();
+	int window = cfg->pam_lookahead;
+	num_t left;
+
+	if (window < 1)
+		window = 1;
+	if (window > PPP_LOOKAHEAD_MAX)
+		window = PPP_LOOKAHEAD_MAX;
+
+	if (s->flags & FLAG_SALTED)
+		left = num_and(s->counter, s->code_mask);
+	else
+		left = s->counter;
+
+	left = num_sub(s->max_code, left);
+	if (num_cmp(left, num_i(window)) < 0)
+		window = num_cmp(left, num_i(1)) < 0 ? 1 : (int)left.lo;
+
+	num_clear(left);
+	return window;
+}
+
+/* Compare passcode with the current one of s and, if PAM_LOOKAHEAD
+ * allows, with the following ones. Number of passcodes the matched one
+ * is ahead of the current is stored in matched. */
+static int _ppp_match(const state *s, const char *passcode, int *matched)
 {
 	int retval;
-	char current_passcode[17] = {0};
+	char candidates[PPP_LOOKAHEAD_MAX * 17];
+	int window;
+	int i;
 
+	const int stride = s->code_length + 1;
+
+	*matched = -1;
 	if (passcode == NULL)
 		return 1;
 
@@ -425,13 +566,42 @@ int ppp_authenticate(const state *s, const char *passcode)
 		return retval;
 	}
 
-	/* Read current passcode */
-	if (ppp_get_passcode(s, s->counter, current_passcode) != 0)
+	/* Length is not a secret */
+	if (strlen(passcode) != s->code_length)
+		return 3;
+
+	/* Read current passcode and the following ones at once */
+	window = _ppp_lookahead(s);
+	if (ppp_get_passcodes(s, s->counter, window, candidates) != 0) {
+		memset(candidates, 0, sizeof(candidates));
 		return 2;
+	}
 
-	/* Check if it matches */
-	if (strcmp(passcode, current_passcode) != 0)
-		return 3;
+	/* Check if any matches; all are always compared */
+	for (i = 0; i < window; i++) {
+		const int differ = _ppp_passcode_differ(passcode,
+							candidates + i * stride,
+							s->code_length);
+		if (!differ && *matched == -1)
+			*matched = i;
+	}
+	memset(candidates, 0, sizeof(candidates));
+
+	return *matched == -1 ? 3 : 0;
+}
+
+int ppp_authenticate(const state *s, const char *passcode, int *matched)
+{
+	int retval;
+
+	retval = _ppp_match(s, passcode, matched);
+	if (retval != 0)
+		return retval;
+
+	if (*matched > 0) {
+		/* User is ahead on his passcard */
+		print(PRINT_NOTICE, "Passcode matched %d codes ahead\n", *matched);
+	}
 
 	/* Success */
 	return 0;
@@ -451,6 +621,11 @@ void ppp_calculate(state *s)
 	assert(s->code_length >= 2 && s->code_length <= 16);
 	assert(num_sgn(s->counter) >= 0);
 
+	s->alphabet_desc = ppp_alphabet_desc(s->alphabet);
+	if (s->alphabet_desc)
+		s->kernel = ppp_kernel_select(s->alphabet_desc->length,
+					      s->code_length);
+
 	s->codes_in_row = ppp_get_codes_per_row(s->code_length);
 	s->codes_on_card = s->codes_in_row * ROWS_PER_CARD;
 
@@ -790,6 +965,49 @@ int ppp_is_locked(const state *s)
 		return 1;
 }
 
+/* Run maintenance function on every file of the global database */
+static int _ppp_db_maintain(int (*maintain)(const char *db))
+{
+	cfg_t *cfg = cfg_get();
+	char path[STATE_PATH_SIZE];
+	int i, ret;
+
+	assert(cfg->db == CONFIG_DB_GLOBAL);
+	if (cfg->db_shards == 0)
+		return maintain(cfg->global_db_path);
+
+	for (i = 0; i < cfg->db_shards; i++) {
+		if (db_file_shard_name(cfg->global_db_path, i, path, sizeof(path)) != 0)
+			return STATE_IO_ERROR;
+		ret = maintain(path);
+		if (ret != 0)
+			return ret;
+	}
+	return 0;
+}
+
+int ppp_db_convert(void)
+{
+	return _ppp_db_maintain(db_file_convert);
+}
+
+int ppp_db_compact(void)
+{
+	return _ppp_db_maintain(db_file_compact);
+}
+
+int ppp_db_reshard(int shards)
+{
+	cfg_t *cfg = cfg_get();
+	assert(cfg->db == CONFIG_DB_GLOBAL);
+	return db_file_reshard(cfg->global_db_path, cfg->db_shards, shards);
+}
+
+int ppp_state_convert(const char *path, int binary)
+{
+	return db_file_convert_state(path, binary);
+}
+
 int ppp_key_generate(state *s, int flags)
 {
 	int ret;
@@ -884,6 +1102,56 @@ error:
 }
 
 
+/* Lock, load, authenticate, increment, save, unlock. Passcode is
+ * known before the state is loaded, so a passcode matched ahead
+ * moves the counter within the same store as the increment. */
+int ppp_increment_authenticate(state *s, const char *passcode)
+{
+	int ret, auth, matched;
+	num_t tmp;
+	assert(s != NULL);
+
+	/* Load user state */
+	ret = ppp_state_load(s, 0);
+	if (ret != 0)
+		return ret;
+
+	/* Verify state correctness before trying anything more */
+	ret = ppp_state_verify(s);
+	if (ret != 0) {
+		goto error;
+	}
+
+	/* Do not increment anything if user is disabled */
+	if (ppp_flag_check(s, FLAG_DISABLED)) {
+		ret = PPP_ERROR_DISABLED;
+		goto error;
+	}
+
+	auth = _ppp_match(s, passcode, &matched);
+	if (auth == 0 && matched > 0)
+		print(PRINT_NOTICE, "Passcode matched %d codes ahead; "
+		      "resynchronizing counter\n", matched);
+
+	/* Current passcode is used even if authentication fails */
+	tmp = s->counter;
+	s->counter = num_add_i(s->counter, auth == 0 ? matched + 1 : 1);
+
+	/* We will return it's return value if anything failed */
+	ret = ppp_state_release(s, PPP_STORE | PPP_UNLOCK);
+
+	/* Restore current counter */
+	s->counter = tmp;
+	num_clear(tmp);
+
+	return ret != 0 ? ret : auth;
+
+error:
+	/* Unlock. And ignore unlocking errors */
+	(void) ppp_state_release(s, PPP_UNLOCK);
+	return ret;
+}
+
 int ppp_skip(state *s, const num_t skip_to)
 {
 	int ret;
@@ -965,6 +1233,52 @@ cleanup:
 	return ret;
 }
 
+int ppp_resync(const state *s, int matched)
+{
+	state *s_tmp; /* Second state. Counter of current one is the
+		       * reserved passcode, counter on disk might be further. */
+	num_t counter;
+	int ret = 1;
+
+	if (ppp_state_init(&s_tmp, s->username) != 0)
+		return 1;
+
+	/* Passcode after the matched one, salted like the state one */
+	counter = num_add_i(s->counter, matched + 1);
+
+	/* Lock&Load state from disk */
+	ret = ppp_state_load(s_tmp, 0);
+	if (ret != 0)
+		goto cleanup;
+
+	ret = ppp_state_verify(s_tmp);
+	if (ret == 0 && ppp_flag_check(s_tmp, FLAG_DISABLED))
+		ret = PPP_ERROR_DISABLED;
+	if (ret != 0) {
+		(void) ppp_state_release(s_tmp, PPP_UNLOCK);
+		goto cleanup;
+	}
+
+	/* Never move back, another session might have gone further */
+	if (num_cmp(counter, s_tmp->counter) > 0)
+		s_tmp->counter = counter;
+
+	/* Store changes and unlock */
+	ret = ppp_state_release(s_tmp, PPP_UNLOCK | PPP_STORE);
+	if (ret != 0) {
+		print(PRINT_WARN, "Unable to save resynchronized counter\n");
+		goto cleanup;
+	}
+
+	ret = 0; /* Everything ok */
+
+cleanup:
+	num_clear(counter);
+	ppp_state_fini(s_tmp);
+
+	return ret;
+}
+
 int ppp_oob_time(const state *s)
 {
 	state *s_tmp; /* Second state. We don't want to clobber current one
@@ -1080,8 +1394,8 @@ int ppp_set_int(state *s, int field, unsigned int arg, int options)
 		if (ret != 0)
 			return ret;
 
-
 		s->alphabet = arg;
+		s->alphabet_desc = ppp_alphabet_desc(arg);
 		break;
 
 	case PPP_FIELD_FLAGS:
@@ -81,6 +81,23 @@ extern int ppp_state_release(state *s, int flags);
 /** Check whether state is locked */
 extern int ppp_is_locked(const state *s);
 
+/** Rewrite global database using fixed-width records
+ * which can be updated in place. Requires DB=global. */
+extern int ppp_db_convert(void);
+
+/** Fold journal of counter updates into the global
+ * database and sort it. Requires DB=global. */
+extern int ppp_db_compact(void);
+
+/** Move entries of the global database, currently split as
+ * DB_SHARDS in config says, into given number of shards
+ * (0 - single file). Requires DB=global. */
+extern int ppp_db_reshard(int shards);
+
+/** Convert state file of DB=user at path into binary
+ * record (if binary is set) or text entry. */
+extern int ppp_state_convert(const char *path, int binary);
+
 
 /** Generate key.
  * On contrary to any other actions, state shouldn't be locked
@@ -134,6 +151,15 @@ extern int ppp_increment(state *s);
 extern int ppp_skip(state *s, const num_t skip_to);
 
 
+/** Lock & Read
+ * Move counter past the passcode 'matched' codes ahead of the
+ * counter of s, as reported by ppp_authenticate. Counter is never
+ * moved back if another session went further.
+ * Store & unlock
+ * Does not modify passed state structure.
+ */
+extern int ppp_resync(const state *s, int matched);
+
 /** Lock & Read
  * If zero = 0 then increment failure and recent_failures count.
  * If zero = 1 then clear recent_failures.
@@ -158,6 +184,18 @@ extern int ppp_oob_time(const state *s);
  */
 extern int ppp_get_passcode(const state *s, const num_t counter, char *passcode);
 
+/** Number of counters encrypted together by ppp_get_passcodes */
+#define PPP_BATCH_BLOCKS 8
+
+/** Calculate count consecutive passcodes starting at first_counter.
+ * Result is identical to calling ppp_get_passcode for each counter.
+ * Passcodes are stored one after another, each taking code_length+1
+ * bytes (including terminating NUL), so passcodes must have place for
+ * count * (code_length+1) bytes.
+ */
+extern int ppp_get_passcodes(const state *s, const num_t first_counter,
+			     const int count, char *passcodes);
+
 /** Return current passcode. Helper for ppp_get_passcode function. */
 extern int ppp_get_current(const state *s, char *passcode);
 
@@ -166,10 +204,23 @@ extern int ppp_get_current(const state *s, char *passcode);
  * In latter case ppp_calculate must have been called before */
 const char *ppp_get_prompt(state *s, int use_current, num_t counter);
 
+/** Maximal number of passcodes accepted during authentication */
+#define PPP_LOOKAHEAD_MAX 32
+
 /** Try to authenticate user; returns 0 on successful authentication.
  * Does not increment counter, just compares with password which would
- * be generated for current passcode (i.e. reserved by ppp_increment call) */
-extern int ppp_authenticate(const state *s, const char *passcode);
+ * be generated for current passcode (i.e. reserved by ppp_increment call)
+ * and, if PAM_LOOKAHEAD allows, with the following ones. Number of
+ * passcodes the matched one is ahead of the current is stored in
+ * matched; if it's not 0 caller must pass it to ppp_resync. */
+extern int ppp_authenticate(const state *s, const char *passcode, int *matched);
+
+/** ppp_increment and ppp_authenticate in a single transaction, for
+ * callers which know the passcode before the state is loaded. Counter
+ * is stored past the passcode which matched, or incremented by one if
+ * none did; counter of s is left at the one loaded. Returns 0 on
+ * successful authentication. */
+extern int ppp_increment_authenticate(state *s, const char *passcode);
 
 /** Adds a salt to given passcode if salt is used.
  * In other words: converts from user supplied passcode
@@ -185,6 +236,10 @@ extern void ppp_calculate(state *s);
 /** Print to stdout all acceptable alphabets with IDs */
 extern void ppp_alphabet_print(void);
 
+/** Get descriptor of alphabet with given ID, or NULL if ID
+ * is out of range. Descriptors are built by ppp_init. */
+extern const ppp_alphabet_t *ppp_alphabet_desc(int id);
+
 /** Get alphabet string for given ID. 
  * \return On invalid ID returns
  * PPP_ERROR_RANGE and sets alphabet to NULL. If ID is correct and alphabet 
@@ -26,11 +26,13 @@
 #define STATE_CONTACT_SIZE 60
 #define STATE_SPASS_SIZE 40 /* Hexadecimal SHA256 (64 bytes) of static password + SALT (16) */
 #define STATE_MAX_FIELD_SIZE 80
-#define STATE_ENTRY_SIZE 512 /* Maximal size of a valid state entry (single line)
+#define STATE_ENTRY_SIZE 1024 /* Maximal size of a valid state entry (single line)
 			      * 32 (username) + 64 (key) + 32 (counter) + 60 (contact)
 			      * + 64 (static) + 32 latest + 20 (failures + recent failures) +
 			      * + 32 (timestamp) + 2 (codelength) + 5 (flags)
 			      * === 343 (+ separators < 512)
+			      * Fixed-width entries are padded to 512 bytes, so
+			      * buffer must be larger.
 			      */
 
 #define ROWS_PER_CARD 10
@@ -236,5 +238,14 @@ enum {
 /* Number of available alphabets */
 extern const int ppp_alphabet_count;
 
+/** Alphabet descriptor. Built once for all alphabets
+ * (including custom one from config) and never modified. */
+typedef struct {
+	int id;			/**< Alphabet ID */
+	int length;		/**< Number of characters */
+	const char *chars;	/**< Character table */
+	int policy;		/**< 0 if allowed by policy, PPP_ERROR_POLICY otherwise */
+} ppp_alphabet_t;
+
 #endif
 
@@ -0,0 +1,436 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Passcode conversion kernels. Each specialized kernel has
+ *   alphabet length and code length fixed at compile time, so the
+ *   compiler unrolls the digit loop and replaces division by
+ *   a constant with multiplication. Power of two alphabets are
+ *   converted with shifts only.
+ **********************************************************************/
+
+#include "ppp_kernels.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PPP_HAVE_SIMD 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#else
+#define PPP_HAVE_SIMD 0
+#endif
+
+#if defined(__GNUC__)
+#define PPP_ALWAYS_INLINE __attribute__((always_inline))
+#else
+#define PPP_ALWAYS_INLINE
+#endif
+
+/* Divide number kept in four 32 bit limbs (most significant first)
+ * by d in place and return the remainder. */
+static inline PPP_ALWAYS_INLINE
+unsigned int _ppp_div_limbs(uint32_t *w, const uint32_t d)
+{
+	uint64_t r = 0;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		const uint64_t cur = (r << 32) | w[i];
+		w[i] = (uint32_t)(cur / d);
+		r = cur % d;
+	}
+	return (unsigned int)r;
+}
+
+static inline PPP_ALWAYS_INLINE
+void _ppp_convert_div(const num_t cipher, const char *chars,
+		      const uint32_t d, const int length, char *passcode)
+{
+	uint32_t w[4] = {
+		(uint32_t)(cipher.hi >> 32), (uint32_t)cipher.hi,
+		(uint32_t)(cipher.lo >> 32), (uint32_t)cipher.lo,
+	};
+	int i;
+
+	for (i = 0; i < length; i++)
+		passcode[i] = chars[_ppp_div_limbs(w, d)];
+	passcode[length] = '\0';
+
+	w[0] = w[1] = w[2] = w[3] = 0;
+}
+
+/* Alphabet of 2^bits characters: digits are consecutive bit groups */
+static inline PPP_ALWAYS_INLINE
+void _ppp_convert_shift(const num_t cipher, const char *chars,
+			const int bits, const int length, char *passcode)
+{
+	const uint64_t mask = (1ULL << bits) - 1;
+	int i;
+
+	for (i = 0; i < length; i++) {
+		const int shift = i * bits;
+		uint64_t v;
+
+		if (shift >= 64)
+			v = cipher.hi >> (shift - 64);
+		else if (shift + bits <= 64)
+			v = cipher.lo >> shift;
+		else
+			v = (cipher.lo >> shift) | (cipher.hi << (64 - shift));
+
+		passcode[i] = chars[v & mask];
+	}
+	passcode[length] = '\0';
+}
+
+static void _ppp_convert_generic(const num_t cipher,
+				 const ppp_alphabet_t *alphabet,
+				 int code_length,
+				 char *passcode)
+{
+	num_t value = cipher;
+	int i;
+
+	for (i = 0; i < code_length; i++) {
+		const uint64_t r = num_div_i(&value, value, alphabet->length);
+		passcode[i] = alphabet->chars[r];
+	}
+	passcode[i] = '\0';
+
+	num_clear(value);
+}
+
+const ppp_kernel_t ppp_kernel_generic = { 0, 0, _ppp_convert_generic };
+
+/***
+ * Kernel generation
+ ***/
+#define _PPP_DIV_KERNEL(D, L)						\
+static void _ppp_kernel_##D##_##L(const num_t cipher,			\
+				  const ppp_alphabet_t *alphabet,	\
+				  int code_length, char *passcode)	\
+{									\
+	_ppp_convert_div(cipher, alphabet->chars, D, L, passcode);	\
+}
+
+#define _PPP_SHIFT_KERNEL(D, BITS, L)					\
+static void _ppp_kernel_##D##_##L(const num_t cipher,			\
+				  const ppp_alphabet_t *alphabet,	\
+				  int code_length, char *passcode)	\
+{									\
+	_ppp_convert_shift(cipher, alphabet->chars, BITS, L, passcode);	\
+}
+
+#define _PPP_DIV_KERNELS(D)						\
+	_PPP_DIV_KERNEL(D, 2)  _PPP_DIV_KERNEL(D, 3)			\
+	_PPP_DIV_KERNEL(D, 4)  _PPP_DIV_KERNEL(D, 5)			\
+	_PPP_DIV_KERNEL(D, 6)  _PPP_DIV_KERNEL(D, 7)			\
+	_PPP_DIV_KERNEL(D, 8)  _PPP_DIV_KERNEL(D, 9)			\
+	_PPP_DIV_KERNEL(D, 10) _PPP_DIV_KERNEL(D, 11)			\
+	_PPP_DIV_KERNEL(D, 12) _PPP_DIV_KERNEL(D, 13)			\
+	_PPP_DIV_KERNEL(D, 14) _PPP_DIV_KERNEL(D, 15)			\
+	_PPP_DIV_KERNEL(D, 16)
+
+#define _PPP_SHIFT_KERNELS(D, BITS)					\
+	_PPP_SHIFT_KERNEL(D, BITS, 2)  _PPP_SHIFT_KERNEL(D, BITS, 3)	\
+	_PPP_SHIFT_KERNEL(D, BITS, 4)  _PPP_SHIFT_KERNEL(D, BITS, 5)	\
+	_PPP_SHIFT_KERNEL(D, BITS, 6)  _PPP_SHIFT_KERNEL(D, BITS, 7)	\
+	_PPP_SHIFT_KERNEL(D, BITS, 8)  _PPP_SHIFT_KERNEL(D, BITS, 9)	\
+	_PPP_SHIFT_KERNEL(D, BITS, 10) _PPP_SHIFT_KERNEL(D, BITS, 11)	\
+	_PPP_SHIFT_KERNEL(D, BITS, 12) _PPP_SHIFT_KERNEL(D, BITS, 13)	\
+	_PPP_SHIFT_KERNEL(D, BITS, 14) _PPP_SHIFT_KERNEL(D, BITS, 15)	\
+	_PPP_SHIFT_KERNEL(D, BITS, 16)
+
+#define _PPP_KERNEL_ENTRY(D, L) { D, L, _ppp_kernel_##D##_##L }
+
+#define _PPP_KERNEL_ENTRIES(D)						\
+	_PPP_KERNEL_ENTRY(D, 2),  _PPP_KERNEL_ENTRY(D, 3),		\
+	_PPP_KERNEL_ENTRY(D, 4),  _PPP_KERNEL_ENTRY(D, 5),		\
+	_PPP_KERNEL_ENTRY(D, 6),  _PPP_KERNEL_ENTRY(D, 7),		\
+	_PPP_KERNEL_ENTRY(D, 8),  _PPP_KERNEL_ENTRY(D, 9),		\
+	_PPP_KERNEL_ENTRY(D, 10), _PPP_KERNEL_ENTRY(D, 11),		\
+	_PPP_KERNEL_ENTRY(D, 12), _PPP_KERNEL_ENTRY(D, 13),		\
+	_PPP_KERNEL_ENTRY(D, 14), _PPP_KERNEL_ENTRY(D, 15),		\
+	_PPP_KERNEL_ENTRY(D, 16)
+
+/* Lengths of built-in alphabets */
+_PPP_SHIFT_KERNELS(64, 6)
+_PPP_DIV_KERNELS(54)
+_PPP_DIV_KERNELS(56)
+_PPP_DIV_KERNELS(78)
+_PPP_DIV_KERNELS(88)
+
+const ppp_kernel_t ppp_kernels[] = {
+	_PPP_KERNEL_ENTRIES(64),
+	_PPP_KERNEL_ENTRIES(54),
+	_PPP_KERNEL_ENTRIES(56),
+	_PPP_KERNEL_ENTRIES(78),
+	_PPP_KERNEL_ENTRIES(88),
+};
+
+const int ppp_kernel_count = sizeof(ppp_kernels) / sizeof(*ppp_kernels);
+
+const ppp_kernel_t *ppp_kernel_select(int alphabet_length, int code_length)
+{
+	int i;
+
+	for (i = 0; i < ppp_kernel_count; i++) {
+		if (ppp_kernels[i].alphabet_length == alphabet_length &&
+		    ppp_kernels[i].code_length == code_length)
+			return &ppp_kernels[i];
+	}
+
+	return &ppp_kernel_generic;
+}
+
+
+/***
+ * Batch conversion
+ *
+ * Vector kernels convert four blocks at once. Each block is split
+ * into eight 16 bit limbs held in 64 bit lanes, so every long
+ * division step is cur = (r << 16) | limb with cur < d * 2^16.
+ * Such cur is divided exactly by multiplying with m = ceil(2^k / d),
+ * k = 16 + 2*bits(d), which fits in 32x32->64 bit multiplication.
+ * Works for any alphabet of up to 256 characters.
+ ***/
+
+/* Number of blocks converted together by vector kernels */
+#define PPP_SIMD_LANES 4
+
+static int simd_level = -1;
+
+int ppp_simd_available(void)
+{
+#if PPP_HAVE_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return PPP_SIMD_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return PPP_SIMD_SSE2;
+#endif
+	return PPP_SIMD_NONE;
+}
+
+int ppp_simd_set(int level)
+{
+	if (level < PPP_SIMD_NONE || level > ppp_simd_available())
+		return 1;
+	simd_level = level;
+	return 0;
+}
+
+#if PPP_HAVE_SIMD
+
+/* Specialized scalar kernels are faster for short codes; vector
+ * kernels are used for them only if there's no specialized one. */
+static const int simd_min_length[] = { 0, 10, 8 };
+
+/* Parameters of division by alphabet length */
+typedef struct {
+	uint64_t d;
+	uint64_t m;
+	int k;
+} _ppp_divisor;
+
+static void _ppp_divisor_init(_ppp_divisor *div, const unsigned int d)
+{
+	int bits = 0;
+
+	assert(d >= 2 && d <= 256);
+	while ((1U << bits) < d)
+		bits++;
+
+	div->d = d;
+	div->k = 16 + 2 * bits;
+	div->m = ((1ULL << div->k) + d - 1) / d;
+}
+
+/* Split blocks into limbs; limb[i][b] is i-th 16 bit limb
+ * (most significant first) of block b */
+static void _ppp_split_limbs(const unsigned char *cipher_bin,
+			     uint64_t limb[8][PPP_SIMD_LANES])
+{
+	int b, i;
+
+	for (b = 0; b < PPP_SIMD_LANES; b++) {
+		num_t c;
+		num_import(&c, (const char *)cipher_bin + 16*b, NUM_FORMAT_BIN);
+		for (i = 0; i < 4; i++) {
+			limb[i][b] = (c.hi >> (48 - 16*i)) & 0xFFFF;
+			limb[i + 4][b] = (c.lo >> (48 - 16*i)) & 0xFFFF;
+		}
+		num_clear(c);
+	}
+}
+
+__attribute__((target("avx2")))
+static void _ppp_convert4_avx2(const _ppp_divisor *div,
+			       const char *chars, int code_length,
+			       const unsigned char *cipher_bin,
+			       char **out)
+{
+	const __m256i vm = _mm256_set1_epi64x(div->m);
+	const __m256i vd = _mm256_set1_epi64x(div->d);
+	const __m128i vk = _mm_cvtsi32_si128(div->k);
+	uint64_t limb[8][PPP_SIMD_LANES];
+	uint64_t rem[PPP_SIMD_LANES];
+	__m256i w[8];
+	int start = 0;
+	int i, b, digit;
+
+	_ppp_split_limbs(cipher_bin, limb);
+	for (i = 0; i < 8; i++)
+		w[i] = _mm256_loadu_si256((const __m256i *)limb[i]);
+
+	for (digit = 0; digit < code_length; digit++) {
+		__m256i r = _mm256_setzero_si256();
+
+		/* Leading limbs which are zero in all blocks can be skipped */
+		while (start < 8 && _mm256_testz_si256(w[start], w[start]))
+			start++;
+
+		for (i = start; i < 8; i++) {
+			const __m256i cur =
+				_mm256_or_si256(_mm256_slli_epi64(r, 16), w[i]);
+			const __m256i q =
+				_mm256_srl_epi64(_mm256_mul_epu32(cur, vm), vk);
+			r = _mm256_sub_epi64(cur, _mm256_mul_epu32(q, vd));
+			w[i] = q;
+		}
+
+		_mm256_storeu_si256((__m256i *)rem, r);
+		for (b = 0; b < PPP_SIMD_LANES; b++)
+			out[b][digit] = chars[rem[b]];
+	}
+
+	for (b = 0; b < PPP_SIMD_LANES; b++)
+		out[b][code_length] = '\0';
+
+	for (i = 0; i < 8; i++)
+		w[i] = _mm256_setzero_si256();
+	memset(limb, 0, sizeof(limb));
+	memset(rem, 0, sizeof(rem));
+}
+
+/* Same as above with two lanes per register */
+__attribute__((target("sse2")))
+static void _ppp_convert4_sse2(const _ppp_divisor *div,
+			       const char *chars, int code_length,
+			       const unsigned char *cipher_bin,
+			       char **out)
+{
+	const __m128i vm = _mm_set1_epi64x(div->m);
+	const __m128i vd = _mm_set1_epi64x(div->d);
+	const __m128i vk = _mm_cvtsi32_si128(div->k);
+	const __m128i zero = _mm_setzero_si128();
+	uint64_t limb[8][PPP_SIMD_LANES];
+	uint64_t rem[PPP_SIMD_LANES];
+	__m128i w0[8], w1[8];
+	int start = 0;
+	int i, b, digit;
+
+	_ppp_split_limbs(cipher_bin, limb);
+	for (i = 0; i < 8; i++) {
+		w0[i] = _mm_loadu_si128((const __m128i *)limb[i]);
+		w1[i] = _mm_loadu_si128((const __m128i *)(limb[i] + 2));
+	}
+
+	for (digit = 0; digit < code_length; digit++) {
+		__m128i r0 = zero, r1 = zero;
+
+		while (start < 8) {
+			const __m128i any = _mm_or_si128(w0[start], w1[start]);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(any, zero)) != 0xFFFF)
+				break;
+			start++;
+		}
+
+		for (i = start; i < 8; i++) {
+			const __m128i cur0 = _mm_or_si128(_mm_slli_epi64(r0, 16), w0[i]);
+			const __m128i cur1 = _mm_or_si128(_mm_slli_epi64(r1, 16), w1[i]);
+			const __m128i q0 = _mm_srl_epi64(_mm_mul_epu32(cur0, vm), vk);
+			const __m128i q1 = _mm_srl_epi64(_mm_mul_epu32(cur1, vm), vk);
+			r0 = _mm_sub_epi64(cur0, _mm_mul_epu32(q0, vd));
+			r1 = _mm_sub_epi64(cur1, _mm_mul_epu32(q1, vd));
+			w0[i] = q0;
+			w1[i] = q1;
+		}
+
+		_mm_storeu_si128((__m128i *)rem, r0);
+		_mm_storeu_si128((__m128i *)(rem + 2), r1);
+		for (b = 0; b < PPP_SIMD_LANES; b++)
+			out[b][digit] = chars[rem[b]];
+	}
+
+	for (b = 0; b < PPP_SIMD_LANES; b++)
+		out[b][code_length] = '\0';
+
+	for (i = 0; i < 8; i++)
+		w0[i] = w1[i] = zero;
+	memset(limb, 0, sizeof(limb));
+	memset(rem, 0, sizeof(rem));
+}
+
+#endif /* PPP_HAVE_SIMD */
+
+void ppp_convert_blocks(const ppp_kernel_t *kernel,
+			const ppp_alphabet_t *alphabet,
+			int code_length,
+			const unsigned char *cipher_bin,
+			int count,
+			char *passcodes,
+			int stride)
+{
+	num_t cipher;
+	int i = 0;
+
+#if PPP_HAVE_SIMD
+	const unsigned int d = alphabet->length;
+
+	if (simd_level == -1)
+		simd_level = ppp_simd_available();
+
+	/* Power of two alphabets are converted with shifts anyway */
+	if (simd_level != PPP_SIMD_NONE && d <= 256 && (d & (d - 1)) != 0 &&
+	    (kernel->alphabet_length == 0 ||
+	     code_length >= simd_min_length[simd_level])) {
+		_ppp_divisor div;
+		_ppp_divisor_init(&div, d);
+
+		for (; i + PPP_SIMD_LANES <= count; i += PPP_SIMD_LANES) {
+			char *out[PPP_SIMD_LANES];
+			int b;
+			for (b = 0; b < PPP_SIMD_LANES; b++)
+				out[b] = passcodes + (i + b) * stride;
+
+			if (simd_level == PPP_SIMD_AVX2)
+				_ppp_convert4_avx2(&div, alphabet->chars, code_length,
+						   cipher_bin + 16*i, out);
+			else
+				_ppp_convert4_sse2(&div, alphabet->chars, code_length,
+						   cipher_bin + 16*i, out);
+		}
+	}
+#endif
+
+	/* Remaining blocks */
+	for (; i < count; i++) {
+		num_import(&cipher, (const char *)cipher_bin + 16*i, NUM_FORMAT_BIN);
+		kernel->convert(cipher, alphabet, code_length, passcodes + i * stride);
+	}
+	num_clear(cipher);
+}
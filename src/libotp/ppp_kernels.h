@@ -0,0 +1,89 @@
+/**********************************************************************
+ * otpasswd -- One-time password manager and PAM module.
+ * Copyright (C) 2009-2013 by Tomasz bla Fortuna <bla@thera.be>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with otpasswd. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * DESC:
+ *   Conversion of encrypted counter into passcode characters.
+ *   Specialized kernels exist for built-in alphabet lengths and
+ *   every code length; others use the generic division loop.
+ **********************************************************************/
+
+#ifndef _PPP_KERNELS_H_
+#define _PPP_KERNELS_H_
+
+#include "ppp_common.h"
+#include "num.h"
+
+/** Write code_length characters of cipher in base alphabet->length,
+ * least significant digit first, followed by '\0'. */
+typedef void (*ppp_convert_fn)(const num_t cipher,
+			       const ppp_alphabet_t *alphabet,
+			       int code_length,
+			       char *passcode);
+
+typedef struct {
+	int alphabet_length;	/**< 0 - generic kernel, any alphabet */
+	int code_length;	/**< 0 - generic kernel, any length */
+	ppp_convert_fn convert;
+} ppp_kernel_t;
+
+/** Select kernel for alphabet and code length. Never returns NULL. */
+extern const ppp_kernel_t *ppp_kernel_select(int alphabet_length, int code_length);
+
+/** Generic kernel; reference for specialized ones */
+extern const ppp_kernel_t ppp_kernel_generic;
+
+/** Check if kernel may be used for given parameters */
+static inline int ppp_kernel_matches(const ppp_kernel_t *k,
+				     int alphabet_length, int code_length)
+{
+	if (k->alphabet_length == 0)
+		return 1;
+	return k->alphabet_length == alphabet_length &&
+		k->code_length == code_length;
+}
+
+/** Vector instruction sets usable for batch conversion */
+enum ppp_simd_level {
+	PPP_SIMD_NONE = 0,
+	PPP_SIMD_SSE2 = 1,
+	PPP_SIMD_AVX2 = 2,
+};
+
+/** Best instruction set supported by this CPU */
+extern int ppp_simd_available(void);
+
+/** Limit batch conversion to given instruction set (for testcases
+ * and benchmarks). Returns 1 if CPU doesn't support it. */
+extern int ppp_simd_set(int level);
+
+/** Convert count AES output blocks (16 bytes each) into passcodes.
+ * Passcode i is written at passcodes + i*stride. Uses vector
+ * instructions to convert several blocks at once when possible;
+ * result is identical to calling kernel->convert for each block. */
+extern void ppp_convert_blocks(const ppp_kernel_t *kernel,
+			       const ppp_alphabet_t *alphabet,
+			       int code_length,
+			       const unsigned char *cipher_bin,
+			       int count,
+			       char *passcodes,
+			       int stride);
+
+/** Table of specialized kernels, for testcases */
+extern const ppp_kernel_t ppp_kernels[];
+extern const int ppp_kernel_count;
+
+#endif
@@ -92,10 +92,16 @@ int state_init(state *s, const char *username)
 	s->channel_time = 0;
 	s->lock = -1;
 	s->new_key = 0;
+	s->db_hash = 0;
+	s->db_counter_hash = 0;
+	s->db_counter = num_i(0);
+	s->db_key_hash = 0;
 
 	s->prompt = NULL;
 
 	memset(s->sequence_key, 0, sizeof(s->sequence_key));
+	memset(&s->key_ctx, 0, sizeof(s->key_ctx));
+	state_key_update(s);
 	memset(s->label, 0, sizeof(s->label));
 	memset(s->contact, 0, sizeof(s->contact));
 
@@ -107,6 +113,8 @@ int state_init(state *s, const char *username)
 		s->flags |= FLAG_SALTED;
 	
 	s->alphabet = cfg->alphabet_def;
+	s->alphabet_desc = ppp_alphabet_desc(s->alphabet);
+	s->kernel = NULL;
 
 	/* This will be calculated later by ppp.c */
 	s->codes_on_card = s->codes_in_row = s->current_row =
@@ -130,6 +138,28 @@ int state_init(state *s, const char *username)
 		ret = num_import(&s->code_mask, code_mask, NUM_FORMAT_HEX);
 		assert(ret == 0);
 	}
+
+	/* Locate database once. Failure is reported when
+	 * the database is accessed. */
+	s->db_permissions = -1;
+	s->location.status = STATE_NOMEM;
+	if (s->username == NULL)
+		return 0;
+
+	switch (cfg->db) {
+	case CONFIG_DB_USER:
+	case CONFIG_DB_GLOBAL:
+		(void) db_file_locate(s);
+		break;
+
+	case CONFIG_DB_BTREE:
+		(void) db_btree_locate(s);
+		break;
+
+	default:
+		s->location.status = STATE_IO_ERROR;
+		break;
+	}
 	return 0;
 }
 
@@ -154,6 +184,8 @@ void state_fini(state *s)
 	}
 	free(s->username);
 
+	crypto_aes_clear(&s->key_ctx);
+
 	/* Clear the rest of memory, this includes sequence_key */
 	memset(s, 0, sizeof(*s));
 }
@@ -212,10 +244,22 @@ int state_key_generate(state *s)
 		s->flags |= FLAG_SALTED;
 	}
 
+	if (state_key_update(s) != 0) {
+		print(PRINT_ERROR, "Unable to expand generated key\n");
+		return 1;
+	}
+
 	s->new_key = 1;
 	return 0;
 }
 
+int state_key_update(state *s)
+{
+	/* Context is set up by state_init; later updates, like the one
+	 * while loading state, only replace the key */
+	return crypto_aes_rekey(&s->key_ctx, s->sequence_key);
+}
+
 
 int state_lock(state *s)
 {
@@ -226,6 +270,9 @@ int state_lock(state *s)
 	case CONFIG_DB_GLOBAL:
 		return db_file_lock(s);
 
+	case CONFIG_DB_BTREE:
+		return db_btree_lock(s);
+
 /*
 	case CONFIG_DB_MYSQL:
 		return db_mysql_lock(s);
@@ -247,6 +294,9 @@ int state_unlock(state *s)
 	case CONFIG_DB_GLOBAL:
 		return db_file_unlock(s);
 
+	case CONFIG_DB_BTREE:
+		return db_btree_unlock(s);
+
 /*
 	case CONFIG_DB_MYSQL:
 		return db_mysql_unlock(s);
@@ -263,23 +313,44 @@ int state_unlock(state *s)
 int state_load(state *s)
 {
 	cfg_t *cfg = cfg_get();
+	int ret;
 
 	switch (cfg->db) {
 	case CONFIG_DB_USER:
 	case CONFIG_DB_GLOBAL:
-		return db_file_load(s);
+		ret = db_file_load(s);
+		break;
+
+	case CONFIG_DB_BTREE:
+		ret = db_btree_load(s);
+		break;
 
 /*
 	case CONFIG_DB_MYSQL:
-		return db_mysql_load(s);
+		ret = db_mysql_load(s);
+		break;
 
 	case CONFIG_DB_LDAP:
-		return db_ldap_load(s);
+		ret = db_ldap_load(s);
+		break;
 */
 	default:
 		assert(0);
 		return 1;
 	}
+
+	if (ret != 0)
+		return ret;
+
+	/* Key is used for every passcode; expand it once */
+	if (state_key_update(s) != 0) {
+		print(PRINT_ERROR, "Unable to expand sequence key\n");
+		return STATE_PARSE_ERROR;
+	}
+
+	/* NULL if out of range; caught by ppp_state_verify */
+	s->alphabet_desc = ppp_alphabet_desc(s->alphabet);
+	return 0;
 }
 
 
@@ -320,6 +391,10 @@ int state_store(state *s, int remove)
 		ret = db_file_store(s, remove);
 		break;
 
+	case CONFIG_DB_BTREE:
+		ret = db_btree_store(s, remove);
+		break;
+
 /*
 	case CONFIG_DB_MYSQL:
 		ret = db_mysql_store(s, remove);
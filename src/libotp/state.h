@@ -26,14 +26,35 @@
 
 
 #include <inttypes.h>
+#include <sys/types.h>
 #include "ppp_common.h"
 #include "num.h"
+#include "crypto.h"
+#include "ppp_kernels.h"
 
 /*** Config ***/
 #define STATE_FILENAME ".otpasswd"
 
 typedef intmax_t state_time_t;
 
+/** Location of state database of a user */
+#define STATE_PATH_SIZE 512
+typedef struct {
+	/** 0 if located, error of locating otherwise */
+	int status;
+
+	/** Database, lock and temporary file */
+	char db[STATE_PATH_SIZE];
+	char lck[STATE_PATH_SIZE + 4];
+	char tmp[STATE_PATH_SIZE + 4];
+
+	/** HOME, UID and GID of the user for DB=user.
+	 * Empty and -1 otherwise. */
+	char home[STATE_PATH_SIZE];
+	uid_t uid;
+	gid_t gid;
+} state_location;
+
 /*** State ***/
 typedef struct {
 	/** 128 bit counter pointing at the next passcode
@@ -82,6 +103,19 @@ typedef struct {
 	/*** Temporary / not-saved data ***/
 	char *prompt; /**< Keep it here so we can safely dispose of it */
 
+	/** Descriptor of selected alphabet. Set by state_init,
+	 * state_load and ppp_calculate. */
+	const ppp_alphabet_t *alphabet_desc;
+
+	/** Passcode conversion kernel for current alphabet
+	 * and code length. Selected by ppp_calculate. */
+	const ppp_kernel_t *kernel;
+
+	/** Sequence key expanded for AES. Rebuilt by state_init,
+	 * state_load and state_key_generate; after changing
+	 * sequence_key by hand call state_key_update. */
+	crypto_aes_ctx key_ctx;
+
 	/** Salt helpers. Initialized in state_init.
 	 * counter & salt_mask = salt
 	 * counter & code_mask = user passcode number
@@ -119,6 +153,31 @@ typedef struct {
 	 * entry without previously locking it before reading as the counter 
 	 * value will be overwritten nevertheless. */
 	int new_key;
+
+	/** Hash of state fields which can't be journaled, as read by
+	 * db_file_load. Store may append only counter and failures to
+	 * the journal while it still matches. 0 - not loaded. */
+	uint64_t db_hash;
+
+	/** Hash of all fields but the counter, and the counter stored
+	 * in database (end of lease with counter leasing), as read by
+	 * db_file_load. */
+	uint64_t db_counter_hash;
+	num_t db_counter;
+
+	/** Hash of sequence key and flags, as read by db_file_load.
+	 * Lease of counter belongs to the key it was taken for. */
+	uint64_t db_key_hash;
+
+	/** Database location, determined once by state_init;
+	 * for DB=user it requires a passwd lookup, which might
+	 * need to query a remote directory service. */
+	state_location location;
+
+	/** Result of database permission check, done once per
+	 * operation and kept until the lock is released.
+	 * -1 - not checked. */
+	int db_permissions;
 } state;
 
 
@@ -136,6 +195,9 @@ extern void state_fini(state *s);
 /** Generate new key */
 extern int state_key_generate(state *s);
 
+/** Rebuild cached AES key schedule after sequence_key change */
+extern int state_key_update(state *s);
+
 /** Validate contact / label data */
 extern int state_validate_str(const char *str);
 
@@ -67,6 +67,7 @@ PAM_EXTERN int pam_sm_authenticate(
 	int first_try = 1;
 	int dont_increment = 0; /* Do not increment if previous prompt was for OOB */
 	int tries;
+	int matched; /* Passcodes skipped ahead of the prompted one */
 
 	/* Perform initialization:
 	 * parse options, start logging, initialize state,
@@ -198,10 +199,19 @@ PAM_EXTERN int pam_sm_authenticate(
 		/* Count this try */
 		tries++;
 
-		if (ppp_authenticate(s, resp[0].resp) == 0) {
+		if (ppp_authenticate(s, resp[0].resp, &matched) == 0) {
 			/* Authenticated */
 			ph_drop_response(resp);
 
+			/* Passcode ahead of the prompted one was used;
+			 * move counter past it so it can't be used again */
+			if (matched > 0 && ppp_resync(s, matched) != 0) {
+				print(PRINT_ERROR, "unable to store resynchronized "
+				      "counter; user=%s\n", username);
+				retval = PAM_AUTH_ERR;
+				goto cleanup;
+			}
+
 			/* Correctly authenticated */
 			retval = PAM_SUCCESS;
 